@@ -4,12 +4,16 @@
       'variables': {
         'GTK_Root%': 'C:/GTK', # Set the location of GTK all-in-one bundle
         'with_jpeg%': 'false',
-        'with_gif%': 'false'
+        'with_gif%': 'false',
+        'with_webp%': 'false',
+        'with_libdeflate%': 'false'
       }
     }, { # 'OS!="win"'
       'variables': {
         'with_jpeg%': '<!(./util/has_lib.sh jpeg)',
-        'with_gif%': '<!(./util/has_lib.sh gif)'
+        'with_gif%': '<!(./util/has_lib.sh gif)',
+        'with_webp%': '<!(./util/has_lib.sh webp)',
+        'with_libdeflate%': '<!(./util/has_lib.sh libdeflate)'
       }
     }]
   ],
@@ -46,14 +50,22 @@
       'target_name': 'canvas',
       'include_dirs': ["<!(node -e \"require('nan')\")"],
       'sources': [
+        'src/AnimationEncoder.cc',
         'src/Canvas.cc',
         'src/CanvasGradient.cc',
         'src/CanvasPattern.cc',
         'src/CanvasRenderingContext2d.cc',
         'src/color.cc',
+        'src/document.cc',
         'src/Image.cc',
         'src/ImageData.cc',
+        'src/ImageEncoder.cc',
+        'src/pixel_convert.cc',
+        'src/png_tuning.cc',
+        'src/quantize.cc',
         'src/register_font.cc',
+        'src/scale.cc',
+        'src/work_pool.cc',
         'src/init.cc'
       ],
       'conditions': [
@@ -144,6 +156,38 @@
               ]
             }]
           ]
+        }],
+        ['with_webp=="true"', {
+          'defines': [
+            'HAVE_WEBP'
+          ],
+          'conditions': [
+            ['OS=="win"', {
+              'libraries': [
+                '-l<(GTK_Root)/lib/libwebp.lib'
+              ]
+            }, {
+              'libraries': [
+                '-lwebp'
+              ]
+            }]
+          ]
+        }],
+        ['with_libdeflate=="true"', {
+          'defines': [
+            'HAVE_LIBDEFLATE'
+          ],
+          'conditions': [
+            ['OS=="win"', {
+              'libraries': [
+                '-l<(GTK_Root)/lib/deflate.lib'
+              ]
+            }, {
+              'libraries': [
+                '-ldeflate'
+              ]
+            }]
+          ]
         }]
       ]
     }
@@ -18,6 +18,8 @@ var canvas = require('./bindings')
   , PNGStream = require('./pngstream')
   , PDFStream = require('./pdfstream')
   , JPEGStream = require('./jpegstream')
+  , WebPStream = require('./webpstream')
+  , ImageStream = require('./imagestream')
   , fs = require('fs')
   , packageJson = require("../package.json")
   , FORMATS = ['image/png', 'image/jpeg'];
@@ -48,6 +50,15 @@ if (canvas.jpegVersion) {
   exports.jpegVersion = canvas.jpegVersion;
 }
 
+/**
+ * libwebp version.
+ */
+
+if (canvas.webpVersion) {
+  exports.webpVersion = canvas.webpVersion;
+  FORMATS.push('image/webp');
+}
+
 /**
  * gif_lib version.
  */
@@ -72,8 +83,11 @@ exports.Context2d = Context2d;
 exports.PNGStream = PNGStream;
 exports.PDFStream = PDFStream;
 exports.JPEGStream = JPEGStream;
+exports.WebPStream = WebPStream;
+exports.ImageStream = ImageStream;
 exports.Image = Image;
 exports.ImageData = canvas.ImageData;
+exports.AnimationEncoder = canvas.AnimationEncoder;
 
 /**
  * Resolve paths for registerFont
@@ -126,37 +140,41 @@ Canvas.prototype.getContext = function(contextId){
 /**
  * Create a `PNGStream` for `this` canvas.
  *
+ * @param {Object} options
  * @return {PNGStream}
  * @api public
  */
 
 Canvas.prototype.pngStream =
-Canvas.prototype.createPNGStream = function(){
-  return new PNGStream(this);
+Canvas.prototype.createPNGStream = function(options){
+  return new PNGStream(this, false, options);
 };
 
 /**
  * Create a synchronous `PNGStream` for `this` canvas.
  *
+ * @param {Object} options
  * @return {PNGStream}
  * @api public
  */
 
 Canvas.prototype.syncPNGStream =
-Canvas.prototype.createSyncPNGStream = function(){
-  return new PNGStream(this, true);
+Canvas.prototype.createSyncPNGStream = function(options){
+  return new PNGStream(this, true, options);
 };
 
 /**
- * Create a `PDFStream` for `this` canvas.
+ * Create a `PDFStream` for `this` canvas. With `options.incremental`
+ * pages are streamed as they are added, until `canvas.finishPDF()`.
  *
+ * @param {Object} options
  * @return {PDFStream}
  * @api public
  */
 
 Canvas.prototype.pdfStream =
-Canvas.prototype.createPDFStream = function(){
-  return new PDFStream(this);
+Canvas.prototype.createPDFStream = function(options){
+  return new PDFStream(this, false, options);
 };
 
 /**
@@ -181,7 +199,7 @@ Canvas.prototype.createSyncPDFStream = function(){
 
 Canvas.prototype.jpegStream =
 Canvas.prototype.createJPEGStream = function(options){
-  return this.createSyncJPEGStream(options);
+  return new JPEGStream(this, jpegStreamOptions(this, options));
 };
 
 /**
@@ -194,23 +212,54 @@ Canvas.prototype.createJPEGStream = function(options){
 
 Canvas.prototype.syncJPEGStream =
 Canvas.prototype.createSyncJPEGStream = function(options){
+  return new JPEGStream(this, jpegStreamOptions(this, options), true);
+};
+
+/**
+ * Fill in the defaults of JPEG stream `options` for `canvas`.
+ *
+ * @param {Canvas} canvas
+ * @param {Object} options
+ * @return {Object}
+ * @api private
+ */
+
+function jpegStreamOptions(canvas, options) {
   options = options || {};
   // Don't allow the buffer size to exceed the size of the canvas (#674)
-  var maxBufSize = this.width * this.height * 4;
+  var maxBufSize = canvas.width * canvas.height * 4;
   var clampedBufSize = Math.min(options.bufsize || 4096, maxBufSize);
-  return new JPEGStream(this, {
+  return {
       bufsize: clampedBufSize
     , quality: options.quality || 75
     , progressive: options.progressive || false
-  });
+    , chromaSubsampling: options.chromaSubsampling
+    , optimizeCoding: options.optimizeCoding
+    , dctMethod: options.dctMethod
+    , restartInterval: options.restartInterval
+  };
+}
+
+/**
+ * Create a `WebPStream` for `this` canvas. Encoding happens
+ * on the thread pool.
+ *
+ * @param {Object} options
+ * @return {WebPStream}
+ * @api public
+ */
+
+Canvas.prototype.webpStream =
+Canvas.prototype.createWebPStream = function(options){
+  return new WebPStream(this, options || {});
 };
 
 /**
- * Return a data url. Pass a function for async support (required for "image/jpeg").
+ * Return a data url. Pass a function for async support (required for "image/jpeg" and "image/webp").
  *
- * @param {String} type, optional, one of "image/png" or "image/jpeg", defaults to "image/png"
+ * @param {String} type, optional, one of "image/png", "image/jpeg" or "image/webp" (when built with libwebp), defaults to "image/png"
  * @param {Object|Number} encoderOptions, optional, options for jpeg compression (see documentation for Canvas#jpegStream) or the JPEG encoding quality from 0 to 1.
- * @param {Function} fn, optional, callback for asynchronous operation. Required for type "image/jpeg".
+ * @param {Function} fn, optional, callback for asynchronous operation. Required for types "image/jpeg" and "image/webp".
  * @return {String} data URL if synchronous (callback omitted)
  * @api public
  */
@@ -274,23 +323,57 @@ Canvas.prototype.toDataURL = function(a1, a2, a3){
       return 'data:image/png;base64,' + this.toBuffer().toString('base64');
     }
 
-  } else if ('image/jpeg' === type) {
+  } else if ('image/jpeg' === type || 'image/webp' === type) {
     if (undefined === fn) {
-      throw new Error('Missing required callback function for format "image/jpeg"');
+      throw new Error('Missing required callback function for format "' + type + '"');
     }
 
-    var stream = this.jpegStream(opts);
-    // note that jpegStream is synchronous
-    var buffers = [];
-    stream.on('data', function (chunk) {
-      buffers.push(chunk);
-    });
-    stream.on('error', function (err) {
-      fn(err);
-    });
-    stream.on('end', function() {
-      var result = 'data:image/jpeg;base64,' + Buffer.concat(buffers).toString('base64');
-      fn(null, result);
+    this.toBuffer(type, opts, function(err, buf){
+      if (err) return fn(err);
+      fn(null, 'data:' + type + ';base64,' + buf.toString('base64'));
     });
   }
 };
+
+/**
+ * File extensions and the formats they imply for `toFile()`.
+ */
+
+var EXTENSIONS = {
+    '.png': 'image/png'
+  , '.jpg': 'image/jpeg'
+  , '.jpeg': 'image/jpeg'
+  , '.webp': 'image/webp'
+  , '.pdf': 'application/pdf'
+  , '.svg': 'image/svg+xml'
+};
+
+/**
+ * Encode the canvas and write it to `path`, both off the main thread.
+ * The format is taken from `options.format`, the file extension, or
+ * the canvas type, and the other options are those of `toBuffer()`
+ * for that format. With `options.fsync` the file is flushed to disk
+ * before `fn` is called.
+ *
+ * @param {String} path
+ * @param {Object} options, optional
+ * @param {Function} fn
+ * @api public
+ */
+
+Canvas.prototype.toFile = function(path, options, fn){
+  if ('function' === typeof options) {
+    fn = options;
+    options = {};
+  }
+  options = options || {};
+
+  var format = options.format;
+  if (!format) {
+    var ext = require('path').extname(String(path)).toLowerCase();
+    format = 'pdf' === this.type ? 'application/pdf'
+      : 'svg' === this.type ? 'image/svg+xml'
+      : EXTENSIONS[ext] || 'image/png';
+  }
+  this._toFile(path, format, options, fn);
+};
@@ -11,7 +11,8 @@
  */
 
 var Canvas = require('./bindings')
-  , Image = Canvas.Image;
+  , Image = Canvas.Image
+  , ImageStream = require('./imagestream');
 
 /**
  * Src setter.
@@ -43,6 +44,43 @@ Image.prototype.__defineGetter__('src', function(){
   return this.source;
 });
 
+/**
+ * Wait for the image to load, as with `img.decoding = 'async'`. Returns
+ * a Promise unless `fn` is given, which is called with an error, if
+ * any, instead.
+ *
+ * @param {Function} fn
+ * @return {Promise}
+ * @api public
+ */
+
+Image.prototype.decode = function(fn){
+  var self = this;
+  if ('function' == typeof fn) {
+    return this._whenDecoded(function(err){
+      process.nextTick(function(){ fn(err || null); });
+    });
+  }
+  return new Promise(function(resolve, reject){
+    self._whenDecoded(function(err){
+      if (err) reject(err);
+      else resolve();
+    });
+  });
+};
+
+/**
+ * Create an `ImageStream` that loads `this` image from the chunks
+ * written to it, replacing its source.
+ *
+ * @return {ImageStream}
+ * @api public
+ */
+
+Image.prototype.createWriteStream = function(){
+  return new ImageStream(this);
+};
+
 /**
  * Inspect image.
  *
@@ -0,0 +1,47 @@
+'use strict';
+
+/*!
+ * Canvas - ImageStream
+ * Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+ * MIT Licensed
+ */
+
+/**
+ * Module dependencies.
+ */
+
+var Writable = require('stream').Writable;
+var util = require('util');
+
+/**
+ * Initialize an `ImageStream` loading the given `image`.
+ *
+ * The image is decoded from the chunks written as they arrive, so that
+ * decoding overlaps with, for example, an upload, without the whole
+ * file being buffered first. The image's `onload` or `onerror` is
+ * invoked once the stream has ended. The following example loads an
+ * image from a request:
+ *
+ *     var img = new Image;
+ *     img.onload = function(){ ... };
+ *     req.pipe(img.createWriteStream());
+ *
+ * @param {Image} image
+ * @api public
+ */
+
+var ImageStream = module.exports = function ImageStream(image) {
+  Writable.call(this);
+  this.image = image;
+  this.loadId = image._beginFeed();
+  this.on('finish', function(){
+    image._endFeed(this.loadId);
+  });
+};
+
+util.inherits(ImageStream, Writable);
+
+ImageStream.prototype._write = function(chunk, encoding, fn){
+  this.image._feed(chunk, this.loadId);
+  fn();
+};
@@ -10,7 +10,9 @@
  * Module dependencies.
  */
 
-var Stream = require('stream').Stream;
+var Readable = require('stream').Readable;
+var util = require('util');
+var PNGStream = require('./pngstream');
 
 /**
  * Initialize a `JPEGStream` with the given `canvas`.
@@ -24,39 +26,24 @@ var Stream = require('stream').Stream;
  *
  *     stream.pipe(out);
  *
+ * Like `PNGStream`, rows are only encoded as the consumer reads.
+ *
  * @param {Canvas} canvas
+ * @param {Object} options
  * @param {Boolean} sync
  * @api public
  */
 
 var JPEGStream = module.exports = function JPEGStream(canvas, options, sync) {
-  var self = this
-    , method = sync
-      ? 'streamJPEGSync'
-      : 'streamJPEG';
+  Readable.call(this);
   this.options = options;
   this.sync = sync;
   this.canvas = canvas;
-  this.readable = true;
-  // TODO: implement async
-  if ('streamJPEG' == method) method = 'streamJPEGSync';
-  process.nextTick(function(){
-    canvas[method](options.bufsize, options.quality, options.progressive, function(err, chunk){
-      if (err) {
-        self.emit('error', err);
-        self.readable = false;
-      } else if (chunk) {
-        self.emit('data', chunk);
-      } else {
-        self.emit('end');
-        self.readable = false;
-      }
-    });
-  });
+  this.encoder = canvas.createEncoder('image/jpeg', options);
 };
 
-/**
- * Inherit from `EventEmitter`.
- */
+util.inherits(JPEGStream, Readable);
 
-JPEGStream.prototype.__proto__ = Stream.prototype;
+JPEGStream.prototype._read = function(){
+  PNGStream.read(this);
+};
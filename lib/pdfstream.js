@@ -22,12 +22,22 @@ var Stream = require('stream').Stream;
  *
  *     stream.pipe(out);
  *
+ * With `options.incremental` the stream is attached to the canvas
+ * right away and pages are emitted as they are added, rather than the
+ * whole document once it is done. It ends on `canvas.finishPDF()`.
+ *
+ *     var stream = canvas.createPDFStream({ incremental: true });
+ *     stream.pipe(out);
+ *     // draw, ctx.addPage(), draw...
+ *     canvas.finishPDF();
+ *
  * @param {Canvas} canvas
  * @param {Boolean} sync
+ * @param {Object} options
  * @api public
  */
 
-var PDFStream = module.exports = function PDFStream(canvas, sync) {
+var PDFStream = module.exports = function PDFStream(canvas, sync, options) {
   var self = this
     , method = sync
       ? 'streamPDFSync'
@@ -35,20 +45,28 @@ var PDFStream = module.exports = function PDFStream(canvas, sync) {
   this.sync = sync;
   this.canvas = canvas;
   this.readable = true;
+
+  function emit(err, chunk, len){
+    if (err) {
+      self.emit('error', err);
+      self.readable = false;
+    } else if (len) {
+      self.emit('data', chunk, len);
+    } else {
+      self.emit('end');
+      self.readable = false;
+    }
+  }
+
+  if (!sync && options && options.incremental) {
+    canvas.streamPDF(emit);
+    return;
+  }
+
   // TODO: implement async
   if ('streamPDF' == method) method = 'streamPDFSync';
   process.nextTick(function(){
-    canvas[method](function(err, chunk, len){
-      if (err) {
-        self.emit('error', err);
-        self.readable = false;
-      } else if (len) {
-        self.emit('data', chunk, len);
-      } else {
-        self.emit('end');
-        self.readable = false;
-      }
-    });
+    canvas[method](emit);
   });
 };
 
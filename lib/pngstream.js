@@ -10,7 +10,8 @@
  * Module dependencies.
  */
 
-var Stream = require('stream').Stream;
+var Readable = require('stream').Readable;
+var util = require('util');
 
 /**
  * Initialize a `PNGStream` with the given `canvas`.
@@ -24,38 +25,48 @@ var Stream = require('stream').Stream;
  *
  *     stream.pipe(out);
  *
+ * Rows are only encoded as the consumer reads, so a slow destination
+ * pauses the encoder instead of buffering its output.
+ *
  * @param {Canvas} canvas
  * @param {Boolean} sync
+ * @param {Object} options
  * @api public
  */
 
-var PNGStream = module.exports = function PNGStream(canvas, sync) {
-  var self = this
-    , method = sync
-      ? 'streamPNGSync'
-      : 'streamPNG';
+var PNGStream = module.exports = function PNGStream(canvas, sync, options) {
+  Readable.call(this);
   this.sync = sync;
   this.canvas = canvas;
-  this.readable = true;
-  // TODO: implement async
-  if ('streamPNG' == method) method = 'streamPNGSync';
-  process.nextTick(function(){
-    canvas[method](function(err, chunk, len){
-      if (err) {
-        self.emit('error', err);
-        self.readable = false;
-      } else if (len) {
-        self.emit('data', chunk, len);
-      } else {
-        self.emit('end');
-        self.readable = false;
-      }
-    });
-  });
+  this.encoder = canvas.createEncoder('image/png', options);
+};
+
+util.inherits(PNGStream, Readable);
+
+PNGStream.prototype._read = function(){
+  read(this);
 };
 
 /**
- * Inherit from `EventEmitter`.
+ * Push the encoder's next chunk to `stream`, null once complete.
+ *
+ * @param {Readable} stream
+ * @api private
  */
 
-PNGStream.prototype.__proto__ = Stream.prototype;
+var read = PNGStream.read = function(stream){
+  if (stream.sync) {
+    var chunk;
+    try {
+      chunk = stream.encoder.readSync();
+    } catch (err) {
+      return stream.emit('error', err);
+    }
+    stream.push(chunk);
+  } else {
+    stream.encoder.read(function(err, chunk){
+      if (err) return stream.emit('error', err);
+      stream.push(chunk);
+    });
+  }
+};
@@ -0,0 +1,56 @@
+'use strict';
+
+/*!
+ * Canvas - WebPStream
+ * Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+ * MIT Licensed
+ */
+
+/**
+ * Module dependencies.
+ */
+
+var Readable = require('stream').Readable;
+var util = require('util');
+
+/**
+ * Initialize a `WebPStream` with the given `canvas`.
+ *
+ * The image is encoded on the thread pool once the consumer first
+ * reads. libwebp only completes the RIFF container once the whole
+ * image is encoded, so the output arrives as a single chunk.
+ *
+ *     var out = fs.createWriteStream(__dirname + '/my.webp')
+ *       , stream = canvas.createWebPStream({quality: 80});
+ *
+ *     stream.pipe(out);
+ *
+ * @param {Canvas} canvas
+ * @param {Object} options
+ * @api public
+ */
+
+var WebPStream = module.exports = function WebPStream(canvas, options) {
+  Readable.call(this);
+  this.options = options;
+  this.canvas = canvas;
+  this.started = false;
+};
+
+util.inherits(WebPStream, Readable);
+
+WebPStream.prototype._read = function(){
+  if (this.started) return;
+  this.started = true;
+
+  var self = this;
+  try {
+    this.canvas.toBuffer('image/webp', this.options, function(err, buf){
+      if (err) return self.emit('error', err);
+      self.push(buf);
+      self.push(null);
+    });
+  } catch (err) {
+    this.emit('error', err);
+  }
+};
@@ -0,0 +1,672 @@
+
+//
+// AnimationEncoder.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "AnimationEncoder.h"
+#include "PNGParallel.h"
+#include "quantize.h"
+#include "work_pool.h"
+
+Nan::Persistent<FunctionTemplate> AnimationEncoder::constructor;
+
+/*
+ * Initialize AnimationEncoder.
+ */
+
+void
+AnimationEncoder::Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
+  Nan::HandleScope scope;
+
+  // Constructor
+  Local<FunctionTemplate> ctor = Nan::New<FunctionTemplate>(AnimationEncoder::New);
+  constructor.Reset(ctor);
+  ctor->InstanceTemplate()->SetInternalFieldCount(1);
+  ctor->SetClassName(Nan::New("AnimationEncoder").ToLocalChecked());
+
+  // Prototype
+  Nan::SetPrototypeMethod(ctor, "addFrame", AddFrame);
+  Nan::SetPrototypeMethod(ctor, "finish", Finish);
+  Nan::Set(target, Nan::New("AnimationEncoder").ToLocalChecked(), ctor->GetFunction());
+}
+
+/*
+ * Initialize a new AnimationEncoder with width, height and options:
+ * `type` ('image/png' for APNG or 'image/gif'), `loop` (number of
+ * plays, 0 for forever), `compressionLevel` for APNG, and `maxColors`
+ * and `dither` for the GIF palettes.
+ */
+
+NAN_METHOD(AnimationEncoder::New) {
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowTypeError("Class constructors cannot be invoked without 'new'");
+  }
+
+  if (!info[0]->IsUint32() || !info[1]->IsUint32())
+    return Nan::ThrowTypeError("Width and height must be integers.");
+  uint32_t width = info[0]->Uint32Value();
+  uint32_t height = info[1]->Uint32Value();
+  if (!width || !height || width > INT_MAX / 4 / height)
+    return Nan::ThrowRangeError("Invalid animation dimensions.");
+
+  bool gif = false;
+  uint32_t loop = 0;
+  uint32_t level = 6;
+  palette_options_t palette = { 256, false };
+
+  if (info[2]->IsObject()) {
+    Local<Object> options = info[2]->ToObject();
+
+    Local<Value> type = options->Get(Nan::New<String>("type").ToLocalChecked());
+    if (type->StrictEquals(Nan::New<String>("image/gif").ToLocalChecked())) {
+      gif = true;
+    } else if (!type->IsUndefined() && !type->StrictEquals(Nan::New<String>("image/png").ToLocalChecked())) {
+      return Nan::ThrowTypeError("Unsupported animation type");
+    }
+
+    Local<Value> plays = options->Get(Nan::New<String>("loop").ToLocalChecked());
+    if (!plays->IsUndefined()) {
+      if (!plays->IsUint32()) return Nan::ThrowTypeError("loop must be a non-negative integer.");
+      loop = plays->Uint32Value();
+    }
+
+    Local<Value> compression = options->Get(Nan::New<String>("compressionLevel").ToLocalChecked());
+    if (!compression->IsUndefined()) {
+      if (!compression->IsUint32() || compression->Uint32Value() > 9)
+        return Nan::ThrowRangeError("Allowed compression levels lie in the range [0, 9].");
+      level = compression->Uint32Value();
+    }
+
+    Local<Value> colors = options->Get(Nan::New<String>("maxColors").ToLocalChecked());
+    if (!colors->IsUndefined()) {
+      if (!colors->IsUint32() || colors->Uint32Value() < 2 || colors->Uint32Value() > 256)
+        return Nan::ThrowRangeError("maxColors must be an integer in the range [2, 256].");
+      palette.max_colors = colors->Uint32Value();
+    }
+    palette.dither = options->Get(Nan::New<String>("dither").ToLocalChecked())->BooleanValue();
+  }
+
+  if (gif) {
+#ifdef ANIMATION_GIF
+    if (width > 65535 || height > 65535)
+      return Nan::ThrowRangeError("GIF images are limited to 65535 pixels per side.");
+#else
+    return Nan::ThrowError("node-canvas was built without GIF encoding support");
+#endif
+  }
+
+  AnimationEncoder *encoder = new AnimationEncoder(width, height, gif);
+  encoder->_loop = loop;
+  encoder->_compressionLevel = level;
+  encoder->_palette = palette;
+  encoder->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+AnimationEncoder::AnimationEncoder(int width, int height, bool gif) {
+  _width = width;
+  _height = height;
+  _gif = gif;
+  _loop = 0;
+  _compressionLevel = 6;
+  _palette.max_colors = 256;
+  _palette.dither = false;
+  _previous = NULL;
+  _added = 0;
+  _frames = 0;
+  _sequence = 0;
+  _output.data = NULL;
+  _output.len = 0;
+  _output.max_len = 0;
+  _actlOffset = 0;
+  _disposalOffset = 0;
+#ifdef ANIMATION_GIF
+  _gifFile = NULL;
+#endif
+  _status = CAIRO_STATUS_SUCCESS;
+  _working = false;
+  _finishing = false;
+  _finalize = false;
+  _finishCallback = NULL;
+  _req.data = this;
+}
+
+static void
+free_frames(std::vector<animation_frame_t> &frames) {
+  for (size_t i = 0; i < frames.size(); i++) {
+    free(frames[i].data);
+    delete frames[i].callback;
+  }
+  frames.clear();
+}
+
+AnimationEncoder::~AnimationEncoder() {
+  free_frames(_pending);
+  free_frames(_batch);
+  free(_previous);
+  free(_output.data);
+#ifdef ANIMATION_GIF
+  if (_gifFile) EGifCloseFile(_gifFile, NULL);
+#endif
+  delete _finishCallback;
+}
+
+/*
+ * cairo write function appending to an animation_output_t.
+ */
+
+static cairo_status_t
+append_output(void *closure, const uint8_t *data, unsigned len) {
+  animation_output_t *output = (animation_output_t *) closure;
+
+  if (output->len + len > output->max_len) {
+    size_t max = output->max_len ? output->max_len : PAGE_SIZE;
+    while (output->len + len > max) max *= 2;
+
+    uint8_t *buf = (uint8_t *) realloc(output->data, max);
+    if (!buf) return CAIRO_STATUS_NO_MEMORY;
+    output->data = buf;
+    output->max_len = max;
+  }
+
+  memcpy(output->data + output->len, data, len);
+  output->len += len;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+static inline void
+put_uint32(uint8_t *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+/*
+ * Bounding rectangle (x, y, width, height) of the pixels that differ
+ * between two frames. Identical frames still get a one pixel frame,
+ * both formats needing some image data per frame.
+ */
+
+static void
+frame_diff(const uint32_t *a, const uint32_t *b, int width, int height, int rect[4]) {
+  size_t rowbytes = (size_t) width * 4;
+  int top = 0, bottom = height - 1, left = width, right = -1;
+
+  while (top < height && !memcmp(a + (size_t) top * width, b + (size_t) top * width, rowbytes)) top++;
+  if (top == height) {
+    rect[0] = rect[1] = 0;
+    rect[2] = rect[3] = 1;
+    return;
+  }
+  while (!memcmp(a + (size_t) bottom * width, b + (size_t) bottom * width, rowbytes)) bottom--;
+
+  for (int y = top; y <= bottom; y++) {
+    const uint32_t *ra = a + (size_t) y * width;
+    const uint32_t *rb = b + (size_t) y * width;
+    for (int x = 0; x < left; x++) {
+      if (ra[x] != rb[x]) {
+        left = x;
+        break;
+      }
+    }
+    for (int x = width - 1; x > right; x--) {
+      if (ra[x] != rb[x]) {
+        right = x;
+        break;
+      }
+    }
+  }
+
+  rect[0] = left;
+  rect[1] = top;
+  rect[2] = right - left + 1;
+  rect[3] = bottom - top + 1;
+}
+
+/*
+ * Encode `frame`, taking over its pixels as the previous frame.
+ */
+
+void
+AnimationEncoder::encodeFrame(animation_frame_t *frame) {
+  int rect[4] = { 0, 0, _width, _height };
+  if (_previous) frame_diff((uint32_t *) _previous, (uint32_t *) frame->data, _width, _height, rect);
+
+#ifdef ANIMATION_GIF
+  if (_gif) {
+    encodeGIFFrame(frame, rect[0], rect[1], rect[2], rect[3]);
+  } else
+#endif
+  encodePNGFrame(frame, rect[0], rect[1], rect[2], rect[3]);
+
+  free(_previous);
+  _previous = frame->data;
+  frame->data = NULL;
+  _frames++;
+}
+
+/*
+ * Encode a frame rectangle as an APNG fcTL chunk followed by IDAT for
+ * the first frame, which doubles as the still image, or fdAT. Frames
+ * replace the pixels under them (APNG_BLEND_OP_SOURCE), so pixels that
+ * turn transparent need no special treatment.
+ */
+
+void
+AnimationEncoder::encodePNGFrame(animation_frame_t *frame, int x, int y, int w, int h) {
+  size_t rowbytes = (size_t) w * 4;
+  uint8_t *prev = (uint8_t *) calloc(1, rowbytes);
+  uint8_t *cur = (uint8_t *) malloc(rowbytes);
+  uint8_t *scratch = (uint8_t *) malloc(rowbytes);
+  uint8_t *filtered = (uint8_t *) malloc(rowbytes + 1);
+  uint8_t out[16384];
+  std::string data;
+  z_stream zs;
+
+  memset(&zs, 0, sizeof(zs));
+  if (!prev || !cur || !scratch || !filtered ||
+      deflateInit2(&zs, _compressionLevel, Z_DEFLATED, 15, 8, Z_FILTERED) != Z_OK) {
+    free(prev);
+    free(cur);
+    free(scratch);
+    free(filtered);
+    _status = CAIRO_STATUS_NO_MEMORY;
+    return;
+  }
+
+  for (int row = 0; row < h && !_status; row++) {
+    argb32_unpremultiply_to_rgba(cur, frame->data + ((size_t) (y + row) * _width + x) * 4, w);
+    canvas_png_select_filter(PNG_ALL_FILTERS, cur, prev, rowbytes, 4, filtered, scratch);
+    uint8_t *tmp = prev; prev = cur; cur = tmp;
+
+    zs.next_in = filtered;
+    zs.avail_in = rowbytes + 1;
+    int flush = row + 1 < h ? Z_NO_FLUSH : Z_FINISH;
+    do {
+      zs.next_out = out;
+      zs.avail_out = sizeof(out);
+      if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+        _status = CAIRO_STATUS_WRITE_ERROR;
+        break;
+      }
+      data.append((const char *) out, sizeof(out) - zs.avail_out);
+    } while (zs.avail_out == 0);
+  }
+
+  deflateEnd(&zs);
+  free(prev);
+  free(cur);
+  free(scratch);
+  free(filtered);
+  if (_status) return;
+
+  // Delays are a 16-bit fraction of a second
+  uint32_t num = frame->delay, den = 1000;
+  while (num > 65535 && den > 1) {
+    num /= 10;
+    den /= 10;
+  }
+  if (num > 65535) num = 65535;
+
+  uint8_t fctl[26];
+  put_uint32(fctl, _sequence++);
+  put_uint32(fctl + 4, w);
+  put_uint32(fctl + 8, h);
+  put_uint32(fctl + 12, x);
+  put_uint32(fctl + 16, y);
+  fctl[20] = num >> 8;
+  fctl[21] = num;
+  fctl[22] = den >> 8;
+  fctl[23] = den;
+  fctl[24] = 0; // APNG_DISPOSE_OP_NONE
+  fctl[25] = 0; // APNG_BLEND_OP_SOURCE
+  // The header goes first, its frame count filled in by finishPNG()
+  if (!_frames) {
+    canvas_png_format_t format = { PNG_COLOR_TYPE_RGB_ALPHA, 8 };
+    uint8_t actl[8];
+    put_uint32(actl, 0);
+    put_uint32(actl + 4, _loop);
+    _status = canvas_png_write_header(append_output, &_output, _width, _height, &format);
+    _actlOffset = _output.len + 8;
+    if (!_status) _status = canvas_png_write_chunk(append_output, &_output, "acTL", actl, sizeof(actl));
+    if (_status) return;
+  }
+
+  _status = canvas_png_write_chunk(append_output, &_output, "fcTL", fctl, sizeof(fctl));
+  if (_status) return;
+
+  if (!_frames) {
+    _status = canvas_png_write_chunk(append_output, &_output, "IDAT", (const uint8_t *) data.data(), data.size());
+  } else {
+    uint8_t sequence[4];
+    uLong crc;
+    put_uint32(sequence, _sequence++);
+    _status = canvas_png_chunk_begin(append_output, &_output, "fdAT", data.size() + 4, &crc);
+    if (!_status) _status = canvas_png_chunk_data(append_output, &_output, sequence, 4, &crc);
+    if (!_status) _status = canvas_png_chunk_data(append_output, &_output, (const uint8_t *) data.data(), data.size(), &crc);
+    if (!_status) _status = canvas_png_chunk_end(append_output, &_output, crc);
+  }
+}
+
+/*
+ * Fill in the frame count, and end the PNG.
+ */
+
+void
+AnimationEncoder::finishPNG() {
+  uint8_t *actl = _output.data + _actlOffset;
+  put_uint32(actl, _frames);
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), (const uint8_t *) "acTL", 4);
+  put_uint32(actl + 8, crc32(crc, actl, 8));
+  _status = canvas_png_write_chunk(append_output, &_output, "IEND", NULL, 0);
+}
+
+#ifdef ANIMATION_GIF
+
+/*
+ * giflib output function appending to an animation_output_t.
+ */
+
+static int
+append_gif_output(GifFileType *gif, const GifByteType *data, int len) {
+  return append_output(gif->UserData, data, len) ? 0 : len;
+}
+
+/*
+ * Encode a frame rectangle as a GIF image with its own palette. Pixels
+ * under half opacity become the transparent index. GIF frames draw over
+ * the ones before them, so when a pixel turns transparent the previous
+ * frame is disposed of to the background instead, which is patched into
+ * its already written control block, and this frame grows to cover it.
+ */
+
+void
+AnimationEncoder::encodeGIFFrame(animation_frame_t *frame, int x, int y, int w, int h) {
+  int error;
+
+  if (!_gifFile) {
+    _gifFile = EGifOpen(&_output, append_gif_output, &error);
+    if (!_gifFile) {
+      _status = CAIRO_STATUS_NO_MEMORY;
+      return;
+    }
+    EGifSetGifVersion(_gifFile, true);
+    if (EGifPutScreenDesc(_gifFile, _width, _height, 8, 0, NULL) != GIF_OK) {
+      _status = CAIRO_STATUS_WRITE_ERROR;
+      return;
+    }
+
+    // NETSCAPE2.0 counts repeats after the first play, 0 being forever
+    if (_loop != 1) {
+      uint32_t repeats = _loop ? _loop - 1 : 0;
+      uint8_t count[3] = { 1, (uint8_t) repeats, (uint8_t) (repeats >> 8) };
+      EGifPutExtensionLeader(_gifFile, APPLICATION_EXT_FUNC_CODE);
+      EGifPutExtensionBlock(_gifFile, 11, "NETSCAPE2.0");
+      EGifPutExtensionBlock(_gifFile, 3, count);
+      EGifPutExtensionTrailer(_gifFile);
+    }
+  }
+
+  if (_previous) {
+    const uint32_t *before = (const uint32_t *) _previous;
+    const uint32_t *after = (const uint32_t *) frame->data;
+    bool clears = false;
+    for (int row = y; row < y + h && !clears; row++) {
+      for (int col = x; col < x + w; col++) {
+        size_t i = (size_t) row * _width + col;
+        if (after[i] < 0x80000000 && before[i] >= 0x80000000) {
+          clears = true;
+          break;
+        }
+      }
+    }
+
+    if (clears) {
+      _output.data[_disposalOffset] = (_output.data[_disposalOffset] & ~0x1c) | DISPOSE_BACKGROUND << 2;
+      int right = x + w, bottom = y + h;
+      int prevRight = _previousRect[0] + _previousRect[2], prevBottom = _previousRect[1] + _previousRect[3];
+      if (_previousRect[0] < x) x = _previousRect[0];
+      if (_previousRect[1] < y) y = _previousRect[1];
+      w = (prevRight > right ? prevRight : right) - x;
+      h = (prevBottom > bottom ? prevBottom : bottom) - y;
+    }
+  }
+
+  // One palette slot is kept for transparency
+  const uint8_t *origin = frame->data + ((size_t) y * _width + x) * 4;
+  unsigned max_colors = _palette.max_colors < 255 ? _palette.max_colors : 255;
+  palette_quantizer_t *q = palette_quantizer_create(origin, w, h, _width * 4, true, max_colors, _palette.dither);
+  GifByteType *line = (GifByteType *) malloc(w);
+  if (!q || !line) {
+    if (q) palette_quantizer_destroy(q);
+    free(line);
+    _status = CAIRO_STATUS_NO_MEMORY;
+    return;
+  }
+
+  GifColorType colors[256];
+  uint8_t map[256];
+  unsigned count = palette_quantizer_colors(q), n = 0;
+  int transparent = NO_TRANSPARENT_COLOR;
+  memset(colors, 0, sizeof(colors));
+  for (unsigned i = 0; i < count; i++) {
+    const uint8_t *rgba = palette_quantizer_color(q, i);
+    if (rgba[3] < 128) {
+      if (transparent == NO_TRANSPARENT_COLOR) transparent = 0;
+      continue;
+    }
+    map[i] = n;
+    colors[n].Red = rgba[0];
+    colors[n].Green = rgba[1];
+    colors[n].Blue = rgba[2];
+    n++;
+  }
+  if (transparent != NO_TRANSPARENT_COLOR) {
+    transparent = n++;
+    for (unsigned i = 0; i < count; i++) {
+      if (palette_quantizer_color(q, i)[3] < 128) map[i] = transparent;
+    }
+  }
+
+  ColorMapObject *colorMap = GifMakeMapObject(1 << GifBitSize(n), colors);
+  GraphicsControlBlock gcb;
+  GifByteType extension[4];
+  gcb.DisposalMode = DISPOSE_DO_NOT;
+  gcb.UserInputFlag = false;
+  gcb.DelayTime = (frame->delay + 5) / 10;
+  gcb.TransparentColor = transparent;
+  EGifGCBToExtension(&gcb, extension);
+
+  _disposalOffset = _output.len + 3;
+  if (!colorMap ||
+      EGifPutExtension(_gifFile, GRAPHICS_EXT_FUNC_CODE, 4, extension) != GIF_OK ||
+      EGifPutImageDesc(_gifFile, x, y, w, h, false, colorMap) != GIF_OK) {
+    _status = colorMap ? CAIRO_STATUS_WRITE_ERROR : CAIRO_STATUS_NO_MEMORY;
+  }
+
+  for (int row = 0; row < h && !_status; row++) {
+    palette_quantizer_map_row(q, origin + (size_t) row * _width * 4, line);
+    for (int col = 0; col < w; col++) line[col] = map[line[col]];
+    if (EGifPutLine(_gifFile, line, w) != GIF_OK) _status = CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  if (colorMap) GifFreeMapObject(colorMap);
+  palette_quantizer_destroy(q);
+  free(line);
+
+  _previousRect[0] = x;
+  _previousRect[1] = y;
+  _previousRect[2] = w;
+  _previousRect[3] = h;
+}
+
+/*
+ * Write the GIF trailer.
+ */
+
+void
+AnimationEncoder::finishGIF() {
+  int error;
+  if (EGifCloseFile(_gifFile, &error) != GIF_OK) _status = CAIRO_STATUS_WRITE_ERROR;
+  _gifFile = NULL;
+}
+
+#endif /* ANIMATION_GIF */
+
+/*
+ * Hand the frames added so far to the thread pool, unless a batch is
+ * already being encoded, in which case they go with the next one.
+ */
+
+void
+AnimationEncoder::start() {
+  if (_working) return;
+  _batch.swap(_pending);
+  _finalize = _finishing;
+  _working = true;
+  Ref();
+  work_pool_queue(WORK_LANE_ENCODE, &_req, EncodeAsync, (uv_after_work_cb)EncodeAsyncAfter);
+}
+
+/*
+ * Encode a batch of frames, and finish the file after the last one.
+ */
+
+void
+AnimationEncoder::EncodeAsync(uv_work_t *req) {
+  AnimationEncoder *encoder = (AnimationEncoder *) req->data;
+
+  for (size_t i = 0; i < encoder->_batch.size() && !encoder->_status; i++) {
+    encoder->encodeFrame(&encoder->_batch[i]);
+  }
+
+  if (!encoder->_finalize || encoder->_status) return;
+
+#ifdef ANIMATION_GIF
+  if (encoder->_gif) {
+    encoder->finishGIF();
+  } else
+#endif
+  encoder->finishPNG();
+
+  // Give back what the doubling left unused
+  uint8_t *data = (uint8_t *) realloc(encoder->_output.data, encoder->_output.len);
+  if (data) {
+    encoder->_output.data = data;
+    encoder->_output.max_len = encoder->_output.len;
+  }
+}
+
+/*
+ * Call back for each frame of the batch, then with the file once it
+ * is finished, or move on to the frames added in the meantime.
+ */
+
+void
+AnimationEncoder::EncodeAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  AnimationEncoder *encoder = (AnimationEncoder *) req->data;
+  std::vector<animation_frame_t> batch;
+
+  encoder->_working = false;
+  batch.swap(encoder->_batch);
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (!batch[i].callback) continue;
+    Local<Value> argv[1] = { Nan::Null() };
+    if (encoder->_status) argv[0] = Canvas::Error(encoder->_status);
+    batch[i].callback->Call(1, argv);
+  }
+  free_frames(batch);
+
+  if (encoder->_finalize) {
+    Nan::Callback *fn = encoder->_finishCallback;
+    encoder->_finishCallback = NULL;
+    if (encoder->_status) {
+      Local<Value> argv[1] = { Canvas::Error(encoder->_status) };
+      fn->Call(1, argv);
+    } else {
+      Local<Object> buf = Nan::NewBuffer((char *) encoder->_output.data, encoder->_output.len, closure_buffer_free, NULL).ToLocalChecked();
+      encoder->_output.data = NULL;
+      encoder->_output.len = encoder->_output.max_len = 0;
+      Local<Value> argv[2] = { Nan::Null(), buf };
+      fn->Call(2, argv);
+    }
+    delete fn;
+  } else if (!encoder->_pending.empty() || encoder->_finishing) {
+    encoder->start();
+  }
+
+  encoder->Unref();
+}
+
+/*
+ * Add a frame: the canvas is copied as it is now and encoded on the
+ * thread pool, calling back with (err) once it has been. `delay` is
+ * in milliseconds and defaults to 100.
+ */
+
+NAN_METHOD(AnimationEncoder::AddFrame) {
+  AnimationEncoder *encoder = Nan::ObjectWrap::Unwrap<AnimationEncoder>(info.This());
+
+  if (encoder->_finishing)
+    return Nan::ThrowError("The animation has already been finished");
+  if (!info[0]->IsObject() || !Nan::New(Canvas::constructor)->HasInstance(info[0]))
+    return Nan::ThrowTypeError("Canvas expected");
+
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info[0]->ToObject());
+  if (canvas->isPDF() || canvas->isSVG())
+    return Nan::ThrowError("Only image canvases can be added as frames");
+  if (canvas->width != encoder->_width || canvas->height != encoder->_height)
+    return Nan::ThrowRangeError("Frames must be the size of the animation.");
+
+  uint32_t delay = 100;
+  if (!info[1]->IsUndefined() && !info[1]->IsFunction()) {
+    if (!info[1]->IsNumber() || !(info[1]->NumberValue() >= 0))
+      return Nan::ThrowTypeError("Delay must be a non-negative number.");
+    delay = info[1]->Uint32Value();
+  }
+  Local<Value> fn = info[1]->IsFunction() ? info[1] : info[2];
+
+  size_t rowbytes = (size_t) encoder->_width * 4;
+  uint8_t *data = (uint8_t *) malloc(rowbytes * encoder->_height);
+  if (!data) return Nan::ThrowError(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+
+  cairo_surface_t *surface = canvas->surface();
+  cairo_surface_flush(surface);
+  const uint8_t *src = cairo_image_surface_get_data(surface);
+  for (int y = 0; y < encoder->_height; y++) {
+    memcpy(data + y * rowbytes, src + y * canvas->stride(), rowbytes);
+  }
+
+  animation_frame_t frame = { data, delay, fn->IsFunction() ? new Nan::Callback(fn.As<Function>()) : NULL };
+  encoder->_pending.push_back(frame);
+  encoder->_added++;
+  encoder->start();
+}
+
+/*
+ * Finish the animation once the frames added so far are encoded,
+ * calling back with (err, buffer).
+ */
+
+NAN_METHOD(AnimationEncoder::Finish) {
+  AnimationEncoder *encoder = Nan::ObjectWrap::Unwrap<AnimationEncoder>(info.This());
+
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("callback function required");
+  if (encoder->_finishing)
+    return Nan::ThrowError("The animation has already been finished");
+  if (!encoder->_added)
+    return Nan::ThrowError("No frames have been added");
+
+  encoder->_finishing = true;
+  encoder->_finishCallback = new Nan::Callback(info[0].As<Function>());
+  encoder->start();
+}
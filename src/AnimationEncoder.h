@@ -0,0 +1,99 @@
+
+//
+// AnimationEncoder.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_ANIMATION_ENCODER_H__
+#define __NODE_ANIMATION_ENCODER_H__
+
+#include <string>
+#include <vector>
+#include "Canvas.h"
+#include "closure.h"
+
+#ifdef HAVE_GIF
+#include <gif_lib.h>
+#if GIFLIB_MAJOR > 5 || GIFLIB_MAJOR == 5 && GIFLIB_MINOR >= 1
+#define ANIMATION_GIF
+#endif
+#endif
+
+/*
+ * A frame waiting to be encoded: a tightly packed ARGB32 copy of the
+ * canvas, its delay in milliseconds and the addFrame() callback.
+ */
+
+typedef struct {
+  uint8_t *data;
+  uint32_t delay;
+  Nan::Callback *callback;
+} animation_frame_t;
+
+/*
+ * The file being written, in a malloc'd buffer that becomes the
+ * finished Buffer as it is.
+ */
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t max_len;
+} animation_output_t;
+
+/*
+ * Animated PNG or GIF encoder. Frames are copied from the canvas when
+ * added and encoded in order on the thread pool, each one only covering
+ * the rectangle that changed since the frame before it.
+ */
+
+class AnimationEncoder: public Nan::ObjectWrap {
+  public:
+    static Nan::Persistent<FunctionTemplate> constructor;
+    static void Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(AddFrame);
+    static NAN_METHOD(Finish);
+    static void EncodeAsync(uv_work_t *req);
+    static void EncodeAsyncAfter(uv_work_t *req);
+
+  private:
+    AnimationEncoder(int width, int height, bool gif);
+    ~AnimationEncoder();
+    void start();
+    void encodeFrame(animation_frame_t *frame);
+    void encodePNGFrame(animation_frame_t *frame, int x, int y, int w, int h);
+    void finishPNG();
+#ifdef ANIMATION_GIF
+    void encodeGIFFrame(animation_frame_t *frame, int x, int y, int w, int h);
+    void finishGIF();
+#endif
+    int _width;
+    int _height;
+    bool _gif;
+    uint32_t _loop;
+    uint32_t _compressionLevel;
+    palette_options_t _palette;
+    std::vector<animation_frame_t> _pending;
+    std::vector<animation_frame_t> _batch;
+    uint8_t *_previous;
+    int _previousRect[4];
+    unsigned _added;
+    unsigned _frames;
+    uint32_t _sequence;
+    animation_output_t _output;
+    size_t _actlOffset;
+    size_t _disposalOffset;
+#ifdef ANIMATION_GIF
+    GifFileType *_gifFile;
+#endif
+    cairo_status_t _status;
+    bool _working;
+    bool _finishing;
+    bool _finalize;
+    Nan::Callback *_finishCallback;
+    uv_work_t _req;
+};
+
+#endif
@@ -7,6 +7,9 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <algorithm>
 #include <node_buffer.h>
 #include <node_version.h>
 #include <glib.h>
@@ -15,14 +18,26 @@
 
 #include "Canvas.h"
 #include "PNG.h"
+#include "PNGParallel.h"
+#include "PNGOptimize.h"
 #include "CanvasRenderingContext2d.h"
 #include "closure.h"
+#include "document.h"
+#include "scale.h"
+#include "work_pool.h"
+#include "ImageEncoder.h"
+#include "pixel_convert.h"
+#include "png_tuning.h"
 #include "register_font.h"
 
 #ifdef HAVE_JPEG
 #include "JPEGStream.h"
 #endif
 
+#ifdef HAVE_WEBP
+#include "WebP.h"
+#endif
+
 #define GENERIC_FACE_ERROR \
   "The second argument to registerFont is required, and should be an object " \
   "with at least a family (string) and optionally weight (string/number) " \
@@ -47,11 +62,17 @@ Canvas::Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
   // Prototype
   Local<ObjectTemplate> proto = ctor->PrototypeTemplate();
   Nan::SetPrototypeMethod(ctor, "toBuffer", ToBuffer);
+  Nan::SetPrototypeMethod(ctor, "_toFile", ToFile);
+  Nan::SetPrototypeMethod(ctor, "toBuffers", ToBuffers);
   Nan::SetPrototypeMethod(ctor, "streamPNGSync", StreamPNGSync);
   Nan::SetPrototypeMethod(ctor, "streamPDFSync", StreamPDFSync);
+  Nan::SetPrototypeMethod(ctor, "streamPDF", StreamPDF);
+  Nan::SetPrototypeMethod(ctor, "finishPDF", FinishPDF);
 #ifdef HAVE_JPEG
   Nan::SetPrototypeMethod(ctor, "streamJPEGSync", StreamJPEGSync);
 #endif
+  Nan::SetPrototypeMethod(ctor, "estimateEncodedSize", EstimateEncodedSize);
+  Nan::SetPrototypeMethod(ctor, "createEncoder", CreateEncoder);
   Nan::SetAccessor(proto, Nan::New("type").ToLocalChecked(), GetType);
   Nan::SetAccessor(proto, Nan::New("stride").ToLocalChecked(), GetStride);
   Nan::SetAccessor(proto, Nan::New("width").ToLocalChecked(), GetWidth, SetWidth);
@@ -67,6 +88,7 @@ Canvas::Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
 
   // Class methods
   Nan::SetMethod(ctor, "_registerFont", RegisterFont);
+  Nan::SetMethod(ctor, "workPool", WorkPool);
 
   Nan::Set(target, Nan::New("Canvas").ToLocalChecked(), ctor->GetFunction());
 }
@@ -89,7 +111,19 @@ NAN_METHOD(Canvas::New) {
     : !strcmp("svg", *String::Utf8Value(info[2]))
       ? CANVAS_TYPE_SVG
       : CANVAS_TYPE_IMAGE;
-  Canvas *canvas = new Canvas(width, height, type);
+
+  // PDF output past this many bytes is moved to a temp file
+  size_t spill_threshold = 0;
+  if (info[3]->IsObject()) {
+    Local<Value> spill = info[3]->ToObject()->Get(Nan::New<String>("spillThreshold").ToLocalChecked());
+    if (!spill->IsUndefined()) {
+      if (!spill->IsNumber() || !(spill->NumberValue() >= 0))
+        return Nan::ThrowTypeError("spillThreshold must be a non-negative number.");
+      spill_threshold = (size_t) spill->NumberValue();
+    }
+  }
+
+  Canvas *canvas = new Canvas(width, height, type, spill_threshold);
   canvas->Wrap(info.This());
   info.GetReturnValue().Set(info.This());
 }
@@ -154,31 +188,50 @@ NAN_SETTER(Canvas::SetHeight) {
 }
 
 /*
- * Canvas::ToBuffer callback.
+ * Choose the compression level and filters for encoding the canvas
+ * as PNG in about `budget_ms`.
  */
 
-static cairo_status_t
-toBuffer(void *c, const uint8_t *data, unsigned len) {
-  closure_t *closure = (closure_t *) c;
-
-  if (closure->len + len > closure->max_len) {
-    uint8_t *data;
-    unsigned max = closure->max_len;
+static void
+tunePNG(Canvas *canvas, double budget_ms, uint32_t threads, uint32_t *compression_level, uint32_t *filter) {
+  cairo_surface_t *surface = canvas->surface();
+  cairo_surface_flush(surface);
+  png_tuning_choose(
+      cairo_image_surface_get_data(surface)
+    , canvas->width
+    , canvas->height
+    , cairo_image_surface_get_stride(surface)
+    , threads
+    , budget_ms
+    , compression_level
+    , filter);
+}
 
-    do {
-      max *= 2;
-    } while (closure->len + len > max);
+/*
+ * Encode `surface` as PNG into the closure, timing the encode so that
+ * later time budgets are met more closely, or searching for the
+ * smallest output with maxCompression.
+ */
 
-    data = (uint8_t *) realloc(closure->data, max);
-    if (!data) return CAIRO_STATUS_NO_MEMORY;
-    closure->data = data;
-    closure->max_len = max;
+static cairo_status_t
+write_to_png_buffer(cairo_surface_t *surface, closure_t *closure) {
+  if (closure->max_compression)
+    return canvas_write_to_png_stream_optimized(surface, closure_write, closure, closure->threads);
+
+  uint64_t start = uv_hrtime();
+  cairo_status_t status = canvas_write_to_png_stream_parallel(surface, closure_write, closure, closure->threads);
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  if (!status && !closure->palette.max_colors && (format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24)) {
+    png_tuning_record(
+        cairo_image_surface_get_data(surface)
+      , cairo_image_surface_get_width(surface)
+      , cairo_image_surface_get_height(surface)
+      , cairo_image_surface_get_stride(surface)
+      , closure->threads
+      , closure->compression_level
+      , uv_hrtime() - start);
   }
-
-  memcpy(closure->data + closure->len, data, len);
-  closure->len += len;
-
-  return CAIRO_STATUS_SUCCESS;
+  return status;
 }
 
 /*
@@ -197,10 +250,16 @@ Canvas::EIO_ToBuffer(eio_req *req) {
 #endif
   closure_t *closure = (closure_t *) req->data;
 
-  closure->status = canvas_write_to_png_stream(
-      closure->canvas->surface()
-    , toBuffer
-    , closure);
+  // Already filled from the encode cache
+  if (closure->len) {
+#if !NODE_VERSION_AT_LEAST(0, 5, 4)
+    return 0;
+#else
+    return;
+#endif
+  }
+
+  closure->status = write_to_png_buffer(closure->surface, closure);
 
 #if !NODE_VERSION_AT_LEAST(0, 5, 4)
   return 0;
@@ -208,168 +267,1262 @@ Canvas::EIO_ToBuffer(eio_req *req) {
 }
 
 /*
- * EIO after toBuffer callback.
+ * EIO after toBuffer callback.
+ */
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+void
+Canvas::ToBufferAsyncAfter(uv_work_t *req) {
+#else
+int
+Canvas::EIO_AfterToBuffer(eio_req *req) {
+#endif
+
+  Nan::HandleScope scope;
+  closure_t *closure = (closure_t *) req->data;
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  delete req;
+#else
+  ev_unref(EV_DEFAULT_UC);
+#endif
+
+  if (closure->status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->status) };
+    closure->pfn->Call(1, argv);
+  } else {
+    closure->canvas->recordEncodedSize(closure->encoding, closure->len);
+    closure_cache_store(closure);
+    Local<Value> argv[2] = { Nan::Null(), closure_to_buffer(closure) };
+    closure->pfn->Call(2, argv);
+  }
+
+  closure->canvas->Unref();
+  cairo_surface_destroy(closure->surface);
+  delete closure->pfn;
+  closure_destroy(closure);
+  free(closure);
+
+#if !NODE_VERSION_AT_LEAST(0, 6, 0)
+  return 0;
+#endif
+}
+
+/*
+ * Parse the optional compression level and filter arguments shared by
+ * toBuffer() and the PNG stream methods. Throws and returns false when
+ * either is invalid.
+ */
+
+static bool
+parsePNGArgs(Local<Value> level, Local<Value> filters, uint32_t *compression_level, uint32_t *filter) {
+  if (!level->IsUndefined()) {
+    bool good = true;
+    if (level->IsNumber()) {
+      *compression_level = level->Uint32Value();
+    } else if (level->IsString()) {
+      if (level->StrictEquals(Nan::New<String>("0").ToLocalChecked())) {
+        *compression_level = 0;
+      } else {
+        uint32_t tmp = level->Uint32Value();
+        if (tmp == 0) {
+          good = false;
+        } else {
+          *compression_level = tmp;
+        }
+      }
+    } else {
+      good = false;
+    }
+
+    if (good) {
+      if (*compression_level > 9) {
+        Nan::ThrowRangeError("Allowed compression levels lie in the range [0, 9].");
+        return false;
+      }
+    } else {
+      Nan::ThrowTypeError("Compression level must be a number.");
+      return false;
+    }
+  }
+
+  if (!filters->IsUndefined()) {
+    if (filters->IsUint32()) {
+      *filter = filters->Uint32Value();
+    } else {
+      Nan::ThrowTypeError("Invalid filter value.");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Parse the `palette` PNG option: true for up to 256 colors, or
+ * { maxColors, dither }. false or undefined keep truecolor output.
+ */
+
+static bool
+parsePaletteOption(Local<Value> value, palette_options_t *palette) {
+  if (value->IsUndefined() || value->IsFalse()) return true;
+
+  palette->max_colors = 256;
+  palette->dither = false;
+  if (value->IsTrue()) return true;
+
+  if (!value->IsObject()) {
+    Nan::ThrowTypeError("Palette must be a boolean or an object.");
+    return false;
+  }
+
+  Local<Object> obj = value->ToObject();
+  Local<Value> max = obj->Get(Nan::New<String>("maxColors").ToLocalChecked());
+  if (!max->IsUndefined()) {
+    if (!max->IsNumber()) {
+      Nan::ThrowTypeError("maxColors must be a number.");
+      return false;
+    }
+    double n = max->NumberValue();
+    if (!(n >= 2 && n <= 256) || n != (uint32_t) n) {
+      Nan::ThrowRangeError("maxColors must be an integer in the range [2, 256].");
+      return false;
+    }
+    palette->max_colors = (uint32_t) n;
+  }
+  palette->dither = obj->Get(Nan::New<String>("dither").ToLocalChecked())->BooleanValue();
+
+  return true;
+}
+
+/*
+ * Parse the PNG encoder options object passed to
+ * toBuffer("image/png", opts). A thread count of 0
+ * means one thread per CPU. A time budget is returned
+ * for tunePNG() to choose the level and filters by.
+ * maxCompression sets level 9 with all filters, which
+ * is what encoders that cannot search for the smallest
+ * output fall back to, and overrides the time budget.
+ */
+
+static bool
+parsePNGOptions(Local<Value> options, uint32_t *compression_level, uint32_t *filter, uint32_t *threads, palette_options_t *palette, double *time_budget, bool *max_compression) {
+  *time_budget = 0;
+  *max_compression = false;
+  if (!options->IsObject()) return true;
+  Local<Object> obj = options->ToObject();
+
+  if (!parsePNGArgs(
+      obj->Get(Nan::New<String>("compressionLevel").ToLocalChecked())
+    , obj->Get(Nan::New<String>("filters").ToLocalChecked())
+    , compression_level
+    , filter)) return false;
+
+  Local<Value> t = obj->Get(Nan::New<String>("threads").ToLocalChecked());
+  if (!t->IsUndefined()) {
+    if (!t->IsUint32()) {
+      Nan::ThrowTypeError("Thread count must be a non-negative integer.");
+      return false;
+    }
+    *threads = t->Uint32Value();
+    if (*threads == 0) {
+      uv_cpu_info_t *cpus;
+      int count;
+      *threads = uv_cpu_info(&cpus, &count) ? 1 : count;
+      if (!*threads) *threads = 1;
+      else uv_free_cpu_info(cpus, count);
+    }
+  }
+
+  Local<Value> budget = obj->Get(Nan::New<String>("timeBudget").ToLocalChecked());
+  if (!budget->IsUndefined()) {
+    if (!budget->IsNumber() || !(budget->NumberValue() > 0)) {
+      Nan::ThrowRangeError("timeBudget must be a positive number of milliseconds.");
+      return false;
+    }
+    *time_budget = budget->NumberValue();
+  }
+
+  if (obj->Get(Nan::New<String>("maxCompression").ToLocalChecked())->BooleanValue()) {
+    *max_compression = true;
+    *compression_level = 9;
+    *filter = PNG_ALL_FILTERS;
+    *time_budget = 0;
+  }
+
+  return parsePaletteOption(obj->Get(Nan::New<String>("palette").ToLocalChecked()), palette);
+}
+
+/*
+ * Parse the options object of toBuffer("raw", opts). `native` is
+ * cleared when a format is given. Throws and returns false when an
+ * option is invalid.
+ */
+
+static bool
+parseRawOptions(Local<Value> options, bool *native, pixel_format_t *format, bool *premultiplied, Local<Value> *target) {
+  Local<Object> obj = options->ToObject();
+
+  Local<Value> f = obj->Get(Nan::New<String>("format").ToLocalChecked());
+  if (!f->IsUndefined()) {
+    Nan::Utf8String name(f);
+    const char *str = *name ? *name : "";
+    *native = false;
+    if (0 == strcmp("rgba", str)) *format = PIXEL_FORMAT_RGBA;
+    else if (0 == strcmp("bgra", str)) *format = PIXEL_FORMAT_BGRA;
+    else if (0 == strcmp("rgb", str)) *format = PIXEL_FORMAT_RGB;
+    else if (0 == strcmp("a8", str)) *format = PIXEL_FORMAT_A8;
+    else if (0 == strcmp("rgb565", str)) *format = PIXEL_FORMAT_RGB565;
+    else {
+      Nan::ThrowTypeError("Unsupported raw format.");
+      return false;
+    }
+  }
+
+  Local<Value> p = obj->Get(Nan::New<String>("premultiplied").ToLocalChecked());
+  if (!p->IsUndefined()) *premultiplied = p->BooleanValue();
+
+  *target = obj->Get(Nan::New<String>("buffer").ToLocalChecked());
+  if (!(*target)->IsUndefined() && !Buffer::HasInstance(*target)) {
+    Nan::ThrowTypeError("buffer must be a Buffer.");
+    return false;
+  }
+
+  return true;
+}
+
+#ifdef HAVE_JPEG
+
+/*
+ * Parse the JPEG encoder options object passed to toBuffer() and
+ * the JPEG streams. Throws and returns false when an option is invalid.
+ */
+
+static bool
+parseJPEGArgs(Local<Value> options, jpeg_options_t *opts) {
+  if (!options->IsObject()) return true;
+  Local<Object> obj = options->ToObject();
+
+  Local<Value> q = obj->Get(Nan::New<String>("quality").ToLocalChecked());
+  if (!q->IsUndefined()) {
+    if (!q->IsNumber()) {
+      Nan::ThrowTypeError("JPEG quality must be a number.");
+      return false;
+    }
+    opts->quality = q->Uint32Value();
+    if (opts->quality > 100) {
+      Nan::ThrowRangeError("Allowed JPEG quality lies in the range [0, 100].");
+      return false;
+    }
+  }
+
+  Local<Value> p = obj->Get(Nan::New<String>("progressive").ToLocalChecked());
+  if (!p->IsUndefined()) opts->progressive = p->BooleanValue();
+
+  // true / false for 4:2:0 / 4:4:4, or the ratio as a string
+  Local<Value> c = obj->Get(Nan::New<String>("chromaSubsampling").ToLocalChecked());
+  if (c->IsBoolean()) {
+    opts->chroma_subsampling = c->BooleanValue() ? 420 : 444;
+  } else if (!c->IsUndefined()) {
+    Nan::Utf8String ratio(c);
+    const char *str = *ratio ? *ratio : "";
+    if (0 == strcmp("4:4:4", str)) opts->chroma_subsampling = 444;
+    else if (0 == strcmp("4:2:2", str)) opts->chroma_subsampling = 422;
+    else if (0 == strcmp("4:2:0", str)) opts->chroma_subsampling = 420;
+    else {
+      Nan::ThrowTypeError("chromaSubsampling must be a boolean, \"4:4:4\", \"4:2:2\" or \"4:2:0\".");
+      return false;
+    }
+  }
+
+  Local<Value> o = obj->Get(Nan::New<String>("optimizeCoding").ToLocalChecked());
+  if (!o->IsUndefined()) opts->optimize_coding = o->BooleanValue();
+
+  Local<Value> d = obj->Get(Nan::New<String>("dctMethod").ToLocalChecked());
+  if (!d->IsUndefined()) {
+    Nan::Utf8String method(d);
+    const char *str = *method ? *method : "";
+    if (0 == strcmp("islow", str)) opts->dct_method = JDCT_ISLOW;
+    else if (0 == strcmp("ifast", str)) opts->dct_method = JDCT_IFAST;
+    else if (0 == strcmp("float", str)) opts->dct_method = JDCT_FLOAT;
+    else {
+      Nan::ThrowTypeError("dctMethod must be \"islow\", \"ifast\" or \"float\".");
+      return false;
+    }
+  }
+
+  Local<Value> r = obj->Get(Nan::New<String>("restartInterval").ToLocalChecked());
+  if (!r->IsUndefined()) {
+    if (!r->IsUint32() || r->Uint32Value() > 65535) {
+      Nan::ThrowRangeError("restartInterval must be an integer in the range [0, 65535].");
+      return false;
+    }
+    opts->restart_interval = r->Uint32Value();
+  }
+
+  return true;
+}
+
+/*
+ * Encode JPEG data into the closure on the thread pool.
+ */
+
+void
+Canvas::ToJPEGBufferAsync(uv_work_t *req) {
+  closure_t *closure = (closure_t *) req->data;
+
+  // Already filled from the encode cache
+  if (closure->len) return;
+
+  closure->status = write_to_jpeg_buffer(
+      closure->surface
+    , &closure->jpeg
+    , closure);
+}
+
+#endif
+
+#ifdef HAVE_WEBP
+
+/*
+ * Parse the WebP encoder options object passed to toBuffer().
+ * Throws and returns false when an option is invalid.
+ */
+
+static bool
+parseWebPArgs(Local<Value> options, webp_options_t *opts) {
+  if (!options->IsObject()) return true;
+  Local<Object> obj = options->ToObject();
+
+  Local<Value> q = obj->Get(Nan::New<String>("quality").ToLocalChecked());
+  if (!q->IsUndefined()) {
+    if (!q->IsNumber()) {
+      Nan::ThrowTypeError("WebP quality must be a number.");
+      return false;
+    }
+    opts->quality = q->NumberValue();
+    if (!(opts->quality >= 0 && opts->quality <= 100)) {
+      Nan::ThrowRangeError("Allowed WebP quality lies in the range [0, 100].");
+      return false;
+    }
+  }
+
+  Local<Value> l = obj->Get(Nan::New<String>("lossless").ToLocalChecked());
+  if (!l->IsUndefined()) opts->lossless = l->BooleanValue();
+
+  Local<Value> m = obj->Get(Nan::New<String>("method").ToLocalChecked());
+  if (!m->IsUndefined()) {
+    if (!m->IsUint32() || m->Uint32Value() > 6) {
+      Nan::ThrowRangeError("WebP method must be an integer in the range [0, 6].");
+      return false;
+    }
+    opts->method = m->Uint32Value();
+  }
+
+  return true;
+}
+
+/*
+ * Encode WebP data into the closure on the thread pool.
+ */
+
+void
+Canvas::ToWebPBufferAsync(uv_work_t *req) {
+  closure_t *closure = (closure_t *) req->data;
+
+  // Already filled from the encode cache
+  if (closure->len) return;
+
+  closure->status = write_to_webp_buffer(
+      closure->surface
+    , &closure->webp
+    , closure);
+}
+
+#endif
+
+/*
+ * Convert PNG data to a node::Buffer, async when a
+ * callback function is passed. toBuffer("image/png", opts[, fn])
+ * takes the PNG options as an object, and may split the work across
+ * several threads. toBuffer("image/jpeg", opts[, fn]) and
+ * toBuffer("image/webp", opts[, fn]) encode a JPEG or WebP instead.
+ */
+
+NAN_METHOD(Canvas::ToBuffer) {
+  cairo_status_t status;
+  uint32_t compression_level = 6;
+  uint32_t filter = PNG_ALL_FILTERS;
+  uint32_t threads = 1;
+  palette_options_t palette = { 0, false };
+  bool max_compression = false;
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
+
+  // TODO: async / move this out
+  if (canvas->isPDF() || canvas->isSVG()) {
+    if (canvas->_pdfSink)
+      return Nan::ThrowError("The PDF is being streamed, call finishPDF() to end it");
+    Local<Object> document = canvas->document();
+    if (!document.IsEmpty()) info.GetReturnValue().Set(document);
+    return;
+  }
+
+  if (info.Length() >= 1 && info[0]->StrictEquals(Nan::New<String>("raw").ToLocalChecked())) {
+    cairo_surface_t *surface = canvas->surface();
+    cairo_surface_flush(surface);
+    const unsigned char *data = cairo_image_surface_get_data(surface);
+
+    // Return raw ARGB data -- just a memcpy()
+    if (!info[1]->IsObject()) {
+      Local<Object> buf = Nan::CopyBuffer(reinterpret_cast<const char*>(data), canvas->nBytes()).ToLocalChecked();
+      info.GetReturnValue().Set(buf);
+      return;
+    }
+
+    // Convert into the requested format, tightly packed
+    bool native = true;
+    pixel_format_t format = PIXEL_FORMAT_RGBA;
+    bool premultiplied = false;
+    Local<Value> target;
+    if (!parseRawOptions(info[1], &native, &format, &premultiplied, &target)) return;
+
+    size_t rowbytes = native ? canvas->stride() : canvas->width * pixel_format_bytes(format);
+    size_t len = rowbytes * canvas->height;
+    Local<Object> buf;
+    uint8_t *out;
+
+    if (target->IsUndefined()) {
+      out = (uint8_t *) malloc(len ? len : 1);
+      if (!out) return Nan::ThrowError(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+      buf = Nan::NewBuffer((char *) out, len, closure_buffer_free, NULL).ToLocalChecked();
+    } else {
+      buf = target.As<Object>();
+      if (Buffer::Length(buf) < len)
+        return Nan::ThrowRangeError("Buffer is too small for the requested format.");
+      out = (uint8_t *) Buffer::Data(buf);
+    }
+
+    if (native) {
+      memcpy(out, data, len);
+    } else {
+      for (int y = 0; y < canvas->height; y++) {
+        argb32_convert(
+            out + y * rowbytes
+          , data + y * canvas->stride()
+          , canvas->width
+          , format
+          , premultiplied);
+      }
+    }
+
+    info.GetReturnValue().Set(buf);
+    return;
+  }
+
+  if (info[0]->StrictEquals(Nan::New<String>("image/jpeg").ToLocalChecked())) {
+#ifdef HAVE_JPEG
+    jpeg_options_t opts;
+    Local<Value> fn = info[1]->IsFunction() ? info[1] : info[2];
+    if (fn->IsFunction() && work_pool_full(WORK_LANE_ENCODE))
+      return Nan::ThrowError("The encode queue is full");
+
+    jpeg_options_init(&opts);
+    if (!parseJPEGArgs(info[1], &opts)) return;
+
+    closure_t *closure = (closure_t *) malloc(sizeof(closure_t));
+    status = closure_init(closure, canvas, 0, PNG_NO_FILTERS);
+    if (status) {
+      closure_destroy(closure);
+      free(closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+    closure->jpeg = opts;
+    closure->encoding = CANVAS_ENCODING_JPEG;
+    closure_presize(closure, canvas->encodedSizeEstimate(CANVAS_ENCODING_JPEG));
+    bool cached = closure_cache_fetch(closure);
+
+    // Async
+    if (fn->IsFunction()) {
+      // Keep the surface alive should the canvas be resized meanwhile
+      closure->surface = cairo_surface_reference(canvas->surface());
+      canvas->Ref();
+      closure->pfn = new Nan::Callback(fn.As<Function>());
+      uv_work_t* req = new uv_work_t;
+      req->data = closure;
+      work_pool_queue(WORK_LANE_ENCODE, req, ToJPEGBufferAsync, (uv_after_work_cb)ToBufferAsyncAfter);
+      return;
+    }
+
+    // Sync
+    status = cached ? CAIRO_STATUS_SUCCESS : write_to_jpeg_buffer(canvas->surface(), &opts, closure);
+    if (status) {
+      closure_destroy(closure);
+      free(closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+
+    canvas->recordEncodedSize(closure->encoding, closure->len);
+    closure_cache_store(closure);
+    Local<Object> buf = closure_to_buffer(closure);
+    closure_destroy(closure);
+    free(closure);
+    info.GetReturnValue().Set(buf);
+    return;
+#else
+    return Nan::ThrowError("node-canvas was built without JPEG support");
+#endif
+  }
+
+  if (info[0]->StrictEquals(Nan::New<String>("image/webp").ToLocalChecked())) {
+#ifdef HAVE_WEBP
+    webp_options_t opts;
+    Local<Value> fn = info[1]->IsFunction() ? info[1] : info[2];
+    if (fn->IsFunction() && work_pool_full(WORK_LANE_ENCODE))
+      return Nan::ThrowError("The encode queue is full");
+
+    webp_options_init(&opts);
+    if (!parseWebPArgs(info[1], &opts)) return;
+
+    if (canvas->width > WEBP_MAX_DIMENSION || canvas->height > WEBP_MAX_DIMENSION)
+      return Nan::ThrowRangeError("WebP images are limited to 16383 pixels per side.");
+
+    closure_t *closure = (closure_t *) malloc(sizeof(closure_t));
+    status = closure_init(closure, canvas, 0, PNG_NO_FILTERS);
+    if (status) {
+      closure_destroy(closure);
+      free(closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+    closure->webp = opts;
+    closure->encoding = CANVAS_ENCODING_WEBP;
+    closure_presize(closure, canvas->encodedSizeEstimate(CANVAS_ENCODING_WEBP));
+    bool cached = closure_cache_fetch(closure);
+
+    // Async
+    if (fn->IsFunction()) {
+      // Keep the surface alive should the canvas be resized meanwhile
+      closure->surface = cairo_surface_reference(canvas->surface());
+      canvas->Ref();
+      closure->pfn = new Nan::Callback(fn.As<Function>());
+      uv_work_t* req = new uv_work_t;
+      req->data = closure;
+      work_pool_queue(WORK_LANE_ENCODE, req, ToWebPBufferAsync, (uv_after_work_cb)ToBufferAsyncAfter);
+      return;
+    }
+
+    // Sync
+    status = cached ? CAIRO_STATUS_SUCCESS : write_to_webp_buffer(canvas->surface(), &opts, closure);
+    if (status) {
+      closure_destroy(closure);
+      free(closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+
+    canvas->recordEncodedSize(closure->encoding, closure->len);
+    closure_cache_store(closure);
+    Local<Object> buf = closure_to_buffer(closure);
+    closure_destroy(closure);
+    free(closure);
+    info.GetReturnValue().Set(buf);
+    return;
+#else
+    return Nan::ThrowError("node-canvas was built without WebP support");
+#endif
+  }
+
+  Local<Value> fn = info[0];
+  if (info[0]->StrictEquals(Nan::New<String>("image/png").ToLocalChecked())) {
+    fn = info[1]->IsFunction() ? info[1] : info[2];
+    double time_budget;
+    if (!parsePNGOptions(info[1], &compression_level, &filter, &threads, &palette, &time_budget, &max_compression)) return;
+    if (time_budget) tunePNG(canvas, time_budget, threads, &compression_level, &filter);
+  } else if (!parsePNGArgs(info[1], info[2], &compression_level, &filter)) {
+    return;
+  }
+
+  // Async
+  if (fn->IsFunction()) {
+    if (work_pool_full(WORK_LANE_ENCODE))
+      return Nan::ThrowError("The encode queue is full");
+
+    closure_t *closure = (closure_t *) malloc(sizeof(closure_t));
+    status = closure_init(closure, canvas, compression_level, filter);
+    closure->threads = threads;
+    closure->palette = palette;
+    closure->max_compression = max_compression;
+
+    // ensure closure is ok
+    if (status) {
+      closure_destroy(closure);
+      free(closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+
+    closure_presize(closure, canvas->encodedSizeEstimate(CANVAS_ENCODING_PNG));
+    closure_cache_fetch(closure);
+
+    // TODO: only one callback fn in closure
+    closure->surface = cairo_surface_reference(canvas->surface());
+    canvas->Ref();
+    closure->pfn = new Nan::Callback(fn.As<Function>());
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+    uv_work_t* req = new uv_work_t;
+    req->data = closure;
+    work_pool_queue(WORK_LANE_ENCODE, req, ToBufferAsync, (uv_after_work_cb)ToBufferAsyncAfter);
+#else
+    eio_custom(EIO_ToBuffer, EIO_PRI_DEFAULT, EIO_AfterToBuffer, closure);
+    ev_ref(EV_DEFAULT_UC);
+#endif
+
+    return;
+  // Sync
+  } else {
+    closure_t closure;
+    status = closure_init(&closure, canvas, compression_level, filter);
+
+    // ensure closure is ok
+    if (status) {
+      closure_destroy(&closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    }
+
+    closure.threads = threads;
+    closure.palette = palette;
+    closure.max_compression = max_compression;
+    closure_presize(&closure, canvas->encodedSizeEstimate(CANVAS_ENCODING_PNG));
+
+    Nan::TryCatch try_catch;
+    if (!closure_cache_fetch(&closure))
+      status = write_to_png_buffer(canvas->surface(), &closure);
+
+    if (try_catch.HasCaught()) {
+      closure_destroy(&closure);
+      try_catch.ReThrow();
+      return;
+    } else if (status) {
+      closure_destroy(&closure);
+      return Nan::ThrowError(Canvas::Error(status));
+    } else {
+      canvas->recordEncodedSize(CANVAS_ENCODING_PNG, closure.len);
+      closure_cache_store(&closure);
+      Local<Object> buf = closure_to_buffer(&closure);
+      closure_destroy(&closure);
+      info.GetReturnValue().Set(buf);
+      return;
+    }
+  }
+}
+
+/*
+ * Initialize `closure` for encoding `canvas` as `format` with the
+ * options toBuffer() takes for it. Throws and returns false when the
+ * format is not supported or an option is invalid.
+ */
+
+static bool
+parseEncoderOptions(Canvas *canvas, const char *format, Local<Value> options, closure_t *closure) {
+  uint32_t compression_level = 6;
+  uint32_t filter = PNG_ALL_FILTERS;
+  uint32_t threads = 1;
+  palette_options_t palette = { 0, false };
+  bool max_compression = false;
+  canvas_encoding_t encoding;
+#ifdef HAVE_JPEG
+  jpeg_options_t jpeg;
+  jpeg_options_init(&jpeg);
+#endif
+#ifdef HAVE_WEBP
+  webp_options_t webp;
+  webp_options_init(&webp);
+#endif
+
+  if (!strcmp(format, "image/png")) {
+    encoding = CANVAS_ENCODING_PNG;
+    double time_budget;
+    if (!parsePNGOptions(options, &compression_level, &filter, &threads, &palette, &time_budget, &max_compression)) return false;
+    if (time_budget) tunePNG(canvas, time_budget, threads, &compression_level, &filter);
+#ifdef HAVE_JPEG
+  } else if (!strcmp(format, "image/jpeg")) {
+    encoding = CANVAS_ENCODING_JPEG;
+    if (!parseJPEGArgs(options, &jpeg)) return false;
+#endif
+#ifdef HAVE_WEBP
+  } else if (!strcmp(format, "image/webp")) {
+    encoding = CANVAS_ENCODING_WEBP;
+    if (!parseWebPArgs(options, &webp)) return false;
+    if (canvas->width > WEBP_MAX_DIMENSION || canvas->height > WEBP_MAX_DIMENSION) {
+      Nan::ThrowRangeError("WebP images are limited to 16383 pixels per side.");
+      return false;
+    }
+#endif
+  } else {
+    Nan::ThrowError("Unsupported format for an image canvas");
+    return false;
+  }
+
+  cairo_status_t status = closure_init(closure, canvas, compression_level, filter);
+  if (status) {
+    closure_destroy(closure);
+    Nan::ThrowError(Canvas::Error(status));
+    return false;
+  }
+  closure->encoding = encoding;
+  closure->threads = threads;
+  closure->palette = palette;
+  closure->max_compression = max_compression;
+#ifdef HAVE_JPEG
+  closure->jpeg = jpeg;
+#endif
+#ifdef HAVE_WEBP
+  closure->webp = webp;
+#endif
+  closure->status = CAIRO_STATUS_SUCCESS;
+  return true;
+}
+
+/*
+ * toFile() state: the encoder closure and the surface it encodes, or
+ * the finished PDF or SVG document kept alive while it is written, or
+ * a snapshot of a PDF that spilled to its temp file, and where it goes.
+ */
+
+typedef struct {
+  closure_t closure;
+  bool encode;
+  cairo_surface_t *surface;
+  const uint8_t *data;
+  size_t len;
+  Nan::Persistent<Object> document;
+  bool replay;
+  document_snapshot_t snapshot;
+  std::string path;
+  bool fsync;
+  int error;
+  const char *syscall;
+} file_closure_t;
+
+/*
+ * An open file being written by write_file(), and the libuv error
+ * a write failed with.
+ */
+
+typedef struct {
+  int fd;
+  int error;
+} file_writer_t;
+
+static cairo_status_t
+write_fd(void *closure, const uint8_t *data, size_t len) {
+  file_writer_t *writer = (file_writer_t *) closure;
+  size_t off = 0;
+  while (off < len) {
+    uv_fs_t req;
+    size_t n = len - off < INT_MAX ? len - off : INT_MAX;
+    uv_buf_t buf = uv_buf_init((char *) data + off, n);
+    int written = uv_fs_write(NULL, &req, writer->fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (written < 0) {
+      writer->error = written;
+      return CAIRO_STATUS_WRITE_ERROR;
+    }
+    off += written;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Write `len` bytes, or the document `snapshot` when given, to `path`
+ * through a file descriptor, synchronously, so from the thread pool.
+ * Returns 0 or a libuv error code, with the failing call in `syscall`.
+ */
+
+static int
+write_file(const char *path, const uint8_t *data, size_t len, const document_snapshot_t *snapshot, bool sync, const char **syscall) {
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, path, O_WRONLY | O_CREAT | O_TRUNC, 0666, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    *syscall = "open";
+    return fd;
+  }
+
+  int err = 0;
+  file_writer_t writer = { fd, 0 };
+  cairo_status_t status = snapshot
+    ? document_snapshot_replay(snapshot, write_fd, &writer)
+    : write_fd(&writer, data, len);
+  if (writer.error) {
+    err = writer.error;
+    *syscall = "write";
+  } else if (status) {
+    // Reading the spilled document back failed
+    err = CAIRO_STATUS_NO_MEMORY == status ? UV_ENOMEM : UV_EIO;
+    *syscall = "read";
+  }
+
+  if (!err && sync) {
+    err = uv_fs_fsync(NULL, &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+    if (err) *syscall = "fsync";
+  }
+
+  int closed = uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (!err && closed) {
+    err = closed;
+    *syscall = "close";
+  }
+  return err;
+}
+
+/*
+ * Encode the canvas, unless the closure was filled from the encode
+ * cache or a document is written, then write the file.
+ */
+
+void
+Canvas::ToFileAsync(uv_work_t *req) {
+  file_closure_t *file = (file_closure_t *) req->data;
+  closure_t *closure = &file->closure;
+
+  if (file->encode && !closure->len) {
+    cairo_surface_t *surface = file->surface;
+    switch (closure->encoding) {
+#ifdef HAVE_JPEG
+      case CANVAS_ENCODING_JPEG:
+        closure->status = write_to_jpeg_buffer(surface, &closure->jpeg, closure);
+        break;
+#endif
+#ifdef HAVE_WEBP
+      case CANVAS_ENCODING_WEBP:
+        closure->status = write_to_webp_buffer(surface, &closure->webp, closure);
+        break;
+#endif
+      default:
+        closure->status = write_to_png_buffer(surface, closure);
+    }
+  }
+  if (closure->status) return;
+
+  if (file->encode) {
+    file->data = closure->data;
+    file->len = closure->len;
+  }
+  file->error = write_file(file->path.c_str(), file->data, file->len
+    , file->replay ? &file->snapshot : NULL, file->fsync, &file->syscall);
+}
+
+void
+Canvas::ToFileAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  file_closure_t *file = (file_closure_t *) req->data;
+  closure_t *closure = &file->closure;
+  delete req;
+
+  if (closure->status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->status) };
+    closure->pfn->Call(1, argv);
+  } else {
+    if (file->encode) {
+      closure->canvas->recordEncodedSize(closure->encoding, closure->len);
+      closure_cache_store(closure);
+    }
+    Local<Value> argv[1] = { Nan::Null() };
+    if (file->error) {
+      argv[0] = node::UVException(v8::Isolate::GetCurrent(), file->error, file->syscall, NULL, file->path.c_str());
+    }
+    closure->pfn->Call(1, argv);
+  }
+
+  closure->canvas->Unref();
+  delete closure->pfn;
+  if (file->encode) closure_destroy(closure);
+  if (file->surface) cairo_surface_destroy(file->surface);
+  document_snapshot_destroy(&file->snapshot);
+  file->document.Reset();
+  delete file;
+}
+
+/*
+ * Encode the canvas as `format` and write it to `path`, both on the
+ * thread pool:
+ *
+ *  _toFile(path, format, opts, fn)
+ *
+ * `opts` takes the options of the format as passed to toBuffer(), and
+ * `fsync`. PDF and SVG canvases are finished and written as they are.
+ */
+
+NAN_METHOD(Canvas::ToFile) {
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("path must be a string");
+  if (!info[3]->IsFunction())
+    return Nan::ThrowTypeError("callback function required");
+  if (work_pool_full(WORK_LANE_ENCODE))
+    return Nan::ThrowError("The encode queue is full");
+
+  String::Utf8Value format(info[1]);
+  Local<Value> options = info[2];
+  bool sync = options->IsObject()
+    && options->ToObject()->Get(Nan::New<String>("fsync").ToLocalChecked())->BooleanValue();
+
+  file_closure_t *file = new file_closure_t;
+  file->path = *String::Utf8Value(info[0]);
+  file->fsync = sync;
+  file->error = 0;
+  file->syscall = NULL;
+  file->surface = NULL;
+  file->data = NULL;
+  file->len = 0;
+  file->replay = false;
+  document_snapshot_init(&file->snapshot);
+  file->encode = !canvas->isPDF() && !canvas->isSVG();
+  closure_t *closure = &file->closure;
+
+  if (!file->encode) {
+    const char *mime = canvas->isPDF() ? "application/pdf" : "image/svg+xml";
+    if (strcmp(*format, mime)) {
+      delete file;
+      return Nan::ThrowError(canvas->isPDF()
+        ? "PDF canvases can only be written as application/pdf"
+        : "SVG canvases can only be written as image/svg+xml");
+    }
+    if (canvas->_pdfSink) {
+      delete file;
+      return Nan::ThrowError("The PDF is being streamed, call finishPDF() to end it");
+    }
+    document_t *doc = (document_t *) canvas->closure();
+    if (canvas->isPDF() && canvas->_document.IsEmpty() && doc->spilled) {
+      // Copied from the temp file on the thread pool, not read back here
+      cairo_surface_finish(canvas->surface());
+      cairo_status_t status = doc->status;
+      if (!status) status = document_snapshot(doc, &file->snapshot);
+      if (status) {
+        delete file;
+        return Nan::ThrowError(Canvas::Error(status));
+      }
+      file->replay = true;
+    } else {
+      Local<Object> document = canvas->document();
+      if (document.IsEmpty()) {
+        delete file;
+        return;
+      }
+      file->document.Reset(document);
+      file->data = (const uint8_t *) Buffer::Data(document);
+      file->len = Buffer::Length(document);
+    }
+    closure->canvas = canvas;
+    closure->status = CAIRO_STATUS_SUCCESS;
+  } else {
+    if (!parseEncoderOptions(canvas, *format, options, closure)) {
+      delete file;
+      return;
+    }
+    closure_presize(closure, canvas->encodedSizeEstimate(closure->encoding));
+    closure_cache_fetch(closure);
+    // Keep the surface alive should the canvas be resized meanwhile
+    file->surface = cairo_surface_reference(canvas->surface());
+  }
+
+  canvas->Ref();
+  closure->pfn = new Nan::Callback(info[3].As<Function>());
+  uv_work_t *req = new uv_work_t;
+  req->data = file;
+  work_pool_queue(WORK_LANE_ENCODE, req, ToFileAsync, (uv_after_work_cb)ToFileAsyncAfter);
+}
+
+struct batch_t;
+
+/*
+ * One output of toBuffers(): its encoder closure, its size, the
+ * surface it is encoded from, the canvas's own or a downscaled copy,
+ * and the request encoding it.
+ */
+
+typedef struct {
+  closure_t closure;
+  int width;
+  int height;
+  cairo_surface_t *surface;
+  batch_t *batch;
+  uv_work_t req;
+} batch_output_t;
+
+/*
+ * toBuffers() state. `pending` counts the outputs still being encoded
+ * once the downscaled surfaces are made.
+ */
+
+struct batch_t {
+  Canvas *canvas;
+  cairo_surface_t *surface;
+  Nan::Callback *pfn;
+  std::vector<batch_output_t> outputs;
+  std::vector<cairo_surface_t *> scaled;
+  size_t pending;
+  cairo_status_t status;
+};
+
+/*
+ * Call back with the Buffers, or the first error, and free the batch.
+ * The caller drops its reference to the canvas.
+ */
+
+static void
+finish_batch(batch_t *batch) {
+  Canvas *canvas = batch->canvas;
+
+  cairo_status_t status = batch->status;
+  for (size_t i = 0; !status && i < batch->outputs.size(); i++) {
+    status = batch->outputs[i].closure.status;
+  }
+
+  if (status) {
+    Local<Value> argv[1] = { Canvas::Error(status) };
+    batch->pfn->Call(1, argv);
+  } else {
+    Local<Array> buffers = Nan::New<Array>(batch->outputs.size());
+    for (size_t i = 0; i < batch->outputs.size(); i++) {
+      batch_output_t &output = batch->outputs[i];
+      if (output.width == canvas->width && output.height == canvas->height) {
+        canvas->recordEncodedSize(output.closure.encoding, output.closure.len);
+        closure_cache_store(&output.closure);
+      }
+      Nan::Set(buffers, i, closure_to_buffer(&output.closure));
+    }
+    Local<Value> argv[2] = { Nan::Null(), buffers };
+    batch->pfn->Call(2, argv);
+  }
+
+  for (size_t i = 0; i < batch->outputs.size(); i++) closure_destroy(&batch->outputs[i].closure);
+  for (size_t i = 0; i < batch->scaled.size(); i++) cairo_surface_destroy(batch->scaled[i]);
+  cairo_surface_destroy(batch->surface);
+  delete batch->pfn;
+  delete batch;
+}
+
+static void
+encode_batch_output(uv_work_t *req) {
+  batch_output_t *output = (batch_output_t *) req->data;
+  closure_t *closure = &output->closure;
+
+  // Already filled from the encode cache
+  if (closure->len) return;
+
+  switch (closure->encoding) {
+#ifdef HAVE_JPEG
+    case CANVAS_ENCODING_JPEG:
+      closure->status = write_to_jpeg_buffer(output->surface, &closure->jpeg, closure);
+      break;
+#endif
+#ifdef HAVE_WEBP
+    case CANVAS_ENCODING_WEBP:
+      closure->status = write_to_webp_buffer(output->surface, &closure->webp, closure);
+      break;
+#endif
+    default:
+      closure->status = write_to_png_buffer(output->surface, closure);
+  }
+}
+
+struct larger_output {
+  const std::vector<batch_output_t> *outputs;
+  bool operator()(size_t a, size_t b) const {
+    return (int64_t) (*outputs)[a].width * (*outputs)[a].height
+      > (int64_t) (*outputs)[b].width * (*outputs)[b].height;
+  }
+};
+
+void
+Canvas::ToBuffersOutputAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  batch_t *batch = ((batch_output_t *) req->data)->batch;
+  if (--batch->pending) return;
+  Canvas *canvas = batch->canvas;
+  finish_batch(batch);
+  canvas->Unref();
+}
+
+/*
+ * Produce the downscaled surfaces, largest first so that each one is
+ * derived from the smallest surface already made that covers it
+ * rather than from the full canvas. The outputs are then encoded in
+ * parallel, each as a request of its own.
  */
 
-#if NODE_VERSION_AT_LEAST(0, 6, 0)
 void
-Canvas::ToBufferAsyncAfter(uv_work_t *req) {
-#else
-int
-Canvas::EIO_AfterToBuffer(eio_req *req) {
-#endif
+Canvas::ToBuffersAsync(uv_work_t *req) {
+  batch_t *batch = (batch_t *) req->data;
+  std::vector<batch_output_t> &outputs = batch->outputs;
+  cairo_surface_t *full = batch->surface;
+  cairo_format_t format = cairo_image_surface_get_format(full);
+
+  std::vector<size_t> order(outputs.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  larger_output larger = { &outputs };
+  std::stable_sort(order.begin(), order.end(), larger);
+
+  std::vector<cairo_surface_t *> levels(1, full);
+  for (size_t k = 0; k < order.size(); k++) {
+    batch_output_t &output = outputs[order[k]];
+    cairo_surface_t *src = NULL;
+    for (size_t l = 0; l < levels.size(); l++) {
+      int w = cairo_image_surface_get_width(levels[l]);
+      int h = cairo_image_surface_get_height(levels[l]);
+      if (w < output.width || h < output.height) continue;
+      if (!src || (int64_t) w * h < (int64_t) cairo_image_surface_get_width(src) * cairo_image_surface_get_height(src))
+        src = levels[l];
+    }
 
-  Nan::HandleScope scope;
-  closure_t *closure = (closure_t *) req->data;
-#if NODE_VERSION_AT_LEAST(0, 6, 0)
-  delete req;
-#else
-  ev_unref(EV_DEFAULT_UC);
-#endif
+    if (cairo_image_surface_get_width(src) == output.width
+        && cairo_image_surface_get_height(src) == output.height) {
+      output.surface = src;
+      continue;
+    }
 
-  if (closure->status) {
-    Local<Value> argv[1] = { Canvas::Error(closure->status) };
-    closure->pfn->Call(1, argv);
-  } else {
-    Local<Object> buf = Nan::CopyBuffer((char*)closure->data, closure->len).ToLocalChecked();
-    memcpy(Buffer::Data(buf), closure->data, closure->len);
-    Local<Value> argv[2] = { Nan::Null(), buf };
-    closure->pfn->Call(2, argv);
+    cairo_surface_t *dst = cairo_image_surface_create(format, output.width, output.height);
+    if (cairo_surface_status(dst)) {
+      batch->status = cairo_surface_status(dst);
+      cairo_surface_destroy(dst);
+      return;
+    }
+    cairo_surface_flush(dst);
+    argb32_downscale(
+        cairo_image_surface_get_data(src)
+      , cairo_image_surface_get_width(src)
+      , cairo_image_surface_get_height(src)
+      , cairo_image_surface_get_stride(src)
+      , cairo_image_surface_get_data(dst)
+      , output.width
+      , output.height
+      , cairo_image_surface_get_stride(dst));
+    cairo_surface_mark_dirty(dst);
+    batch->scaled.push_back(dst);
+    levels.push_back(dst);
+    output.surface = dst;
   }
-
-  closure->canvas->Unref();
-  delete closure->pfn;
-  closure_destroy(closure);
-  free(closure);
-
-#if !NODE_VERSION_AT_LEAST(0, 6, 0)
-  return 0;
-#endif
 }
 
 /*
- * Convert PNG data to a node::Buffer, async when a
- * callback function is passed.
+ * Queue the encode of every output, the last one to finish calling
+ * back.
  */
 
-NAN_METHOD(Canvas::ToBuffer) {
-  cairo_status_t status;
-  uint32_t compression_level = 6;
-  uint32_t filter = PNG_ALL_FILTERS;
-  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
-
-  // TODO: async / move this out
-  if (canvas->isPDF() || canvas->isSVG()) {
-    cairo_surface_finish(canvas->surface());
-    closure_t *closure = (closure_t *) canvas->closure();
+void
+Canvas::ToBuffersAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  batch_t *batch = (batch_t *) req->data;
+  delete req;
 
-    Local<Object> buf = Nan::CopyBuffer((char*) closure->data, closure->len).ToLocalChecked();
-    info.GetReturnValue().Set(buf);
+  if (batch->status) {
+    Canvas *canvas = batch->canvas;
+    finish_batch(batch);
+    canvas->Unref();
     return;
   }
 
-  if (info.Length() >= 1 && info[0]->StrictEquals(Nan::New<String>("raw").ToLocalChecked())) {
-    // Return raw ARGB data -- just a memcpy()
-    cairo_surface_t *surface = canvas->surface();
-    cairo_surface_flush(surface);
-    const unsigned char *data = cairo_image_surface_get_data(surface);
-    Local<Object> buf = Nan::CopyBuffer(reinterpret_cast<const char*>(data), canvas->nBytes()).ToLocalChecked();
-    info.GetReturnValue().Set(buf);
-    return;
+  batch->pending = batch->outputs.size();
+  for (size_t i = 0; i < batch->outputs.size(); i++) {
+    batch_output_t *output = &batch->outputs[i];
+    output->batch = batch;
+    output->req.data = output;
+    work_pool_queue(WORK_LANE_ENCODE, &output->req, encode_batch_output, (uv_after_work_cb)ToBuffersOutputAsyncAfter);
   }
+}
 
-  if (info.Length() > 1 && !(info[1]->IsUndefined() && info[2]->IsUndefined())) {
-    if (!info[1]->IsUndefined()) {
-        bool good = true;
-        if (info[1]->IsNumber()) {
-          compression_level = info[1]->Uint32Value();
-        } else if (info[1]->IsString()) {
-          if (info[1]->StrictEquals(Nan::New<String>("0").ToLocalChecked())) {
-            compression_level = 0;
-          } else {
-            uint32_t tmp = info[1]->Uint32Value();
-            if (tmp == 0) {
-              good = false;
-            } else {
-              compression_level = tmp;
-            }
-          }
-       } else {
-         good = false;
-       }
-
-       if (good) {
-         if (compression_level > 9) {
-           return Nan::ThrowRangeError("Allowed compression levels lie in the range [0, 9].");
-         }
-       } else {
-        return Nan::ThrowTypeError("Compression level must be a number.");
-       }
-    }
-
-    if (!info[2]->IsUndefined()) {
-      if (info[2]->IsUint32()) {
-        filter = info[2]->Uint32Value();
-      } else {
-        return Nan::ThrowTypeError("Invalid filter value.");
-      }
-    }
-  }
+/*
+ * Encode several outputs from one read of the canvas:
+ *
+ *  toBuffers([{ format, width, height, ...options }, ...], fn)
+ *
+ * Each spec takes the options toBuffer() takes for its format, and
+ * optionally a smaller size; given only one of width and height the
+ * aspect ratio is kept. `fn` is called with the Buffers in order.
+ */
 
-  // Async
-  if (info[0]->IsFunction()) {
-    closure_t *closure = (closure_t *) malloc(sizeof(closure_t));
-    status = closure_init(closure, canvas, compression_level, filter);
+NAN_METHOD(Canvas::ToBuffers) {
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
 
-    // ensure closure is ok
-    if (status) {
-      closure_destroy(closure);
-      free(closure);
-      return Nan::ThrowError(Canvas::Error(status));
+  if (canvas->isPDF() || canvas->isSVG())
+    return Nan::ThrowError("Only image canvases can be encoded to several outputs");
+  if (!info[0]->IsArray() || !info[0].As<Array>()->Length())
+    return Nan::ThrowTypeError("An array of output specs is required");
+  if (!info[1]->IsFunction())
+    return Nan::ThrowTypeError("callback function required");
+  if (work_pool_full(WORK_LANE_ENCODE))
+    return Nan::ThrowError("The encode queue is full");
+
+  Local<Array> specs = info[0].As<Array>();
+  batch_t *batch = new batch_t;
+  batch->canvas = canvas;
+  batch->pending = 0;
+  batch->status = CAIRO_STATUS_SUCCESS;
+  batch->outputs.reserve(specs->Length());
+
+  for (uint32_t i = 0; i < specs->Length(); i++) {
+    Local<Value> spec = specs->Get(i);
+    if (!spec->IsObject()) {
+      Nan::ThrowTypeError("Output specs must be objects");
+      break;
     }
+    Local<Object> obj = spec->ToObject();
 
-    // TODO: only one callback fn in closure
-    canvas->Ref();
-    closure->pfn = new Nan::Callback(info[0].As<Function>());
-
-#if NODE_VERSION_AT_LEAST(0, 6, 0)
-    uv_work_t* req = new uv_work_t;
-    req->data = closure;
-    uv_queue_work(uv_default_loop(), req, ToBufferAsync, (uv_after_work_cb)ToBufferAsyncAfter);
-#else
-    eio_custom(EIO_ToBuffer, EIO_PRI_DEFAULT, EIO_AfterToBuffer, closure);
-    ev_ref(EV_DEFAULT_UC);
-#endif
-
-    return;
-  // Sync
-  } else {
-    closure_t closure;
-    status = closure_init(&closure, canvas, compression_level, filter);
+    Local<Value> type = obj->Get(Nan::New<String>("format").ToLocalChecked());
+    std::string format = type->IsUndefined() ? "image/png" : *String::Utf8Value(type);
 
-    // ensure closure is ok
-    if (status) {
-      closure_destroy(&closure);
-      return Nan::ThrowError(Canvas::Error(status));
+    double width = canvas->width, height = canvas->height;
+    Local<Value> w = obj->Get(Nan::New<String>("width").ToLocalChecked());
+    Local<Value> h = obj->Get(Nan::New<String>("height").ToLocalChecked());
+    if ((!w->IsUndefined() && !w->IsNumber()) || (!h->IsUndefined() && !h->IsNumber())) {
+      Nan::ThrowTypeError("Output width and height must be numbers");
+      break;
+    }
+    if (w->IsNumber() && h->IsNumber()) {
+      width = w->NumberValue();
+      height = h->NumberValue();
+    } else if (w->IsNumber()) {
+      width = w->NumberValue();
+      height = round(canvas->height * width / canvas->width);
+    } else if (h->IsNumber()) {
+      height = h->NumberValue();
+      width = round(canvas->width * height / canvas->height);
+    }
+    width = floor(width);
+    height = floor(height);
+    if (!(width >= 1 && width <= canvas->width && height >= 1 && height <= canvas->height)) {
+      Nan::ThrowRangeError("Output sizes must lie between 1 pixel and the canvas size.");
+      break;
     }
 
-    Nan::TryCatch try_catch;
-    status = canvas_write_to_png_stream(canvas->surface(), toBuffer, &closure);
-
-    if (try_catch.HasCaught()) {
-      closure_destroy(&closure);
-      try_catch.ReThrow();
-      return;
-    } else if (status) {
-      closure_destroy(&closure);
-      return Nan::ThrowError(Canvas::Error(status));
-    } else {
-      Local<Object> buf = Nan::CopyBuffer((char *)closure.data, closure.len).ToLocalChecked();
-      closure_destroy(&closure);
-      info.GetReturnValue().Set(buf);
-      return;
+    batch_output_t output;
+    output.width = (int) width;
+    output.height = (int) height;
+    output.surface = NULL;
+    if (!parseEncoderOptions(canvas, format.c_str(), obj, &output.closure)) break;
+    if (output.width == canvas->width && output.height == canvas->height) {
+      closure_presize(&output.closure, canvas->encodedSizeEstimate(output.closure.encoding));
+      closure_cache_fetch(&output.closure);
     }
+    batch->outputs.push_back(output);
+  }
+
+  if (batch->outputs.size() != specs->Length()) {
+    for (size_t i = 0; i < batch->outputs.size(); i++) closure_destroy(&batch->outputs[i].closure);
+    delete batch;
+    return;
   }
+
+  cairo_surface_flush(canvas->surface());
+  // Keep the surface alive should the canvas be resized meanwhile
+  batch->surface = cairo_surface_reference(canvas->surface());
+  canvas->Ref();
+  batch->pfn = new Nan::Callback(info[1].As<Function>());
+  uv_work_t *req = new uv_work_t;
+  req->data = batch;
+  work_pool_queue(WORK_LANE_ENCODE, req, ToBuffersAsync, (uv_after_work_cb)ToBuffersAsyncAfter);
 }
 
 /*
@@ -396,51 +1549,13 @@ streamPNG(void *c, const uint8_t *data, unsigned len) {
 NAN_METHOD(Canvas::StreamPNGSync) {
   uint32_t compression_level = 6;
   uint32_t filter = PNG_ALL_FILTERS;
-  // TODO: async as well
   if (!info[0]->IsFunction())
     return Nan::ThrowTypeError("callback function required");
 
-  if (info.Length() > 1 && !(info[1]->IsUndefined() && info[2]->IsUndefined())) {
-    if (!info[1]->IsUndefined()) {
-        bool good = true;
-        if (info[1]->IsNumber()) {
-          compression_level = info[1]->Uint32Value();
-        } else if (info[1]->IsString()) {
-          if (info[1]->StrictEquals(Nan::New<String>("0").ToLocalChecked())) {
-            compression_level = 0;
-          } else {
-            uint32_t tmp = info[1]->Uint32Value();
-            if (tmp == 0) {
-              good = false;
-            } else {
-              compression_level = tmp;
-            }
-          }
-       } else {
-         good = false;
-       }
-
-       if (good) {
-         if (compression_level > 9) {
-           return Nan::ThrowRangeError("Allowed compression levels lie in the range [0, 9].");
-         }
-       } else {
-        return Nan::ThrowTypeError("Compression level must be a number.");
-       }
-    }
-
-    if (!info[2]->IsUndefined()) {
-      if (info[2]->IsUint32()) {
-        filter = info[2]->Uint32Value();
-      } else {
-        return Nan::ThrowTypeError("Invalid filter value.");
-      }
-    }
-  }
-
+  if (!parsePNGArgs(info[1], info[2], &compression_level, &filter)) return;
 
   Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
-  closure_t closure;
+  closure_t closure = {};
   closure.fn = Local<Function>::Cast(info[0]);
   closure.compression_level = compression_level;
   closure.filter = filter;
@@ -517,17 +1632,28 @@ NAN_METHOD(Canvas::StreamPDFSync) {
 
   if (!canvas->isPDF())
     return Nan::ThrowTypeError("wrong canvas type");
+  if (canvas->_pdfSink)
+    return Nan::ThrowError("The PDF is already being streamed");
 
-  cairo_surface_finish(canvas->surface());
-
+  document_t *doc = (document_t *) canvas->closure();
   closure_t closure;
-  closure.data = static_cast<closure_t *>(canvas->closure())->data;
-  closure.len = static_cast<closure_t *>(canvas->closure())->len;
   closure.fn = info[0].As<Function>();
 
   Nan::TryCatch try_catch;
+  cairo_status_t status;
 
-  cairo_status_t status = canvas_write_to_pdf_stream(canvas->surface(), streamPDF, &closure);
+  // A spilled document is read back from its temp file a chunk at a time
+  if (canvas->_document.IsEmpty() && doc->spilled) {
+    cairo_surface_finish(canvas->surface());
+    status = doc->status;
+    if (!status) status = document_replay(doc, streamPDF, &closure);
+  } else {
+    Local<Object> document = canvas->document();
+    if (document.IsEmpty()) return;
+    closure.data = (uint8_t *) Buffer::Data(document);
+    closure.len = Buffer::Length(document);
+    status = canvas_write_to_pdf_stream(canvas->surface(), streamPDF, &closure);
+  }
 
   if (try_catch.HasCaught()) {
     try_catch.ReThrow();
@@ -543,6 +1669,79 @@ NAN_METHOD(Canvas::StreamPDFSync) {
   }
 }
 
+/*
+ * Pass a chunk of a streamed PDF to its callback.
+ */
+
+static cairo_status_t
+streamPDFChunk(void *c, const uint8_t *data, size_t len) {
+  Nan::HandleScope scope;
+  Nan::Callback *fn = static_cast<Nan::Callback *>(c);
+  Local<Value> argv[3] = {
+      Nan::Null()
+    , Nan::CopyBuffer((const char *) data, len).ToLocalChecked()
+    , Nan::New<Number>(len) };
+  fn->Call(3, argv);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Stream the PDF as it is produced: the bytes written so far and then
+ * each page as it is added are passed to the callback, and the
+ * document is ended by finishPDF(). Nothing is kept in memory.
+ */
+
+NAN_METHOD(Canvas::StreamPDF) {
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("callback function required");
+
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.Holder());
+
+  if (!canvas->isPDF())
+    return Nan::ThrowTypeError("wrong canvas type");
+  if (canvas->_pdfSink)
+    return Nan::ThrowError("The PDF is already being streamed");
+  if (!canvas->_document.IsEmpty())
+    return Nan::ThrowError("The PDF has already been finished");
+
+  canvas->_pdfSink = new Nan::Callback(info[0].As<Function>());
+  document_set_flush((document_t *) canvas->closure(), streamPDFChunk, canvas->_pdfSink);
+}
+
+/*
+ * Finish a PDF. A streamed PDF has its remaining bytes passed on and
+ * its callback called a last time with a null chunk.
+ */
+
+NAN_METHOD(Canvas::FinishPDF) {
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.Holder());
+
+  if (!canvas->isPDF())
+    return Nan::ThrowTypeError("wrong canvas type");
+
+  document_t *doc = (document_t *) canvas->closure();
+  cairo_surface_finish(canvas->surface());
+  if (!canvas->_pdfSink) return;
+
+  Nan::Callback *fn = canvas->_pdfSink;
+  cairo_status_t status = doc->status;
+  if (!status) status = document_flush(doc);
+  document_set_flush(doc, NULL, NULL);
+  canvas->_pdfSink = NULL;
+
+  if (status) {
+    Local<Value> error = Canvas::Error(status);
+    fn->Call(1, &error);
+  } else {
+    Local<Value> argv[3] = {
+        Nan::Null()
+      , Nan::Null()
+      , Nan::New<Uint32>(0) };
+    fn->Call(3, argv);
+  }
+  delete fn;
+}
+
 /*
  * Stream JPEG data synchronously.
  */
@@ -553,19 +1752,21 @@ NAN_METHOD(Canvas::StreamJPEGSync) {
   // TODO: async as well
   if (!info[0]->IsNumber())
     return Nan::ThrowTypeError("buffer size required");
-  if (!info[1]->IsNumber())
-    return Nan::ThrowTypeError("quality setting required");
-  if (!info[2]->IsBoolean())
-    return Nan::ThrowTypeError("progressive setting required");
-  if (!info[3]->IsFunction())
+  if (!info[1]->IsObject())
+    return Nan::ThrowTypeError("options object required");
+  if (!info[2]->IsFunction())
     return Nan::ThrowTypeError("callback function required");
 
+  jpeg_options_t opts;
+  jpeg_options_init(&opts);
+  if (!parseJPEGArgs(info[1], &opts)) return;
+
   Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
   closure_t closure;
-  closure.fn = Local<Function>::Cast(info[3]);
+  closure.fn = Local<Function>::Cast(info[2]);
 
   Nan::TryCatch try_catch;
-  write_to_jpeg_stream(canvas->surface(), info[0]->NumberValue(), info[1]->NumberValue(), info[2]->BooleanValue(), &closure);
+  write_to_jpeg_stream(canvas->surface(), info[0]->NumberValue(), &opts, &closure);
 
   if (try_catch.HasCaught()) {
     try_catch.ReThrow();
@@ -575,6 +1776,80 @@ NAN_METHOD(Canvas::StreamJPEGSync) {
 
 #endif
 
+/*
+ * Estimate the size in bytes of the canvas encoded as the given type,
+ * "image/png" by default.
+ *
+ * Examples:
+ *
+ *    canvas.estimateEncodedSize()
+ *    canvas.estimateEncodedSize('image/jpeg')
+ */
+
+NAN_METHOD(Canvas::EstimateEncodedSize) {
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
+  canvas_encoding_t encoding = CANVAS_ENCODING_PNG;
+
+  if (canvas->isPDF() || canvas->isSVG())
+    return Nan::ThrowError("Encoded size estimates are only available for image canvases");
+
+  if (!info[0]->IsUndefined()) {
+    String::Utf8Value str(info[0]);
+    if (0 == strcmp("image/png", *str)) encoding = CANVAS_ENCODING_PNG;
+    else if (0 == strcmp("image/jpeg", *str)) encoding = CANVAS_ENCODING_JPEG;
+    else if (0 == strcmp("image/webp", *str)) encoding = CANVAS_ENCODING_WEBP;
+    else return Nan::ThrowTypeError("Unsupported image type");
+  }
+
+  info.GetReturnValue().Set(Nan::New<Number>(canvas->encodedSizeEstimate(encoding)));
+}
+
+/*
+ * Create an incremental encoder for the PNG and JPEG streams. Output
+ * is only produced as chunks are read from it. Takes the PNG options
+ * of toBuffer("image/png", opts) (minus threads) or the JPEG stream
+ * options, where `bufsize` sets the initial size of each chunk.
+ */
+
+NAN_METHOD(Canvas::CreateEncoder) {
+  Canvas *canvas = Nan::ObjectWrap::Unwrap<Canvas>(info.This());
+  canvas_encoding_t encoding = CANVAS_ENCODING_PNG;
+  unsigned chunk_size = 0;
+  uint32_t threads = 1;
+  closure_t settings;
+
+  if (canvas->isPDF() || canvas->isSVG())
+    return Nan::ThrowError("Only image canvases can be encoded incrementally");
+
+  settings.compression_level = 6;
+  settings.filter = PNG_ALL_FILTERS;
+  settings.palette.max_colors = 0;
+  settings.palette.dither = false;
+
+  if (info[0]->StrictEquals(Nan::New<String>("image/jpeg").ToLocalChecked())) {
+#ifdef HAVE_JPEG
+    encoding = CANVAS_ENCODING_JPEG;
+    jpeg_options_init(&settings.jpeg);
+    if (!parseJPEGArgs(info[1], &settings.jpeg)) return;
+    if (info[1]->IsObject()) {
+      Local<Value> bufsize = info[1]->ToObject()->Get(Nan::New<String>("bufsize").ToLocalChecked());
+      if (bufsize->IsUint32()) chunk_size = bufsize->Uint32Value();
+    }
+#else
+    return Nan::ThrowError("node-canvas was built without JPEG support");
+#endif
+  } else if (info[0]->StrictEquals(Nan::New<String>("image/png").ToLocalChecked())) {
+    double time_budget;
+    bool max_compression;
+    if (!parsePNGOptions(info[1], &settings.compression_level, &settings.filter, &threads, &settings.palette, &time_budget, &max_compression)) return;
+    if (time_budget) tunePNG(canvas, time_budget, 1, &settings.compression_level, &settings.filter);
+  } else {
+    return Nan::ThrowTypeError("Unsupported image type");
+  }
+
+  info.GetReturnValue().Set(ImageEncoder::NewInstance(info.This(), encoding, &settings, chunk_size));
+}
+
 char *
 str_value(Local<Value> val, const char *fallback, bool can_be_number) {
   if (val->IsString() || (can_be_number && val->IsNumber())) {
@@ -586,6 +1861,49 @@ str_value(Local<Value> val, const char *fallback, bool can_be_number) {
   }
 }
 
+/*
+ * Read, and with an options object set, the sizes of the encode and
+ * decode thread pools:
+ *
+ *  Canvas.workPool({ encodeThreads, decodeThreads, queueDepth })
+ *
+ * All options are optional. Returns the settings in effect.
+ */
+
+NAN_METHOD(Canvas::WorkPool) {
+  if (info[0]->IsObject()) {
+    Local<Object> options = info[0]->ToObject();
+    const char *names[] = { "encodeThreads", "decodeThreads", "queueDepth" };
+    uint32_t values[3];
+    for (int i = 0; i < 3; i++) {
+      Local<Value> value = options->Get(Nan::New<String>(names[i]).ToLocalChecked());
+      if (value->IsUndefined()) {
+        values[i] = UINT32_MAX;
+      } else if (!value->IsUint32() || (i < 2 && !value->Uint32Value())) {
+        return Nan::ThrowRangeError(i < 2
+          ? "Thread counts must be positive integers."
+          : "queueDepth must be a non-negative integer.");
+      } else {
+        values[i] = value->Uint32Value();
+      }
+    }
+    if (values[0] != UINT32_MAX) work_pool_set_threads(WORK_LANE_ENCODE, values[0]);
+    if (values[1] != UINT32_MAX) work_pool_set_threads(WORK_LANE_DECODE, values[1]);
+    if (values[2] != UINT32_MAX) {
+      work_pool_set_queue_depth(WORK_LANE_ENCODE, values[2]);
+      work_pool_set_queue_depth(WORK_LANE_DECODE, values[2]);
+    }
+  } else if (!info[0]->IsUndefined()) {
+    return Nan::ThrowTypeError("Options must be an object.");
+  }
+
+  Local<Object> settings = Nan::New<Object>();
+  Nan::Set(settings, Nan::New("encodeThreads").ToLocalChecked(), Nan::New<Uint32>(work_pool_threads(WORK_LANE_ENCODE)));
+  Nan::Set(settings, Nan::New("decodeThreads").ToLocalChecked(), Nan::New<Uint32>(work_pool_threads(WORK_LANE_DECODE)));
+  Nan::Set(settings, Nan::New("queueDepth").ToLocalChecked(), Nan::New<Uint32>(work_pool_queue_depth(WORK_LANE_ENCODE)));
+  info.GetReturnValue().Set(settings);
+}
+
 NAN_METHOD(Canvas::RegisterFont) {
   if (!info[0]->IsString()) {
     return Nan::ThrowError("Wrong argument type");
@@ -650,25 +1968,27 @@ NAN_METHOD(Canvas::RegisterFont) {
  * Initialize cairo surface.
  */
 
-Canvas::Canvas(int w, int h, canvas_type_t t): Nan::ObjectWrap() {
+Canvas::Canvas(int w, int h, canvas_type_t t, size_t spill_threshold): Nan::ObjectWrap() {
   type = t;
   width = w;
   height = h;
   _surface = NULL;
   _closure = NULL;
+  _pdfSink = NULL;
+  memset(_encodedSize, 0, sizeof(_encodedSize));
+  _generation = 0;
 
   if (CANVAS_TYPE_PDF == t) {
-    _closure = malloc(sizeof(closure_t));
+    _closure = malloc(sizeof(document_t));
     assert(_closure);
-    cairo_status_t status = closure_init((closure_t *) _closure, this, 0, PNG_NO_FILTERS);
-    assert(status == CAIRO_STATUS_SUCCESS);
-    _surface = cairo_pdf_surface_create_for_stream(toBuffer, _closure, w, h);
+    document_init((document_t *) _closure, spill_threshold);
+    _surface = cairo_pdf_surface_create_for_stream(document_write, _closure, w, h);
   } else if (CANVAS_TYPE_SVG == t) {
     _closure = malloc(sizeof(closure_t));
     assert(_closure);
     cairo_status_t status = closure_init((closure_t *) _closure, this, 0, PNG_NO_FILTERS);
     assert(status == CAIRO_STATUS_SUCCESS);
-    _surface = cairo_svg_surface_create_for_stream(toBuffer, _closure, w, h);
+    _surface = cairo_svg_surface_create_for_stream(closure_write, _closure, w, h);
   } else {
     _surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
     assert(_surface);
@@ -683,11 +2003,21 @@ Canvas::Canvas(int w, int h, canvas_type_t t): Nan::ObjectWrap() {
 Canvas::~Canvas() {
   switch (type) {
     case CANVAS_TYPE_PDF:
+      // Too late to call into JS with the rest of a streamed PDF
+      document_set_flush((document_t *) _closure, NULL, NULL);
+      delete _pdfSink;
+      cairo_surface_finish(_surface);
+      document_destroy((document_t *) _closure);
+      free(_closure);
+      cairo_surface_destroy(_surface);
+      _document.Reset();
+      break;
     case CANVAS_TYPE_SVG:
       cairo_surface_finish(_surface);
       closure_destroy((closure_t *) _closure);
       free(_closure);
       cairo_surface_destroy(_surface);
+      _document.Reset();
       break;
     case CANVAS_TYPE_IMAGE:
       int oldNBytes = nBytes();
@@ -695,6 +2025,7 @@ Canvas::~Canvas() {
       Nan::AdjustExternalMemory(-oldNBytes);
       break;
   }
+  clearEncodeCache();
 }
 
 std::vector<FontFace>
@@ -804,6 +2135,103 @@ Canvas::ResolveFontDescription(const PangoFontDescription *desc) {
   return ret;
 }
 
+/*
+ * The finished PDF or SVG document. The first call hands the
+ * closure's data over to a Buffer and later calls return that
+ * same Buffer, until the surface is recreated. A PDF that spilled
+ * to a temp file is read back. Throws and returns an empty handle
+ * when the document could not be produced.
+ */
+
+Local<Object>
+Canvas::document() {
+  if (_document.IsEmpty()) {
+    cairo_surface_finish(_surface);
+    if (isPDF()) {
+      document_t *doc = (document_t *) _closure;
+      size_t len;
+      uint8_t *data = doc->status ? NULL : document_take(doc, &len);
+      if (!data) {
+        Nan::ThrowError(Canvas::Error(doc->status ? doc->status : CAIRO_STATUS_NO_MEMORY));
+        return Local<Object>();
+      }
+      _document.Reset(Nan::NewBuffer((char *) data, len, closure_buffer_free, NULL).ToLocalChecked());
+    } else {
+      _document.Reset(closure_to_buffer((closure_t *) _closure));
+    }
+  }
+  return Nan::New(_document);
+}
+
+/*
+ * Pass what a streamed PDF has produced so far on to its callback.
+ */
+
+cairo_status_t
+Canvas::flushDocument() {
+  if (!_pdfSink) return CAIRO_STATUS_SUCCESS;
+  document_t *doc = (document_t *) _closure;
+  return doc->status ? doc->status : document_flush(doc);
+}
+
+/*
+ * Expected size in bytes of the canvas encoded as `encoding`: the last
+ * encoded size with some headroom, or a small guess from the pixel
+ * count when the canvas has not been encoded yet. Used to presize
+ * encoder buffers, so the guess is kept low: a mostly blank canvas
+ * compresses to next to nothing, and buffers grow as needed.
+ */
+
+#define CANVAS_ENCODED_SIZE_GUESS_MAX (4 << 20)
+
+size_t
+Canvas::encodedSizeEstimate(canvas_encoding_t encoding) {
+  size_t size = _encodedSize[encoding];
+  if (size) return size + size / 8;
+
+  size_t pixels = (size_t) width * height;
+  size = encoding == CANVAS_ENCODING_WEBP ? pixels / 16 : pixels / 8;
+  if (size > CANVAS_ENCODED_SIZE_GUESS_MAX) size = CANVAS_ENCODED_SIZE_GUESS_MAX;
+  return size < PAGE_SIZE ? PAGE_SIZE : size;
+}
+
+/*
+ * The cached encoding for `key`, or NULL. Entries only live until
+ * the canvas is next modified.
+ */
+
+const std::string *
+Canvas::cachedEncoding(const std::string &key) {
+  for (size_t i = 0; i < _encodeCache.size(); i++) {
+    if (_encodeCache[i].first == key) return &_encodeCache[i].second;
+  }
+  return NULL;
+}
+
+/*
+ * Cache `len` bytes of encoded output under `key`, evicting the
+ * oldest entry when full.
+ */
+
+void
+Canvas::cacheEncoding(const std::string &key, const uint8_t *data, size_t len) {
+  if (cachedEncoding(key)) return;
+  if (_encodeCache.size() >= CANVAS_ENCODE_CACHE_ENTRIES) {
+    Nan::AdjustExternalMemory(-((intptr_t) _encodeCache[0].second.size()));
+    _encodeCache.erase(_encodeCache.begin());
+  }
+  _encodeCache.push_back(std::make_pair(key, std::string((const char *) data, len)));
+  Nan::AdjustExternalMemory(len);
+}
+
+void
+Canvas::clearEncodeCache() {
+  for (size_t i = 0; i < _encodeCache.size(); i++) {
+    Nan::AdjustExternalMemory(-((intptr_t) _encodeCache[i].second.size()));
+  }
+  _encodeCache.clear();
+}
+
 /*
  * Re-alloc the surface, destroying the previous.
  */
@@ -812,6 +2240,7 @@ void
 Canvas::resurface(Local<Object> canvas) {
   Nan::HandleScope scope;
   Local<Value> context;
+  bumpGeneration();
   switch (type) {
     case CANVAS_TYPE_PDF:
       cairo_pdf_surface_set_size(_surface, width, height);
@@ -821,8 +2250,9 @@ Canvas::resurface(Local<Object> canvas) {
       cairo_surface_finish(_surface);
       closure_destroy((closure_t *) _closure);
       cairo_surface_destroy(_surface);
+      _document.Reset();
       closure_init((closure_t *) _closure, this, 0, PNG_NO_FILTERS);
-      _surface = cairo_svg_surface_create_for_stream(toBuffer, _closure, width, height);
+      _surface = cairo_svg_surface_create_for_stream(closure_write, _closure, width, height);
 
       // Reset context
       context = canvas->Get(Nan::New<String>("context").ToLocalChecked());
@@ -839,6 +2269,7 @@ Canvas::resurface(Local<Object> canvas) {
       cairo_surface_destroy(_surface);
       _surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
       Nan::AdjustExternalMemory(nBytes() - oldNBytes);
+      memset(_encodedSize, 0, sizeof(_encodedSize));
 
       // Reset context
       context = canvas->Get(Nan::New<String>("context").ToLocalChecked());
@@ -13,6 +13,7 @@
 #include <node_object_wrap.h>
 #include <node_version.h>
 #include <pango/pangocairo.h>
+#include <string>
 #include <vector>
 #include <cairo.h>
 #include <nan.h>
@@ -40,6 +41,25 @@ typedef enum {
   CANVAS_TYPE_SVG
 } canvas_type_t;
 
+/*
+ * Encoded output formats, for size estimates.
+ */
+
+typedef enum {
+  CANVAS_ENCODING_PNG,
+  CANVAS_ENCODING_JPEG,
+  CANVAS_ENCODING_WEBP,
+  CANVAS_ENCODING_COUNT
+} canvas_encoding_t;
+
+/*
+ * Most encoded images kept per canvas, one per format and settings.
+ */
+
+#ifndef CANVAS_ENCODE_CACHE_ENTRIES
+#define CANVAS_ENCODE_CACHE_ENTRIES 4
+#endif
+
 /*
  * FontFace describes a font file in terms of one PangoFontDescription that
  * will resolve to it and one that the user describes it as (like @font-face)
@@ -63,6 +83,8 @@ class Canvas: public Nan::ObjectWrap {
     static void Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target);
     static NAN_METHOD(New);
     static NAN_METHOD(ToBuffer);
+    static NAN_METHOD(ToFile);
+    static NAN_METHOD(ToBuffers);
     static NAN_GETTER(GetType);
     static NAN_GETTER(GetStride);
     static NAN_GETTER(GetWidth);
@@ -71,12 +93,24 @@ class Canvas: public Nan::ObjectWrap {
     static NAN_SETTER(SetHeight);
     static NAN_METHOD(StreamPNGSync);
     static NAN_METHOD(StreamPDFSync);
+    static NAN_METHOD(StreamPDF);
+    static NAN_METHOD(FinishPDF);
     static NAN_METHOD(StreamJPEGSync);
     static NAN_METHOD(RegisterFont);
+    static NAN_METHOD(WorkPool);
+    static NAN_METHOD(EstimateEncodedSize);
+    static NAN_METHOD(CreateEncoder);
     static Local<Value> Error(cairo_status_t status);
 #if NODE_VERSION_AT_LEAST(0, 6, 0)
     static void ToBufferAsync(uv_work_t *req);
     static void ToBufferAsyncAfter(uv_work_t *req);
+    static void ToJPEGBufferAsync(uv_work_t *req);
+    static void ToWebPBufferAsync(uv_work_t *req);
+    static void ToFileAsync(uv_work_t *req);
+    static void ToFileAsyncAfter(uv_work_t *req);
+    static void ToBuffersAsync(uv_work_t *req);
+    static void ToBuffersAsyncAfter(uv_work_t *req);
+    static void ToBuffersOutputAsyncAfter(uv_work_t *req);
 #else
     static
 #if NODE_VERSION_AT_LEAST(0, 5, 4)
@@ -98,13 +132,27 @@ class Canvas: public Nan::ObjectWrap {
     inline uint8_t *data(){ return cairo_image_surface_get_data(_surface); }
     inline int stride(){ return cairo_image_surface_get_stride(_surface); }
     inline int nBytes(){ return height * stride(); }
-    Canvas(int width, int height, canvas_type_t type);
+    Canvas(int width, int height, canvas_type_t type, size_t spill_threshold = 0);
     void resurface(Local<Object> canvas);
+    Local<Object> document();
+    cairo_status_t flushDocument();
+    size_t encodedSizeEstimate(canvas_encoding_t encoding);
+    inline void recordEncodedSize(canvas_encoding_t encoding, size_t size){ _encodedSize[encoding] = size; }
+    inline uint32_t generation(){ return _generation; }
+    inline void bumpGeneration(){ _generation++; if (!_encodeCache.empty()) clearEncodeCache(); }
+    const std::string *cachedEncoding(const std::string &key);
+    void cacheEncoding(const std::string &key, const uint8_t *data, size_t len);
+    void clearEncodeCache();
 
   private:
     ~Canvas();
     cairo_surface_t *_surface;
     void *_closure;
+    Nan::Persistent<Object> _document;
+    Nan::Callback *_pdfSink;
+    size_t _encodedSize[CANVAS_ENCODING_COUNT];
+    uint32_t _generation;
+    std::vector<std::pair<std::string, std::string> > _encodeCache;
     static std::vector<FontFace> _font_face_list;
 };
 
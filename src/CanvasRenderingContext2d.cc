@@ -255,6 +255,7 @@ Context2d::setFillRule(v8::Local<v8::Value> value) {
 
 void
 Context2d::fill(bool preserve) {
+  _canvas->bumpGeneration();
   if (state->fillPattern) {
     cairo_set_source(_context, state->fillPattern);
     cairo_pattern_set_extend(cairo_get_source(_context), CAIRO_EXTEND_REPEAT);
@@ -283,6 +284,7 @@ Context2d::fill(bool preserve) {
 
 void
 Context2d::stroke(bool preserve) {
+  _canvas->bumpGeneration();
   if (state->strokePattern) {
     cairo_set_source(_context, state->strokePattern);
     cairo_pattern_set_extend(cairo_get_source(_context), CAIRO_EXTEND_REPEAT);
@@ -516,7 +518,9 @@ NAN_METHOD(Context2d::AddPage) {
     return Nan::ThrowError("only PDF canvases support .nextPage()");
   }
   cairo_show_page(context->context());
-  return;
+  context->canvas()->bumpGeneration();
+  cairo_status_t status = context->canvas()->flushDocument();
+  if (status) return Nan::ThrowError(Canvas::Error(status));
 }
 
 /*
@@ -630,6 +634,7 @@ NAN_METHOD(Context2d::PutImageData) {
     src += srcStride;
   }
 
+  context->canvas()->bumpGeneration();
   cairo_surface_mark_dirty_rectangle(
       context->canvas()->surface()
     , dx
@@ -886,6 +891,7 @@ NAN_METHOD(Context2d::DrawImage) {
   cairo_set_source_surface(ctx, surface, dx - sx, dy - sy);
   cairo_pattern_set_filter(cairo_get_source(ctx), context->state->patternQuality);
   cairo_paint_with_alpha(ctx, context->state->globalAlpha);
+  context->canvas()->bumpGeneration();
 
   cairo_restore(ctx);
 }
@@ -1755,6 +1761,7 @@ Context2d::setTextPath(const char *str, double x, double y) {
   if (state->textDrawingMode == TEXT_DRAW_PATHS) {
     pango_cairo_layout_path(_context, _layout);
   } else if (state->textDrawingMode == TEXT_DRAW_GLYPHS) {
+    _canvas->bumpGeneration();
     pango_cairo_show_layout(_context, _layout);
   }
 }
@@ -2044,6 +2051,7 @@ NAN_METHOD(Context2d::ClearRect) {
   cairo_rectangle(ctx, x, y, width, height);
   cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
   cairo_fill(ctx);
+  context->canvas()->bumpGeneration();
   context->restorePath();
   cairo_restore(ctx);
 }
@@ -6,6 +6,10 @@
 
 #include "Canvas.h"
 #include "Image.h"
+#include "work_pool.h"
+#include "pixel_convert.h"
+#include <png.h>
+#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -28,6 +32,82 @@ typedef struct {
   uint8_t *buf;
 } read_closure_t;
 
+/*
+ * Async decode state. The source is decoded into `decoded`, a detached
+ * Image, so that the Image being loaded is not touched off the main
+ * thread. A Buffer source is kept alive by `source`.
+ */
+
+typedef struct {
+  Image *image;
+  Image *decoded;
+  uint32_t load_id;
+  bool from_buffer;
+  uint8_t *buf;
+  unsigned len;
+  Nan::Persistent<Object> source;
+  cairo_status_t status;
+} decode_closure_t;
+
+#ifdef HAVE_JPEG
+
+/*
+ * Suspending JPEG source over the bytes written so far, which are the
+ * tail of feed_state_t::pending. Skips past them carry over to later
+ * writes.
+ */
+
+typedef struct {
+  struct jpeg_source_mgr pub;
+  size_t skip;
+  bool eof;
+} feed_jpeg_source_t;
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+} feed_jpeg_error_t;
+
+typedef enum {
+    FEED_JPEG_HEADER
+  , FEED_JPEG_START
+  , FEED_JPEG_ROWS
+  , FEED_JPEG_FINISH
+  , FEED_JPEG_DONE
+} feed_jpeg_state_t;
+
+#endif
+
+/*
+ * Incremental decode state, for a source written in chunks. PNGs are
+ * decoded by libpng's progressive reader and JPEGs through a suspending
+ * source, each as far as the bytes written so far allow, into `data`.
+ * Other sources, and JPEGs whose bytes are kept as mime data, are
+ * collected in `pending` and loaded once complete.
+ */
+
+struct feed_state_t {
+  bool sniffed;
+  bool incremental;
+  bool done;
+  Image::type format;
+  std::vector<uint8_t> pending;
+  cairo_status_t status;
+  cairo_format_t surface_format;
+  uint8_t *data;
+  int width, height, stride;
+  png_structp png;
+  png_infop png_info;
+#ifdef HAVE_JPEG
+  bool jpeg_created;
+  struct jpeg_decompress_struct jpeg;
+  feed_jpeg_source_t jpeg_src;
+  feed_jpeg_error_t jpeg_err;
+  feed_jpeg_state_t jpeg_state;
+  uint8_t *jpeg_row;
+#endif
+};
+
 Nan::Persistent<FunctionTemplate> Image::constructor;
 
 /*
@@ -51,6 +131,16 @@ Image::Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
   Nan::SetAccessor(proto, Nan::New("height").ToLocalChecked(), GetHeight);
   Nan::SetAccessor(proto, Nan::New("onload").ToLocalChecked(), GetOnload, SetOnload);
   Nan::SetAccessor(proto, Nan::New("onerror").ToLocalChecked(), GetOnerror, SetOnerror);
+  Nan::SetAccessor(proto, Nan::New("decoding").ToLocalChecked(), GetDecoding, SetDecoding);
+  Nan::SetAccessor(proto, Nan::New("maxWidth").ToLocalChecked(), GetMaxWidth, SetMaxWidth);
+  Nan::SetAccessor(proto, Nan::New("maxHeight").ToLocalChecked(), GetMaxHeight, SetMaxHeight);
+  Nan::SetAccessor(proto, Nan::New("frameCount").ToLocalChecked(), GetFrameCount);
+  Nan::SetAccessor(proto, Nan::New("frame").ToLocalChecked(), GetFrame, SetFrame);
+  Nan::SetAccessor(proto, Nan::New("frameDelays").ToLocalChecked(), GetFrameDelays);
+  Nan::SetPrototypeMethod(ctor, "_whenDecoded", WhenDecoded);
+  Nan::SetPrototypeMethod(ctor, "_beginFeed", BeginFeed);
+  Nan::SetPrototypeMethod(ctor, "_feed", Feed);
+  Nan::SetPrototypeMethod(ctor, "_endFeed", EndFeed);
 #if CAIRO_VERSION_MINOR >= 10
   Nan::SetAccessor(proto, Nan::New("dataMode").ToLocalChecked(), GetDataMode, SetDataMode);
   ctor->Set(Nan::New("MODE_IMAGE").ToLocalChecked(), Nan::New<Number>(DATA_IMAGE));
@@ -108,6 +198,167 @@ NAN_SETTER(Image::SetDataMode) {
 
 #endif
 
+/*
+ * Get decoding, "async" when sources are decoded on the thread pool.
+ */
+
+NAN_GETTER(Image::GetDecoding) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  info.GetReturnValue().Set(Nan::New<String>(img->decode_async ? "async" : "sync").ToLocalChecked());
+}
+
+/*
+ * Set decoding. "async" decodes later sources on the thread pool;
+ * "sync" and "auto" decode them in the src setter.
+ */
+
+NAN_SETTER(Image::SetDecoding) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  String::Utf8Value str(value);
+  img->decode_async = *str && 0 == strcmp("async", *str);
+}
+
+/*
+ * Get maxWidth.
+ */
+
+NAN_GETTER(Image::GetMaxWidth) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  info.GetReturnValue().Set(Nan::New<Number>(img->max_width));
+}
+
+/*
+ * Set maxWidth, the widest the image will be drawn, 0 for no hint.
+ * JPEGs are decoded at a reduced size still at least this wide.
+ */
+
+NAN_SETTER(Image::SetMaxWidth) {
+  if (value->IsNumber()) {
+    Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+    img->max_width = value->Uint32Value();
+  }
+}
+
+/*
+ * Get maxHeight.
+ */
+
+NAN_GETTER(Image::GetMaxHeight) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  info.GetReturnValue().Set(Nan::New<Number>(img->max_height));
+}
+
+/*
+ * Set maxHeight, the tallest the image will be drawn, 0 for no hint.
+ */
+
+NAN_SETTER(Image::SetMaxHeight) {
+  if (value->IsNumber()) {
+    Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+    img->max_height = value->Uint32Value();
+  }
+}
+
+/*
+ * Get frameCount, the number of frames of an animated GIF, otherwise
+ * 1 once loaded.
+ */
+
+NAN_GETTER(Image::GetFrameCount) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  info.GetReturnValue().Set(Nan::New<Number>(img->frameCount()));
+}
+
+/*
+ * Get frame, the index of the frame drawn.
+ */
+
+NAN_GETTER(Image::GetFrame) {
+  int frame = 0;
+#ifdef HAVE_GIF
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  if (img->_frame > 0) frame = img->_frame;
+#endif
+  info.GetReturnValue().Set(Nan::New<Number>(frame));
+}
+
+/*
+ * Set frame, selecting the frame of an animated GIF to draw. It is
+ * decoded and composited then, from as few of the frames before it as
+ * their disposal methods allow.
+ */
+
+NAN_SETTER(Image::SetFrame) {
+  if (!value->IsNumber()) return;
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  double index = value->NumberValue();
+  if (!(index >= 0 && index < img->frameCount()) || index != (int) index)
+    return Nan::ThrowRangeError("Frame index out of range");
+
+#ifdef HAVE_GIF
+  int frame = (int) index;
+  if (!img->_gifFrames.empty() && frame != img->_frame) {
+    cairo_status_t status = img->compositeGIFFrame(img->_gif, img->_gifLen, frame);
+    if (status) Nan::ThrowError(Canvas::Error(status));
+  }
+#endif
+}
+
+/*
+ * Get frameDelays, the delay after each frame in ms.
+ */
+
+NAN_GETTER(Image::GetFrameDelays) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  int count = img->frameCount();
+  Local<Array> delays = Nan::New<Array>(count);
+  for (int i = 0; i < count; i++) {
+    int delay = 0;
+#ifdef HAVE_GIF
+    if (!img->_gifFrames.empty()) delay = img->_gifFrames[i].delay;
+#endif
+    Nan::Set(delays, i, Nan::New<Number>(delay));
+  }
+  info.GetReturnValue().Set(delays);
+}
+
+/*
+ * Number of frames, 0 until loaded.
+ */
+
+int
+Image::frameCount() {
+#ifdef HAVE_GIF
+  if (!_gifFrames.empty()) return _gifFrames.size();
+#endif
+  return isComplete() ? 1 : 0;
+}
+
+/*
+ * Call `fn` once the image has loaded, or with an error if it fails to.
+ * Used by decode().
+ */
+
+NAN_METHOD(Image::WhenDecoded) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("Callback function required");
+
+  Nan::Callback *fn = new Nan::Callback(info[0].As<Function>());
+  if (img->_decoding) {
+    img->_waiters.push_back(fn);
+    return;
+  }
+
+  if (img->isComplete()) {
+    fn->Call(0, NULL);
+  } else {
+    Local<Value> argv[1] = { Nan::Error("The image could not be decoded") };
+    fn->Call(1, argv);
+  }
+  delete fn;
+}
+
 /*
  * Get width.
  */
@@ -140,6 +391,11 @@ NAN_GETTER(Image::GetSource) {
 
 void
 Image::clearData() {
+  freeFeed();
+#ifdef HAVE_GIF
+  clearGIF();
+#endif
+
   if (_surface) {
     cairo_surface_destroy(_surface);
     Nan::AdjustExternalMemory(-_data_len);
@@ -166,15 +422,20 @@ NAN_SETTER(Image::SetSource) {
   cairo_status_t status = CAIRO_STATUS_READ_ERROR;
 
   img->clearData();
+  // Any decode in flight is for the previous source
+  img->_loadId++;
+  img->_decoding = false;
 
   // url string
   if (value->IsString()) {
     String::Utf8Value src(value);
     if (img->filename) free(img->filename);
     img->filename = strdup(*src);
+    if (img->decode_async) return img->loadAsync(Local<Value>());
     status = img->load();
   // Buffer
   } else if (Buffer::HasInstance(value)) {
+    if (img->decode_async) return img->loadAsync(value);
     uint8_t *buf = (uint8_t *) Buffer::Data(value->ToObject());
     unsigned len = Buffer::Length(value->ToObject());
     status = img->loadFromBuffer(buf, len);
@@ -319,6 +580,17 @@ Image::Image() {
   _surface = NULL;
   width = height = 0;
   state = DEFAULT;
+  decode_async = false;
+  max_width = max_height = 0;
+  _loadId = 0;
+  _decoding = false;
+  _feed = NULL;
+#ifdef HAVE_GIF
+  _gif = NULL;
+  _gifLen = 0;
+  _frame = 0;
+  _gifRestore = NULL;
+#endif
   onload = NULL;
   onerror = NULL;
 }
@@ -339,6 +611,8 @@ Image::~Image() {
     delete onload;
     onload = NULL;
   }
+
+  for (size_t i = 0; i < _waiters.size(); i++) delete _waiters[i];
 }
 
 /*
@@ -354,6 +628,107 @@ Image::load() {
   return CAIRO_STATUS_READ_ERROR;
 }
 
+/*
+ * Decode the source on the decode thread pool. The filename is the
+ * source unless `buffer` is a Buffer. onload or onerror is invoked
+ * when done, unless the source has been replaced by then.
+ */
+
+void
+Image::loadAsync(Local<Value> buffer) {
+  if (work_pool_full(WORK_LANE_DECODE)) {
+    error(Nan::Error("The decode queue is full"));
+    return;
+  }
+
+  decode_closure_t *closure = new decode_closure_t;
+  closure->image = this;
+  closure->load_id = _loadId;
+  closure->decoded = new Image;
+  closure->decoded->data_mode = data_mode;
+  closure->decoded->max_width = max_width;
+  closure->decoded->max_height = max_height;
+  closure->decoded->filename = filename ? strdup(filename) : NULL;
+  closure->from_buffer = !buffer.IsEmpty() && Buffer::HasInstance(buffer);
+  closure->buf = NULL;
+  closure->len = 0;
+  if (closure->from_buffer) {
+    closure->source.Reset(buffer->ToObject());
+    closure->buf = (uint8_t *) Buffer::Data(buffer->ToObject());
+    closure->len = Buffer::Length(buffer->ToObject());
+  }
+
+  state = LOADING;
+  _decoding = true;
+  Ref();
+
+  uv_work_t *req = new uv_work_t;
+  req->data = closure;
+  work_pool_queue(WORK_LANE_DECODE, req, DecodeAsync, (uv_after_work_cb) DecodeAsyncAfter);
+}
+
+/*
+ * Thread pool decode callback.
+ */
+
+void
+Image::DecodeAsync(uv_work_t *req) {
+  decode_closure_t *closure = (decode_closure_t *) req->data;
+  Image *decoded = closure->decoded;
+  closure->status = closure->from_buffer
+    ? decoded->loadFromBuffer(closure->buf, closure->len)
+    : decoded->load();
+}
+
+/*
+ * Adopt the decoded surface and invoke onload, or invoke onerror.
+ */
+
+void
+Image::DecodeAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  decode_closure_t *closure = (decode_closure_t *) req->data;
+  Image *img = closure->image;
+  delete req;
+
+  closure->source.Reset();
+  if (closure->load_id == img->_loadId) {
+    img->_decoding = false;
+    if (closure->status) {
+      img->state = DEFAULT;
+      img->error(Canvas::Error(closure->status));
+    } else {
+      img->adopt(closure->decoded);
+      img->loaded();
+    }
+  }
+
+  delete closure->decoded;
+  img->Unref();
+  delete closure;
+}
+
+/*
+ * Take over the surface decoded into `decoded`.
+ */
+
+void
+Image::adopt(Image *decoded) {
+  _surface = decoded->_surface;
+  _data = decoded->_data;
+  decoded->_surface = NULL;
+  decoded->_data = NULL;
+#ifdef HAVE_GIF
+  _gif = decoded->_gif;
+  _gifLen = decoded->_gifLen;
+  _gifFrames.swap(decoded->_gifFrames);
+  _frame = decoded->_frame;
+  _gifRestore = decoded->_gifRestore;
+  decoded->_gif = NULL;
+  decoded->_gifRestore = NULL;
+#endif
+}
+
 /*
  * Invoke onload (when assigned) and assign dimensions.
  */
@@ -366,11 +741,23 @@ Image::loaded() {
   width = cairo_image_surface_get_width(_surface);
   height = cairo_image_surface_get_height(_surface);
   _data_len = height * cairo_image_surface_get_stride(_surface);
+#if CAIRO_VERSION_MINOR >= 10
+  // Mime data is accounted for here rather than where it is assigned,
+  // which may be off the main thread
+  const unsigned char *mime_data;
+  unsigned long mime_len = 0;
+  cairo_surface_get_mime_data(_surface, CAIRO_MIME_TYPE_JPEG, &mime_data, &mime_len);
+  _data_len += mime_len;
+#endif
+#ifdef HAVE_GIF
+  _data_len += _gifLen;
+#endif
   Nan::AdjustExternalMemory(_data_len);
 
   if (onload != NULL) {
     onload->Call(0, NULL);
   }
+  settle(Local<Value>());
 }
 
 /*
@@ -384,13 +771,30 @@ Image::error(Local<Value> err) {
     Local<Value> argv[1] = { err };
     onerror->Call(1, argv);
   }
+  settle(err);
+}
+
+/*
+ * Call the decode() callbacks waiting on the load, with `err` if it
+ * failed.
+ */
+
+void
+Image::settle(Local<Value> err) {
+  std::vector<Nan::Callback *> waiters;
+  waiters.swap(_waiters);
+  for (size_t i = 0; i < waiters.size(); i++) {
+    Local<Value> argv[1] = { err };
+    waiters[i]->Call(err.IsEmpty() ? 0 : 1, argv);
+    delete waiters[i];
+  }
 }
 
 /*
- * Load cairo surface from the image src.
+ * Load cairo surface from the image src. Touches no JS state, so that
+ * it can run on the thread pool.
  *
  * TODO: support more formats
- * TODO: use node IO or at least thread pool
  */
 
 cairo_status_t
@@ -438,22 +842,6 @@ Image::loadPNG() {
 
 #ifdef HAVE_GIF
 
-/*
- * Return the alpha color for `gif` at `frame`, or -1.
- */
-
-int
-get_gif_transparent_color(GifFileType *gif, int frame) {
-  ExtensionBlock *ext = gif->SavedImages[frame].ExtensionBlocks;
-  int len = gif->SavedImages[frame].ExtensionBlockCount;
-  for (int x = 0; x < len; ++x, ++ext) {
-    if ((ext->Function == GRAPHICS_EXT_FUNC_CODE) && (ext->Bytes[0] & 1)) {
-      return ext->Bytes[3] == 0 ? 0 : (uint8_t) ext->Bytes[3];
-    }
-  }
-  return -1;
-}
-
 /*
  * Memory GIF reader callback.
  */
@@ -500,12 +888,236 @@ Image::loadGIF(FILE *stream) {
 }
 
 /*
- * Load give from `buf` and the given `len`.
+ * Read the graphic control extension `ext`, its length byte first,
+ * into `frame`.
+ */
+
+static void
+read_gif_control(const GifByteType *ext, gif_frame_t *frame) {
+  if (ext[0] < 4) return;
+  frame->disposal = (ext[1] >> 2) & 7;
+  frame->delay = (ext[2] | ext[3] << 8) * 10;
+  frame->transparent = (ext[1] & 1) ? ext[4] : -1;
+}
+
+/*
+ * Index the frames of `gif`: where the image descriptor of each one
+ * starts, its rectangle and its graphic control. Image data is skipped
+ * over without being decompressed, and a truncated frame left out.
+ */
+
+static void
+index_gif_frames(GifFileType *gif, gif_data_t *gifd, std::vector<gif_frame_t> &frames) {
+  const gif_frame_t none = { 0, 0, 0, 0, 0, 0, DISPOSAL_UNSPECIFIED, -1 };
+  gif_frame_t control = none;
+  GifRecordType type;
+
+  do {
+    if (GIF_OK != DGifGetRecordType(gif, &type)) return;
+
+    if (EXTENSION_RECORD_TYPE == type) {
+      int code;
+      GifByteType *ext;
+      if (GIF_OK != DGifGetExtension(gif, &code, &ext)) return;
+      if (GRAPHICS_EXT_FUNC_CODE == code && ext) read_gif_control(ext, &control);
+      while (ext) {
+        if (GIF_OK != DGifGetExtensionNext(gif, &ext)) return;
+      }
+    } else if (IMAGE_DESC_RECORD_TYPE == type) {
+      gif_frame_t frame = control;
+      frame.offset = gifd->pos;
+      if (GIF_OK != DGifGetImageDesc(gif)) return;
+      frame.left = gif->Image.Left;
+      frame.top = gif->Image.Top;
+      frame.width = gif->Image.Width;
+      frame.height = gif->Image.Height;
+
+      int size;
+      GifByteType *block;
+      if (GIF_OK != DGifGetCode(gif, &size, &block)) return;
+      while (block) {
+        if (GIF_OK != DGifGetCodeNext(gif, &block)) return;
+      }
+
+      frames.push_back(frame);
+      control = none;
+    }
+  } while (TERMINATE_RECORD_TYPE != type);
+}
+
+/*
+ * Decode `frame` onto `data`, the width x height ARGB32 screen, leaving
+ * it as it is under transparent pixels.
+ */
+
+static bool
+draw_gif_frame(GifFileType *gif, gif_data_t *gifd, const gif_frame_t *frame, uint32_t *data, int width, int height) {
+  // Interlaced frames store every 8th row from 0, then from 4, every
+  // 4th from 2 and every other one from 1
+  static const int offsets[] = { 0, 4, 2, 1 };
+  static const int steps[] = { 8, 8, 4, 2 };
+
+  gifd->pos = frame->offset;
+  if (GIF_OK != DGifGetImageDesc(gif)) return false;
+  ColorMapObject *colormap = gif->Image.ColorMap ? gif->Image.ColorMap : gif->SColorMap;
+  if (!colormap) return false;
+
+  int w = gif->Image.Width, h = gif->Image.Height;
+  if (!w || !h) return true;
+  GifByteType *line = (GifByteType *) malloc(w);
+  if (!line) return false;
+
+  int passes = gif->Image.Interlace ? 4 : 1;
+  for (int pass = 0; pass < passes; pass++) {
+    int y = passes > 1 ? offsets[pass] : 0;
+    int step = passes > 1 ? steps[pass] : 1;
+    for (; y < h; y += step) {
+      if (GIF_OK != DGifGetLine(gif, line, w)) {
+        free(line);
+        return false;
+      }
+      int sy = frame->top + y;
+      if (sy >= height) continue;
+
+      uint32_t *row = data + (size_t) sy * width;
+      for (int x = 0; x < w && frame->left + x < width; x++) {
+        int i = line[x];
+        if (i == frame->transparent || i >= colormap->ColorCount) continue;
+        GifColorType *c = &colormap->Colors[i];
+        row[frame->left + x] = 0xff000000 | c->Red << 16 | c->Green << 8 | c->Blue;
+      }
+    }
+  }
+
+  free(line);
+  return true;
+}
+
+/*
+ * Whether `frame` overwrites the whole screen, so that compositing can
+ * start from it.
+ */
+
+static bool
+gif_frame_covers(const gif_frame_t *frame, int width, int height) {
+  return frame->transparent < 0
+    && !frame->left && !frame->top
+    && frame->width >= width && frame->height >= height;
+}
+
+/*
+ * Clip the rectangle of `frame` to the screen.
+ */
+
+static void
+clip_gif_frame(const gif_frame_t *frame, int width, int height, int *x, int *y, int *w, int *h) {
+  *x = frame->left < width ? frame->left : width;
+  *y = frame->top < height ? frame->top : height;
+  *w = (frame->left + frame->width < width ? frame->left + frame->width : width) - *x;
+  *h = (frame->top + frame->height < height ? frame->top + frame->height : height) - *y;
+}
+
+/*
+ * Dispose of frame `f` as its graphic control says, before the next one
+ * is drawn: clear its rectangle to transparent black, or restore what was
+ * saved before it was drawn.
+ */
+
+void
+Image::disposeGIFFrame(int f) {
+  const gif_frame_t *frame = &_gifFrames[f];
+  uint32_t *data = (uint32_t *) _data;
+  int x, y, w, h;
+  clip_gif_frame(frame, width, height, &x, &y, &w, &h);
+
+  if (DISPOSE_BACKGROUND == frame->disposal) {
+    for (int r = 0; r < h; r++) {
+      memset(data + (size_t) (y + r) * width + x, 0, w * 4);
+    }
+  } else if (DISPOSE_PREVIOUS == frame->disposal && _gifRestore) {
+    for (int r = 0; r < h; r++) {
+      memcpy(data + (size_t) (y + r) * width + x, _gifRestore + (size_t) r * w, w * 4);
+    }
+  }
+
+  free(_gifRestore);
+  _gifRestore = NULL;
+}
+
+/*
+ * Composite the screen as of `frame` from the GIF in `buf`. Frames are
+ * drawn in order, each after disposing of the one before, on from the
+ * frame composited already when that is on the way, else from the last
+ * frame overwriting the whole screen, else from transparent black. Frames
+ * before that are never decoded.
+ */
+
+cairo_status_t
+Image::compositeGIFFrame(uint8_t *buf, unsigned len, int frame) {
+  int start = frame;
+  while (start > 0 && !gif_frame_covers(&_gifFrames[start], width, height)) start--;
+
+  int from = _frame >= start && _frame < frame ? _frame + 1 : start;
+  if (from == start) {
+    memset(_data, 0, (size_t) width * height * 4);
+    free(_gifRestore);
+    _gifRestore = NULL;
+  }
+
+  GifFileType *gif;
+  gif_data_t gifd = { buf, len, 0 };
+#if GIFLIB_MAJOR >= 5
+  int errorcode;
+  if ((gif = DGifOpen((void*) &gifd, read_gif_from_memory, &errorcode)) == NULL)
+    return CAIRO_STATUS_READ_ERROR;
+#else
+  if ((gif = DGifOpen((void*) &gifd, read_gif_from_memory)) == NULL)
+    return CAIRO_STATUS_READ_ERROR;
+#endif
+
+  if (_surface) cairo_surface_flush(_surface);
+
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+  for (int f = from; f <= frame; f++) {
+    if (f > from || from > start) disposeGIFFrame(f - 1);
+
+    const gif_frame_t *next = &_gifFrames[f];
+    if (DISPOSE_PREVIOUS == next->disposal) {
+      int x, y, w, h;
+      clip_gif_frame(next, width, height, &x, &y, &w, &h);
+      _gifRestore = (uint32_t *) malloc((size_t) w * h * 4 + 4);
+      if (!_gifRestore) {
+        status = CAIRO_STATUS_NO_MEMORY;
+        break;
+      }
+      for (int r = 0; r < h; r++) {
+        memcpy(_gifRestore + (size_t) r * w, (uint32_t *) _data + (size_t) (y + r) * width + x, w * 4);
+      }
+    }
+
+    if (!draw_gif_frame(gif, &gifd, next, (uint32_t *) _data, width, height)) {
+      status = CAIRO_STATUS_READ_ERROR;
+      break;
+    }
+    _frame = f;
+  }
+
+  GIF_CLOSE_FILE(gif);
+  if (_surface) cairo_surface_mark_dirty(_surface);
+
+  // Start over next time from a partly drawn screen
+  if (status) _frame = -1;
+  return status;
+}
+
+/*
+ * Load GIF from `buf` and the given `len`, composited as of its first
+ * frame. Animated GIFs keep a copy of `buf` for other frames to be
+ * decoded when selected.
  */
 
 cairo_status_t
 Image::loadGIFFromBuffer(uint8_t *buf, unsigned len) {
-  int i = 0;
   GifFileType* gif;
 
   gif_data_t gifd = { buf, len, 0 };
@@ -519,118 +1131,64 @@ Image::loadGIFFromBuffer(uint8_t *buf, unsigned len) {
     return CAIRO_STATUS_READ_ERROR;
 #endif
 
-  if (GIF_OK != DGifSlurp(gif)) {
-    GIF_CLOSE_FILE(gif);
-    return CAIRO_STATUS_READ_ERROR;
-  }
+  index_gif_frames(gif, &gifd, _gifFrames);
 
   width = gif->SWidth;
   height = gif->SHeight;
 
-  uint8_t *data = (uint8_t *) malloc(width * height * 4);
-  if (!data) {
-    GIF_CLOSE_FILE(gif);
-    return CAIRO_STATUS_NO_MEMORY;
-  }
-
-  GifImageDesc *img = &gif->SavedImages[i].ImageDesc;
-
-  // local colormap takes precedence over global
-  ColorMapObject *colormap = img->ColorMap
-    ? img->ColorMap
-    : gif->SColorMap;
+  GIF_CLOSE_FILE(gif);
 
-  int bgColor = 0;
-  int alphaColor = get_gif_transparent_color(gif, i);
-  if (gif->SColorMap) bgColor = (uint8_t) gif->SBackGroundColor;
-  else if(alphaColor >= 0) bgColor = alphaColor;
+  if (_gifFrames.empty()) return CAIRO_STATUS_READ_ERROR;
 
-  uint8_t *src_data = (uint8_t*) gif->SavedImages[i].RasterBits;
-  uint32_t *dst_data = (uint32_t*) data;
+  _data = (uint8_t *) malloc((size_t) width * height * 4);
+  if (!_data) return CAIRO_STATUS_NO_MEMORY;
 
-  if (!gif->Image.Interlace) {
-    if (width == img->Width && height == img->Height) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          *dst_data = ((*src_data == alphaColor) ? 0 : 255) << 24
-            | colormap->Colors[*src_data].Red << 16
-            | colormap->Colors[*src_data].Green << 8
-            | colormap->Colors[*src_data].Blue;
+  _frame = -1;
+  cairo_status_t status = compositeGIFFrame(buf, len, 0);
 
-          dst_data++;
-          src_data++;
-        }
-      }
+  if (!status && _gifFrames.size() > 1) {
+    _gif = (uint8_t *) malloc(len);
+    if (_gif) {
+      memcpy(_gif, buf, len);
+      _gifLen = len;
     } else {
-      // Image does not take up whole "screen" so we need to fill-in the background
-      int bottom = img->Top + img->Height;
-      int right = img->Left + img->Width;
-
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          if (y < img->Top || y >= bottom || x < img->Left || x >= right) {
-            *dst_data = ((bgColor == alphaColor) ? 0 : 255) << 24
-              | colormap->Colors[bgColor].Red << 16
-              | colormap->Colors[bgColor].Green << 8
-              | colormap->Colors[bgColor].Blue;
-          } else {
-            *dst_data = ((*src_data == alphaColor) ? 0 : 255) << 24
-              | colormap->Colors[*src_data].Red << 16
-              | colormap->Colors[*src_data].Green << 8
-              | colormap->Colors[*src_data].Blue;
-          }
-
-          dst_data++;
-          src_data++;
-        }
-      }
-    }
-  } else {
-    // Image is interlaced so that it streams nice over 14.4k and 28.8k modems :)
-    // We first load in 1/8 of the image, followed by another 1/8, followed by
-    // 1/4 and finally the remaining 1/2.
-    int ioffs[] = { 0, 4, 2, 1 };
-    int ijumps[] = { 8, 8, 4, 2 };
-
-    uint8_t *src_ptr = src_data;
-    uint32_t *dst_ptr;
-
-    for(int z = 0; z < 4; z++) {
-      for(int y = ioffs[z]; y < height; y += ijumps[z]) {
-        dst_ptr = dst_data + width * y;
-        for(int x = 0; x < width; ++x) {
-          *dst_ptr = ((*src_ptr == alphaColor) ? 0 : 255) << 24
-            | (colormap->Colors[*src_ptr].Red) << 16
-            | (colormap->Colors[*src_ptr].Green) << 8
-            | (colormap->Colors[*src_ptr].Blue);
-
-          dst_ptr++;
-          src_ptr++;
-        }
-      }
+      status = CAIRO_STATUS_NO_MEMORY;
     }
   }
 
-  GIF_CLOSE_FILE(gif);
-
   // New image surface
-  _surface = cairo_image_surface_create_for_data(
-      data
-    , CAIRO_FORMAT_ARGB32
-    , width
-    , height
-    , cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width));
-
-  cairo_status_t status = cairo_surface_status(_surface);
+  if (!status) {
+    _surface = cairo_image_surface_create_for_data(
+        _data
+      , CAIRO_FORMAT_ARGB32
+      , width
+      , height
+      , cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width));
+    status = cairo_surface_status(_surface);
+  }
 
   if (status) {
-    free(data);
-    return status;
+    free(_data);
+    _data = NULL;
+    clearGIF();
   }
 
-  _data = data;
+  return status;
+}
 
-  return CAIRO_STATUS_SUCCESS;
+/*
+ * Free the state kept for decoding other frames.
+ */
+
+void
+Image::clearGIF() {
+  free(_gif);
+  _gif = NULL;
+  _gifLen = 0;
+  free(_gifRestore);
+  _gifRestore = NULL;
+  _gifFrames.clear();
+  _frame = 0;
 }
 #endif /* HAVE_GIF */
 
@@ -682,6 +1240,95 @@ static void jpeg_mem_src (j_decompress_ptr cinfo, void* buffer, long nbytes) {
 
 #endif
 
+/*
+ * Decode at 1/2, 1/4 or 1/8 size, scaling in the DCT domain, when
+ * that still covers maxWidth and maxHeight. Mime data is the full
+ * size JPEG, so images tracking it are decoded at full size too.
+ * Call between jpeg_read_header() and jpeg_start_decompress().
+ */
+
+void
+Image::scaleJPEG(jpeg_decompress_struct *args) {
+  if (!(max_width || max_height) || (data_mode & DATA_MIME)) return;
+
+  unsigned denom = 8;
+  for (; denom > 1; denom /= 2) {
+    unsigned w = (args->image_width + denom - 1) / denom;
+    unsigned h = (args->image_height + denom - 1) / denom;
+    if (w >= max_width && h >= max_height) break;
+  }
+  args->scale_num = 1;
+  args->scale_denom = denom;
+}
+
+/*
+ * Set the output size to the one scaleJPEG() picks. With the alpha
+ * extensions of libjpeg-turbo, gray and YCbCr JPEGs are output as
+ * opaque pixels in cairo's ARGB32 layout, so scanlines are read
+ * straight into the surface.
+ */
+
+void
+Image::setupJPEG(jpeg_decompress_struct *args) {
+  scaleJPEG(args);
+#ifdef JCS_ALPHA_EXTENSIONS
+  if (args->jpeg_color_space == JCS_GRAYSCALE || args->jpeg_color_space == JCS_YCbCr) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    args->out_color_space = JCS_EXT_ARGB;
+#else
+    args->out_color_space = JCS_EXT_BGRA;
+#endif
+  }
+#endif
+}
+
+/*
+ * Start decompressing, as set up by setupJPEG().
+ */
+
+void
+Image::startJPEG(jpeg_decompress_struct *args) {
+  setupJPEG(args);
+  jpeg_start_decompress(args);
+  width = args->output_width;
+  height = args->output_height;
+}
+
+/*
+ * Whether scanlines are output as ARGB32 pixels.
+ */
+
+static bool
+jpeg_output_is_argb32(jpeg_decompress_struct *args) {
+#ifdef JCS_ALPHA_EXTENSIONS
+  return args->out_color_space == JCS_EXT_BGRA || args->out_color_space == JCS_EXT_ARGB;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Read the next scanline into `row` as ARGB32 pixels, through `src`, a
+ * row of output_components bytes per pixel, unless the output is
+ * ARGB32 already. Returns the number of lines read, 0 when a suspending
+ * source runs out of data.
+ */
+
+static JDIMENSION
+read_jpeg_row(jpeg_decompress_struct *args, uint8_t *row, uint8_t *src) {
+  if (!src) return jpeg_read_scanlines(args, &row, 1);
+
+  JDIMENSION lines = jpeg_read_scanlines(args, &src, 1);
+  if (lines) {
+    if (args->output_components == 1) {
+      gray_to_argb32(row, src, args->output_width);
+    } else {
+      rgb_to_argb32(row, src, args->output_width);
+    }
+  }
+  return lines;
+}
+
 /*
  * Takes an initialised jpeg_decompress_struct and decodes the
  * data into _surface.
@@ -699,33 +1346,20 @@ Image::decodeJPEGIntoSurface(jpeg_decompress_struct *args) {
     return CAIRO_STATUS_NO_MEMORY;
   }
 
-  uint8_t *src = (uint8_t *) malloc(width * args->output_components);
-  if (!src) {
-    free(data);
-    jpeg_abort_decompress(args);
-    jpeg_destroy_decompress(args);
-    return CAIRO_STATUS_NO_MEMORY;
+  // Other output is read a row at a time and converted
+  uint8_t *src = NULL;
+  if (!jpeg_output_is_argb32(args)) {
+    src = (uint8_t *) malloc(width * args->output_components);
+    if (!src) {
+      free(data);
+      jpeg_abort_decompress(args);
+      jpeg_destroy_decompress(args);
+      return CAIRO_STATUS_NO_MEMORY;
+    }
   }
 
   for (int y = 0; y < height; ++y) {
-    jpeg_read_scanlines(args, &src, 1);
-    uint32_t *row = (uint32_t *)(data + stride * y);
-    for (int x = 0; x < width; ++x) {
-      if (args->jpeg_color_space == 1) {
-        uint32_t *pixel = row + x;
-        *pixel = 255 << 24
-          | src[x] << 16
-          | src[x] << 8
-          | src[x];
-      } else {
-        int bx = 3 * x;
-        uint32_t *pixel = row + x;
-        *pixel = 255 << 24
-          | src[bx + 0] << 16
-          | src[bx + 1] << 8
-          | src[bx + 2];
-      }
-    }
+    read_jpeg_row(args, data + stride * y, src);
   }
 
   _surface = cairo_image_surface_create_for_data(
@@ -810,7 +1444,6 @@ Image::decodeJPEGBufferIntoMimeSurface(uint8_t *buf, unsigned len) {
 
 void
 clearMimeData(void *closure) {
-  Nan::AdjustExternalMemory(-((read_closure_t *)closure)->len);
   free(((read_closure_t *) closure)->buf);
   free(closure);
 }
@@ -819,6 +1452,7 @@ clearMimeData(void *closure) {
  * Assign a given buffer as mime data against the surface.
  * The provided buffer will be copied, and the copy will
  * be automatically freed when the surface is destroyed.
+ * Its size is reported to V8 by loaded().
  */
 
 cairo_status_t
@@ -837,8 +1471,6 @@ Image::assignDataAsMime(uint8_t *data, int len, const char *mime_type) {
   mime_closure->buf = mime_data;
   mime_closure->len = len;
 
-  Nan::AdjustExternalMemory(len);
-
   return cairo_surface_set_mime_data(_surface
     , mime_type
     , mime_data
@@ -865,9 +1497,7 @@ Image::loadJPEGFromBuffer(uint8_t *buf, unsigned len) {
   jpeg_mem_src(&args, buf, len);
 
   jpeg_read_header(&args, 1);
-  jpeg_start_decompress(&args);
-  width = args.output_width;
-  height = args.output_height;
+  startJPEG(&args);
 
   return decodeJPEGIntoSurface(&args);
 }
@@ -890,9 +1520,7 @@ Image::loadJPEG(FILE *stream) {
     jpeg_stdio_src(&args, stream);
 
     jpeg_read_header(&args, 1);
-    jpeg_start_decompress(&args);
-    width = args.output_width;
-    height = args.output_height;
+    startJPEG(&args);
 
     status = decodeJPEGIntoSurface(&args);
     fclose(stream);
@@ -931,6 +1559,427 @@ Image::loadJPEG(FILE *stream) {
 
 #endif /* HAVE_JPEG */
 
+// Incremental loading
+
+#define FEED_SNIFF_BYTES 4
+
+/*
+ * Start loading from chunks written by an ImageStream, replacing the
+ * source. Returns the load id to pass _feed() and _endFeed(), which
+ * ignore chunks for a source since replaced.
+ */
+
+NAN_METHOD(Image::BeginFeed) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  img->clearData();
+  img->_loadId++;
+  img->_decoding = true;
+  img->state = LOADING;
+
+  feed_state_t *feed = new feed_state_t();
+  feed->sniffed = feed->incremental = feed->done = false;
+  feed->format = UNKNOWN;
+  feed->status = CAIRO_STATUS_SUCCESS;
+  feed->data = NULL;
+  feed->png = NULL;
+  feed->png_info = NULL;
+#ifdef HAVE_JPEG
+  feed->jpeg_created = false;
+  feed->jpeg_row = NULL;
+#endif
+  img->_feed = feed;
+
+  info.GetReturnValue().Set(Nan::New<Number>(img->_loadId));
+}
+
+/*
+ * Decode the chunk `buffer` as far as possible.
+ */
+
+NAN_METHOD(Image::Feed) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  if (!Buffer::HasInstance(info[0]))
+    return Nan::ThrowTypeError("Buffer required");
+  if (!img->_feed || info[1]->Uint32Value() != img->_loadId) return;
+
+  Local<Object> buffer = info[0]->ToObject();
+  cairo_status_t status = img->feed((uint8_t *) Buffer::Data(buffer), Buffer::Length(buffer));
+  if (status) {
+    img->freeFeed();
+    img->_decoding = false;
+    img->state = DEFAULT;
+    img->error(Canvas::Error(status));
+  }
+}
+
+/*
+ * Finish decoding once every chunk has been written, invoking onload
+ * or onerror.
+ */
+
+NAN_METHOD(Image::EndFeed) {
+  Image *img = Nan::ObjectWrap::Unwrap<Image>(info.This());
+  if (!img->_feed || info[0]->Uint32Value() != img->_loadId) return;
+
+  cairo_status_t status = img->feedEnd();
+  img->freeFeed();
+  img->_decoding = false;
+  if (status) {
+    img->state = DEFAULT;
+    img->error(Canvas::Error(status));
+  } else {
+    img->loaded();
+  }
+}
+
+/*
+ * Free the incremental decode state, if any.
+ */
+
+void
+Image::freeFeed() {
+  feed_state_t *feed = _feed;
+  if (!feed) return;
+  _feed = NULL;
+
+  if (feed->png) png_destroy_read_struct(&feed->png, feed->png_info ? &feed->png_info : NULL, NULL);
+#ifdef HAVE_JPEG
+  if (feed->jpeg_created) jpeg_destroy_decompress(&feed->jpeg);
+  free(feed->jpeg_row);
+#endif
+  free(feed->data);
+  delete feed;
+}
+
+/*
+ * Row transforms into cairo's formats, as cairo's own PNG reader does:
+ * premultiplied ARGB32 with alpha, RGB24 without.
+ */
+
+static void
+feed_png_premultiply(png_structp png, png_row_infop row_info, png_bytep data) {
+  for (png_size_t i = 0; i < row_info->rowbytes; i += 4) {
+    uint8_t *b = data + i;
+    uint32_t a = b[3], pixel = 0;
+    if (a == 0xff) {
+      pixel = 0xff000000 | (uint32_t) b[0] << 16 | (uint32_t) b[1] << 8 | b[2];
+    } else if (a) {
+      uint32_t c[3];
+      for (int k = 0; k < 3; k++) {
+        uint32_t t = a * b[k] + 0x80;
+        c[k] = (t + (t >> 8)) >> 8;
+      }
+      pixel = a << 24 | c[0] << 16 | c[1] << 8 | c[2];
+    }
+    memcpy(b, &pixel, sizeof(uint32_t));
+  }
+}
+
+static void
+feed_png_opaque(png_structp png, png_row_infop row_info, png_bytep data) {
+  for (png_size_t i = 0; i < row_info->rowbytes; i += 4) {
+    uint8_t *b = data + i;
+    uint32_t pixel = 0xff000000 | (uint32_t) b[0] << 16 | (uint32_t) b[1] << 8 | b[2];
+    memcpy(b, &pixel, sizeof(uint32_t));
+  }
+}
+
+/*
+ * Progressive reader callbacks: set up the transforms and the pixel
+ * data once the header is read, combine each (interlace pass of a) row
+ * into it, and note the end of the image.
+ */
+
+static void
+feed_png_info(png_structp png, png_infop info) {
+  feed_state_t *feed = (feed_state_t *) png_get_progressive_ptr(png);
+  png_uint_32 width, height;
+  int depth, color_type, interlace;
+  png_get_IHDR(png, info, &width, &height, &depth, &color_type, &interlace, NULL, NULL);
+
+  bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+  if (color_type == PNG_COLOR_TYPE_GRAY) png_set_expand_gray_1_2_4_to_8(png);
+  if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+  if (depth == 16) png_set_strip_16(png);
+  if (depth < 8) png_set_packing(png);
+  if (!(color_type & PNG_COLOR_MASK_COLOR)) png_set_gray_to_rgb(png);
+  if (interlace != PNG_INTERLACE_NONE) png_set_interlace_handling(png);
+  png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+  png_set_read_user_transform_fn(png, alpha ? feed_png_premultiply : feed_png_opaque);
+  png_read_update_info(png, info);
+
+  feed->surface_format = alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+  feed->width = width;
+  feed->height = height;
+  feed->stride = cairo_format_stride_for_width(feed->surface_format, width);
+  feed->data = feed->stride > 0 ? (uint8_t *) malloc((size_t) feed->stride * height) : NULL;
+  if (!feed->data) {
+    feed->status = feed->stride > 0 ? CAIRO_STATUS_NO_MEMORY : CAIRO_STATUS_INVALID_SIZE;
+    png_error(png, "Cannot allocate the image");
+  }
+}
+
+static void
+feed_png_row(png_structp png, png_bytep row, png_uint_32 y, int pass) {
+  feed_state_t *feed = (feed_state_t *) png_get_progressive_ptr(png);
+  if (row) png_progressive_combine_row(png, feed->data + (size_t) y * feed->stride, row);
+}
+
+static void
+feed_png_end(png_structp png, png_infop info) {
+  feed_state_t *feed = (feed_state_t *) png_get_progressive_ptr(png);
+  feed->done = true;
+}
+
+static cairo_status_t
+feed_png(feed_state_t *feed, uint8_t *buf, size_t len) {
+  if (setjmp(png_jmpbuf(feed->png))) {
+    return feed->status ? feed->status : CAIRO_STATUS_READ_ERROR;
+  }
+  png_process_data(feed->png, feed->png_info, buf, len);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+#ifdef HAVE_JPEG
+
+static void
+feed_jpeg_init_source(j_decompress_ptr args) {}
+
+/*
+ * Suspend the decoder until more bytes are written or, once the source
+ * has ended, insert an EOI marker, as jpeg_mem_src() does for
+ * truncated data.
+ */
+
+static boolean
+feed_jpeg_fill_input_buffer(j_decompress_ptr args) {
+  static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+  feed_jpeg_source_t *src = (feed_jpeg_source_t *) args->src;
+  if (!src->eof) return FALSE;
+
+  WARNMS(args, JWRN_JPEG_EOF);
+  src->pub.next_input_byte = eoi;
+  src->pub.bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void
+feed_jpeg_skip_input_data(j_decompress_ptr args, long n) {
+  feed_jpeg_source_t *src = (feed_jpeg_source_t *) args->src;
+  if (n <= 0) return;
+  if ((size_t) n > src->pub.bytes_in_buffer) {
+    src->skip += n - src->pub.bytes_in_buffer;
+    n = src->pub.bytes_in_buffer;
+  }
+  src->pub.next_input_byte += n;
+  src->pub.bytes_in_buffer -= n;
+}
+
+static void
+feed_jpeg_term_source(j_decompress_ptr args) {}
+
+static void
+feed_jpeg_error_exit(j_common_ptr args) {
+  feed_jpeg_error_t *err = (feed_jpeg_error_t *) args->err;
+  longjmp(err->jmp, 1);
+}
+
+/*
+ * Drop the bytes the decoder is done with and append `buf`, less any
+ * pending skip.
+ */
+
+static void
+feed_jpeg_append(feed_state_t *feed, uint8_t *buf, size_t len) {
+  feed_jpeg_source_t *src = &feed->jpeg_src;
+  std::vector<uint8_t> &pending = feed->pending;
+  pending.erase(pending.begin(), pending.end() - src->pub.bytes_in_buffer);
+
+  size_t skip = src->skip < len ? src->skip : len;
+  src->skip -= skip;
+  pending.insert(pending.end(), buf + skip, buf + len);
+
+  src->pub.next_input_byte = pending.empty() ? NULL : &pending[0];
+  src->pub.bytes_in_buffer = pending.size();
+}
+
+/*
+ * Decode as far as the bytes written so far allow, picking up where
+ * the decoder last suspended.
+ */
+
+cairo_status_t
+Image::feedJPEG() {
+  feed_state_t *feed = _feed;
+  struct jpeg_decompress_struct *args = &feed->jpeg;
+  if (setjmp(feed->jpeg_err.jmp)) return CAIRO_STATUS_READ_ERROR;
+
+  switch (feed->jpeg_state) {
+    case FEED_JPEG_HEADER:
+      if (JPEG_SUSPENDED == jpeg_read_header(args, 1)) return CAIRO_STATUS_SUCCESS;
+      setupJPEG(args);
+      feed->jpeg_state = FEED_JPEG_START;
+      // fall through
+    case FEED_JPEG_START:
+      if (!jpeg_start_decompress(args)) return CAIRO_STATUS_SUCCESS;
+      feed->surface_format = CAIRO_FORMAT_ARGB32;
+      feed->width = args->output_width;
+      feed->height = args->output_height;
+      feed->stride = feed->width * 4;
+      feed->data = (uint8_t *) malloc((size_t) feed->stride * feed->height);
+      if (!feed->data) return CAIRO_STATUS_NO_MEMORY;
+      if (!jpeg_output_is_argb32(args)) {
+        feed->jpeg_row = (uint8_t *) malloc(feed->width * args->output_components);
+        if (!feed->jpeg_row) return CAIRO_STATUS_NO_MEMORY;
+      }
+      feed->jpeg_state = FEED_JPEG_ROWS;
+      // fall through
+    case FEED_JPEG_ROWS:
+      while (args->output_scanline < args->output_height) {
+        uint8_t *row = feed->data + (size_t) feed->stride * args->output_scanline;
+        if (!read_jpeg_row(args, row, feed->jpeg_row)) return CAIRO_STATUS_SUCCESS;
+      }
+      feed->jpeg_state = FEED_JPEG_FINISH;
+      // fall through
+    case FEED_JPEG_FINISH:
+      if (!jpeg_finish_decompress(args)) return CAIRO_STATUS_SUCCESS;
+      feed->jpeg_state = FEED_JPEG_DONE;
+      feed->done = true;
+      // fall through
+    case FEED_JPEG_DONE:
+      break;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+#endif /* HAVE_JPEG */
+
+/*
+ * Pick the decoder for the first bytes in `pending`.
+ */
+
+cairo_status_t
+Image::sniffFeed() {
+  feed_state_t *feed = _feed;
+  uint8_t *data = &feed->pending[0];
+  feed->sniffed = true;
+
+  if (isPNG(data)) {
+    feed->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (feed->png) feed->png_info = png_create_info_struct(feed->png);
+    if (!feed->png_info) return CAIRO_STATUS_NO_MEMORY;
+    png_set_progressive_read_fn(feed->png, feed, feed_png_info, feed_png_row, feed_png_end);
+    feed->format = PNG;
+    feed->incremental = true;
+  }
+
+#ifdef HAVE_JPEG
+  if (isJPEG(data) && DATA_IMAGE == data_mode) {
+    struct jpeg_decompress_struct *args = &feed->jpeg;
+    args->err = jpeg_std_error(&feed->jpeg_err.pub);
+    feed->jpeg_err.pub.error_exit = feed_jpeg_error_exit;
+    if (setjmp(feed->jpeg_err.jmp)) return CAIRO_STATUS_NO_MEMORY;
+    jpeg_create_decompress(args);
+    feed->jpeg_created = true;
+
+    feed_jpeg_source_t *src = &feed->jpeg_src;
+    src->pub.init_source = feed_jpeg_init_source;
+    src->pub.fill_input_buffer = feed_jpeg_fill_input_buffer;
+    src->pub.skip_input_data = feed_jpeg_skip_input_data;
+    src->pub.resync_to_restart = jpeg_resync_to_restart;
+    src->pub.term_source = feed_jpeg_term_source;
+    src->pub.next_input_byte = NULL;
+    src->pub.bytes_in_buffer = 0;
+    src->skip = 0;
+    src->eof = false;
+    args->src = &src->pub;
+
+    feed->jpeg_state = FEED_JPEG_HEADER;
+    feed->format = JPEG;
+    feed->incremental = true;
+  }
+#endif
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Decode the chunk `buf` as far as possible, once enough bytes have
+ * been written to tell the format.
+ */
+
+cairo_status_t
+Image::feed(uint8_t *buf, unsigned len) {
+  feed_state_t *feed = _feed;
+
+  if (!feed->sniffed) {
+    feed->pending.insert(feed->pending.end(), buf, buf + len);
+    if (feed->pending.size() < FEED_SNIFF_BYTES) return CAIRO_STATUS_SUCCESS;
+    cairo_status_t status = sniffFeed();
+    if (status || !feed->incremental) return status;
+
+    // Decode the bytes collected so far as a first chunk
+    std::vector<uint8_t> first;
+    first.swap(feed->pending);
+    if (PNG == feed->format) return feed_png(feed, &first[0], first.size());
+#ifdef HAVE_JPEG
+    feed_jpeg_append(feed, &first[0], first.size());
+    return feedJPEG();
+#endif
+  }
+
+  if (!feed->incremental) {
+    feed->pending.insert(feed->pending.end(), buf, buf + len);
+    return CAIRO_STATUS_SUCCESS;
+  }
+  // Anything after the end of the image is ignored
+  if (feed->done) return CAIRO_STATUS_SUCCESS;
+  if (PNG == feed->format) return feed_png(feed, buf, len);
+#ifdef HAVE_JPEG
+  feed_jpeg_append(feed, buf, len);
+  return feedJPEG();
+#endif
+  return CAIRO_STATUS_READ_ERROR;
+}
+
+/*
+ * Complete the image once every chunk has been written.
+ */
+
+cairo_status_t
+Image::feedEnd() {
+  feed_state_t *feed = _feed;
+
+  if (!feed->incremental) {
+    if (feed->pending.empty()) return CAIRO_STATUS_READ_ERROR;
+    return loadFromBuffer(&feed->pending[0], feed->pending.size());
+  }
+
+#ifdef HAVE_JPEG
+  // Decode what there is of a truncated JPEG
+  if (JPEG == feed->format && !feed->done) {
+    feed->jpeg_src.eof = true;
+    cairo_status_t status = feedJPEG();
+    if (status) return status;
+  }
+#endif
+  if (!feed->done) return CAIRO_STATUS_READ_ERROR;
+
+  _surface = cairo_image_surface_create_for_data(
+      feed->data
+    , feed->surface_format
+    , feed->width
+    , feed->height
+    , feed->stride);
+  cairo_status_t status = cairo_surface_status(_surface);
+  if (status) return status;
+
+  _data = feed->data;
+  feed->data = NULL;
+  return CAIRO_STATUS_SUCCESS;
+}
+
 /*
  * Return UNKNOWN, JPEG, or PNG based on the filename.
  */
@@ -9,6 +9,7 @@
 #define __NODE_IMAGE_H__
 
 #include "Canvas.h"
+#include <vector>
 
 #ifdef HAVE_JPEG
 #include <jpeglib.h>
@@ -23,10 +24,26 @@
   #else
     #define GIF_CLOSE_FILE(gif) DGifCloseFile(gif)
   #endif
+
+/*
+ * A frame of an animated GIF: where its image descriptor starts in the
+ * source, its rectangle, delay in ms, disposal method and transparent
+ * color index, or -1.
+ */
+
+typedef struct {
+  unsigned offset;
+  int left, top, width, height;
+  int delay;
+  int disposal;
+  int transparent;
+} gif_frame_t;
 #endif
 
 
 
+struct feed_state_t;
+
 class Image: public Nan::ObjectWrap {
   public:
     char *filename;
@@ -43,10 +60,26 @@ class Image: public Nan::ObjectWrap {
     static NAN_GETTER(GetWidth);
     static NAN_GETTER(GetHeight);
     static NAN_GETTER(GetDataMode);
+    static NAN_GETTER(GetDecoding);
+    static NAN_GETTER(GetMaxWidth);
+    static NAN_GETTER(GetMaxHeight);
+    static NAN_GETTER(GetFrameCount);
+    static NAN_GETTER(GetFrame);
+    static NAN_GETTER(GetFrameDelays);
     static NAN_SETTER(SetSource);
     static NAN_SETTER(SetOnload);
     static NAN_SETTER(SetOnerror);
     static NAN_SETTER(SetDataMode);
+    static NAN_SETTER(SetDecoding);
+    static NAN_SETTER(SetMaxWidth);
+    static NAN_SETTER(SetMaxHeight);
+    static NAN_SETTER(SetFrame);
+    static NAN_METHOD(WhenDecoded);
+    static NAN_METHOD(BeginFeed);
+    static NAN_METHOD(Feed);
+    static NAN_METHOD(EndFeed);
+    static void DecodeAsync(uv_work_t *req);
+    static void DecodeAsyncAfter(uv_work_t *req);
     inline cairo_surface_t *surface(){ return _surface; }
     inline uint8_t *data(){ return cairo_image_surface_get_data(_surface); }
     inline int stride(){ return cairo_image_surface_get_stride(_surface); }
@@ -63,11 +96,18 @@ class Image: public Nan::ObjectWrap {
 #ifdef HAVE_GIF
     cairo_status_t loadGIFFromBuffer(uint8_t *buf, unsigned len);
     cairo_status_t loadGIF(FILE *stream);
+    cairo_status_t compositeGIFFrame(uint8_t *buf, unsigned len, int frame);
+    void disposeGIFFrame(int frame);
+    void clearGIF();
 #endif
 #ifdef HAVE_JPEG
     cairo_status_t loadJPEGFromBuffer(uint8_t *buf, unsigned len);
     cairo_status_t loadJPEG(FILE *stream);
     cairo_status_t decodeJPEGIntoSurface(jpeg_decompress_struct *info);
+    void scaleJPEG(jpeg_decompress_struct *info);
+    void setupJPEG(jpeg_decompress_struct *info);
+    void startJPEG(jpeg_decompress_struct *info);
+    cairo_status_t feedJPEG();
 #if CAIRO_VERSION_MINOR >= 10
     cairo_status_t decodeJPEGBufferIntoMimeSurface(uint8_t *buf, unsigned len);
     cairo_status_t assignDataAsMime(uint8_t *data, int len, const char *mime_type);
@@ -76,6 +116,11 @@ class Image: public Nan::ObjectWrap {
     void error(Local<Value> error);
     void loaded();
     cairo_status_t load();
+    void loadAsync(Local<Value> buffer);
+    void adopt(Image *decoded);
+    int frameCount();
+    cairo_status_t feed(uint8_t *buf, unsigned len);
+    cairo_status_t feedEnd();
     Image();
 
     enum {
@@ -89,6 +134,9 @@ class Image: public Nan::ObjectWrap {
       , DATA_MIME = 2
     } data_mode;
 
+    bool decode_async;
+    uint32_t max_width, max_height;
+
     typedef enum {
         UNKNOWN
       , GIF
@@ -102,6 +150,20 @@ class Image: public Nan::ObjectWrap {
     cairo_surface_t *_surface;
     uint8_t *_data;
     int _data_len;
+    uint32_t _loadId;
+    bool _decoding;
+    std::vector<Nan::Callback *> _waiters;
+    feed_state_t *_feed;
+#ifdef HAVE_GIF
+    uint8_t *_gif;
+    unsigned _gifLen;
+    std::vector<gif_frame_t> _gifFrames;
+    int _frame;
+    uint32_t *_gifRestore;
+#endif
+    void settle(Local<Value> err);
+    cairo_status_t sniffFeed();
+    void freeFeed();
     ~Image();
 };
 
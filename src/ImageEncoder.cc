@@ -0,0 +1,317 @@
+
+//
+// ImageEncoder.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ImageEncoder.h"
+#include "work_pool.h"
+
+/*
+ * Rows encoded per step, aiming for roughly ENCODER_BATCH_BYTES
+ * of surface data. A read keeps stepping until there is output.
+ */
+
+#define ENCODER_BATCH_BYTES (256 * 1024)
+
+/*
+ * Largest output collected while streaming so it can be cached. A
+ * stream of a larger image keeps no copy of what it has handed out.
+ */
+
+#define ENCODER_CACHE_MAX_BYTES (256 * 1024)
+
+Nan::Persistent<FunctionTemplate> ImageEncoder::constructor;
+
+/*
+ * Initialize ImageEncoder. Instances are only created by
+ * Canvas#createEncoder(), so the constructor is not exported.
+ */
+
+void
+ImageEncoder::Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
+  Nan::HandleScope scope;
+
+  // Constructor
+  Local<FunctionTemplate> ctor = Nan::New<FunctionTemplate>(ImageEncoder::New);
+  constructor.Reset(ctor);
+  ctor->InstanceTemplate()->SetInternalFieldCount(1);
+  ctor->SetClassName(Nan::New("ImageEncoder").ToLocalChecked());
+
+  // Prototype
+  Nan::SetPrototypeMethod(ctor, "read", Read);
+  Nan::SetPrototypeMethod(ctor, "readSync", ReadSync);
+}
+
+/*
+ * Create an encoder for `canvas`. `settings` carries the compression
+ * level, filters and palette for PNG or the JPEG options; each chunk starts out
+ * as a `chunk_size` byte allocation.
+ */
+
+Local<Object>
+ImageEncoder::NewInstance(Local<Object> canvas, canvas_encoding_t encoding, const closure_t *settings, unsigned chunk_size) {
+  Nan::EscapableHandleScope scope;
+  Local<Function> ctor = Nan::GetFunction(Nan::New(constructor)).ToLocalChecked();
+  Local<Object> instance = Nan::NewInstance(ctor).ToLocalChecked();
+  ImageEncoder *encoder = Nan::ObjectWrap::Unwrap<ImageEncoder>(instance);
+
+  encoder->_canvas = Nan::ObjectWrap::Unwrap<Canvas>(canvas);
+  encoder->_canvasObject.Reset(canvas);
+  // Keep the surface alive should the canvas be resized mid-stream
+  encoder->_surface = cairo_surface_reference(encoder->_canvas->surface());
+  encoder->_encoding = encoding;
+  encoder->_closure.encoding = encoding;
+  encoder->_chunkSize = chunk_size ? chunk_size : PAGE_SIZE;
+  encoder->_closure.canvas = encoder->_canvas;
+  encoder->_closure.compression_level = settings->compression_level;
+  encoder->_closure.filter = settings->filter;
+  encoder->_closure.palette = settings->palette;
+  encoder->_closure.jpeg = settings->jpeg;
+  encoder->_closure.generation = encoder->_canvas->generation();
+
+  const std::string *cached = encoder->_canvas->cachedEncoding(closure_cache_key(&encoder->_closure));
+  if (cached) {
+    encoder->_cached = *cached;
+    encoder->_cacheHit = true;
+    encoder->_caching = false;
+  }
+  return scope.Escape(instance);
+}
+
+/*
+ * Initialize a new ImageEncoder.
+ */
+
+NAN_METHOD(ImageEncoder::New) {
+  if (!info.IsConstructCall()) {
+    return Nan::ThrowTypeError("Class constructors cannot be invoked without 'new'");
+  }
+
+  ImageEncoder *encoder = new ImageEncoder();
+  encoder->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+ImageEncoder::ImageEncoder() {
+  _canvas = NULL;
+  _surface = NULL;
+  _encoding = CANVAS_ENCODING_PNG;
+  _chunkSize = PAGE_SIZE;
+  _closure.pfn = NULL;
+  _closure.len = 0;
+  _closure.max_len = 0;
+  _closure.data = NULL;
+  _closure.canvas = NULL;
+  _closure.encoding = CANVAS_ENCODING_PNG;
+  _closure.status = CAIRO_STATUS_SUCCESS;
+  _closure.threads = 1;
+  _closure.palette.max_colors = 0;
+  _closure.palette.dither = false;
+  _closure.max_compression = false;
+  _png.png = NULL;
+  _png.info = NULL;
+  _png.quantizer = NULL;
+  _png.row_buf = NULL;
+#ifdef HAVE_JPEG
+  _jpeg.active = false;
+#endif
+  _cachedOffset = 0;
+  _cacheHit = false;
+  _caching = true;
+  _started = false;
+  _reading = false;
+  _req.data = this;
+}
+
+ImageEncoder::~ImageEncoder() {
+  canvas_png_encoder_destroy(&_png);
+#ifdef HAVE_JPEG
+  jpeg_encoder_destroy(&_jpeg);
+#endif
+  free(_closure.data);
+  if (_surface) cairo_surface_destroy(_surface);
+  _canvasObject.Reset();
+}
+
+/*
+ * Whether the whole image has been encoded, or encoding failed.
+ */
+
+bool
+ImageEncoder::done() {
+  if (_closure.status) return true;
+  if (_cacheHit) return _cachedOffset == _cached.size();
+  if (!_started) return false;
+#ifdef HAVE_JPEG
+  if (CANVAS_ENCODING_JPEG == _encoding) return jpeg_encoder_done(&_jpeg);
+#endif
+  return canvas_png_encoder_done(&_png);
+}
+
+/*
+ * Encode rows into a fresh chunk until there is some output or the
+ * image is complete. An empty chunk means the end of the image.
+ * Touches no JS state, so it is safe to call from the thread pool.
+ */
+
+cairo_status_t
+ImageEncoder::encodeNext() {
+  closure_t *closure = &_closure;
+  int stride = cairo_image_surface_get_stride(_surface);
+  unsigned rows = ENCODER_BATCH_BYTES / (stride > 0 ? stride : 1);
+  if (!rows) rows = 1;
+
+  closure->len = 0;
+  if (done()) return closure->status;
+
+  if (_cacheHit) {
+    size_t len = _cached.size() - _cachedOffset;
+    if (len > ENCODER_BATCH_BYTES) len = ENCODER_BATCH_BYTES;
+    if (!closure->data || closure->max_len < len) {
+      free(closure->data);
+      closure->data = (uint8_t *) malloc(closure->max_len = len);
+      if (!closure->data) return closure->status = CAIRO_STATUS_NO_MEMORY;
+    }
+    memcpy(closure->data, _cached.data() + _cachedOffset, len);
+    closure->len = len;
+    _cachedOffset += len;
+    return CAIRO_STATUS_SUCCESS;
+  }
+
+  // The previous chunk was handed over to a Buffer
+  if (!closure->data) {
+    closure->data = (uint8_t *) malloc(closure->max_len = _chunkSize);
+    if (!closure->data) return closure->status = CAIRO_STATUS_NO_MEMORY;
+  }
+
+  if (!_started) {
+    _started = true;
+#ifdef HAVE_JPEG
+    if (CANVAS_ENCODING_JPEG == _encoding) {
+      closure->status = jpeg_encoder_begin(&_jpeg, _surface, &closure->jpeg, closure);
+    } else
+#endif
+    closure->status = canvas_png_encoder_begin(&_png, _surface, closure_write, closure);
+  }
+
+  while (!closure->status && !closure->len && !done()) {
+#ifdef HAVE_JPEG
+    if (CANVAS_ENCODING_JPEG == _encoding) {
+      closure->status = jpeg_encoder_write_rows(&_jpeg, rows);
+      continue;
+    }
+#endif
+    closure->status = canvas_png_encoder_write_rows(&_png, rows);
+  }
+
+  return closure->status;
+}
+
+/*
+ * Hand the encoded chunk over to a Buffer, or return null at the end
+ * of the image, at which point the whole output is cached if it is
+ * small and the canvas has not been drawn to since the encoder was
+ * created. Output is only collected for that while it stays small.
+ */
+
+Local<Value>
+ImageEncoder::takeChunk() {
+  if (_closure.len) {
+    if (_caching) {
+      if (_output.size() + _closure.len > ENCODER_CACHE_MAX_BYTES
+        || _closure.generation != _canvas->generation()) {
+        _caching = false;
+        std::string().swap(_output);
+      } else {
+        _output.append((const char *) _closure.data, _closure.len);
+      }
+    }
+    return closure_to_buffer(&_closure);
+  }
+
+  if (_caching && _output.size()) {
+    if (_closure.generation == _canvas->generation())
+      _canvas->cacheEncoding(closure_cache_key(&_closure), (const uint8_t *) _output.data(), _output.size());
+    std::string().swap(_output);
+  }
+  _caching = false;
+  return Nan::Null();
+}
+
+/*
+ * Encode the next chunk on the thread pool.
+ */
+
+void
+ImageEncoder::ReadAsync(uv_work_t *req) {
+  ImageEncoder *encoder = (ImageEncoder *) req->data;
+  encoder->encodeNext();
+}
+
+/*
+ * Hand the chunk to the read callback, or null at the end.
+ */
+
+void
+ImageEncoder::ReadAsyncAfter(uv_work_t *req) {
+  Nan::HandleScope scope;
+  ImageEncoder *encoder = (ImageEncoder *) req->data;
+  closure_t *closure = &encoder->_closure;
+  Nan::Callback *fn = closure->pfn;
+
+  encoder->_reading = false;
+  closure->pfn = NULL;
+
+  if (closure->status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->status) };
+    fn->Call(1, argv);
+  } else {
+    Local<Value> argv[2] = { Nan::Null(), encoder->takeChunk() };
+    fn->Call(2, argv);
+  }
+
+  delete fn;
+  encoder->Unref();
+}
+
+/*
+ * Encode the next chunk on the thread pool and call back with
+ * (err, chunk), chunk being null once the image is complete.
+ * Only one read may be pending at a time.
+ */
+
+NAN_METHOD(ImageEncoder::Read) {
+  ImageEncoder *encoder = Nan::ObjectWrap::Unwrap<ImageEncoder>(info.This());
+
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("callback function required");
+  if (encoder->_reading)
+    return Nan::ThrowError("A read is already in progress");
+
+  encoder->_reading = true;
+  encoder->_closure.pfn = new Nan::Callback(info[0].As<Function>());
+  encoder->Ref();
+  work_pool_queue(WORK_LANE_ENCODE, &encoder->_req, ReadAsync, (uv_after_work_cb)ReadAsyncAfter);
+}
+
+/*
+ * Encode the next chunk synchronously, returning null once the
+ * image is complete.
+ */
+
+NAN_METHOD(ImageEncoder::ReadSync) {
+  ImageEncoder *encoder = Nan::ObjectWrap::Unwrap<ImageEncoder>(info.This());
+
+  if (encoder->_reading)
+    return Nan::ThrowError("A read is already in progress");
+
+  cairo_status_t status = encoder->encodeNext();
+  if (status) return Nan::ThrowError(Canvas::Error(status));
+
+  info.GetReturnValue().Set(encoder->takeChunk());
+}
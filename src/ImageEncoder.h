@@ -0,0 +1,65 @@
+
+//
+// ImageEncoder.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_IMAGE_ENCODER_H__
+#define __NODE_IMAGE_ENCODER_H__
+
+#include "Canvas.h"
+#include "closure.h"
+#include "PNG.h"
+
+#ifdef HAVE_JPEG
+#include "JPEGStream.h"
+#endif
+
+/*
+ * Pull-based incremental encoder behind PNGStream and JPEGStream.
+ * Nothing is encoded until a chunk is asked for; each read encodes
+ * just enough rows to produce the next chunk of output. When the
+ * canvas holds a cached encoding with the same settings it is served
+ * instead, and a complete encode of an unchanged canvas is cached
+ * when it is small.
+ */
+
+class ImageEncoder: public Nan::ObjectWrap {
+  public:
+    static Nan::Persistent<FunctionTemplate> constructor;
+    static void Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target);
+    static Local<Object> NewInstance(Local<Object> canvas, canvas_encoding_t encoding, const closure_t *settings, unsigned chunk_size);
+    static NAN_METHOD(New);
+    static NAN_METHOD(Read);
+    static NAN_METHOD(ReadSync);
+    static void ReadAsync(uv_work_t *req);
+    static void ReadAsyncAfter(uv_work_t *req);
+    cairo_status_t encodeNext();
+
+  private:
+    ImageEncoder();
+    ~ImageEncoder();
+    bool done();
+    Local<Value> takeChunk();
+    Canvas *_canvas;
+    Nan::Persistent<Object> _canvasObject;
+    cairo_surface_t *_surface;
+    canvas_encoding_t _encoding;
+    unsigned _chunkSize;
+    closure_t _closure;
+    canvas_png_encoder_t _png;
+#ifdef HAVE_JPEG
+    jpeg_encoder_t _jpeg;
+#endif
+    std::string _cached;
+    size_t _cachedOffset;
+    bool _cacheHit;
+    bool _caching;
+    std::string _output;
+    bool _started;
+    bool _reading;
+    uv_work_t _req;
+};
+
+#endif
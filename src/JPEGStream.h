@@ -7,6 +7,8 @@
 #define __NODE_JPEG_STREAM_H__
 
 #include "Canvas.h"
+#include "pixel_convert.h"
+#include <setjmp.h>
 #include <jpeglib.h>
 #include <jerror.h>
 
@@ -22,12 +24,12 @@ typedef struct {
   int bufsize;
 } closure_destination_mgr;
 
-void
+inline void
 init_closure_destination(j_compress_ptr cinfo){
   // we really don't have to do anything here
 }
 
-boolean
+inline boolean
 empty_closure_output_buffer(j_compress_ptr cinfo){
   Nan::HandleScope scope;
   closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
@@ -47,7 +49,7 @@ empty_closure_output_buffer(j_compress_ptr cinfo){
   return true;
 }
 
-void
+inline void
 term_closure_destination(j_compress_ptr cinfo){
   Nan::HandleScope scope;
   closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
@@ -71,7 +73,7 @@ term_closure_destination(j_compress_ptr cinfo){
   Nan::MakeCallback(Nan::GetCurrentContext()->Global(), (v8::Local<v8::Function>)dest->closure->fn, 2, end_argv);
 }
 
-void
+inline void
 jpeg_closure_dest(j_compress_ptr cinfo, closure_t * closure, int bufsize){
   closure_destination_mgr * dest;
 
@@ -98,49 +100,285 @@ jpeg_closure_dest(j_compress_ptr cinfo, closure_t * closure, int bufsize){
   cinfo->dest->free_in_buffer = dest->bufsize;
 }
 
-void
-write_to_jpeg_stream(cairo_surface_t *surface, int bufsize, int quality, bool progressive, closure_t *closure){
+/*
+ * Growable in-memory destination writing straight into the closure's
+ * buffer, so that an encode can run on the thread pool without calling
+ * back into JS.
+ */
+
+inline void
+init_closure_buffer_destination(j_compress_ptr cinfo){
+  closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
+  closure_t *closure = dest->closure;
+  cinfo->dest->next_output_byte = closure->data + closure->len;
+  cinfo->dest->free_in_buffer = closure->max_len - closure->len;
+}
+
+inline boolean
+empty_closure_buffer(j_compress_ptr cinfo){
+  closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
+  closure_t *closure = dest->closure;
+  unsigned max = closure->max_len * 2;
+
+  uint8_t *data = (uint8_t *) realloc(closure->data, max);
+  if (!data) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+  closure->len = closure->max_len;
+  closure->data = data;
+  closure->max_len = max;
+  cinfo->dest->next_output_byte = closure->data + closure->len;
+  cinfo->dest->free_in_buffer = closure->max_len - closure->len;
+  return true;
+}
+
+inline void
+term_closure_buffer_destination(j_compress_ptr cinfo){
+  closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
+  dest->closure->len = dest->closure->max_len - cinfo->dest->free_in_buffer;
+}
+
+inline void
+jpeg_closure_buffer_dest(j_compress_ptr cinfo, closure_t *closure){
+  if (cinfo->dest == NULL) {
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+         sizeof(closure_destination_mgr));
+  }
+
+  closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
+  cinfo->dest->init_destination = &init_closure_buffer_destination;
+  cinfo->dest->empty_output_buffer = &empty_closure_buffer;
+  cinfo->dest->term_destination = &term_closure_buffer_destination;
+  dest->closure = closure;
+  dest->buffer = NULL;
+  dest->bufsize = 0;
+}
+
+/*
+ * Error manager that returns control to the encoder instead of
+ * exit()ing, so that failures can be reported through a status.
+ */
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} canvas_jpeg_error_mgr;
+
+inline void
+canvas_jpeg_error_exit(j_common_ptr cinfo){
+  canvas_jpeg_error_mgr *err = (canvas_jpeg_error_mgr *) cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/*
+ * Reset `opts` to the encoder defaults.
+ */
+
+inline void
+jpeg_options_init(jpeg_options_t *opts){
+  opts->quality = 75;
+  opts->progressive = false;
+  opts->chroma_subsampling = 420;
+  opts->optimize_coding = false;
+  opts->dct_method = JDCT_ISLOW;
+  opts->restart_interval = 0;
+}
+
+/*
+ * Set up `cinfo` for `surface` and start compressing, with the
+ * destination already attached. Rows are then fed by jpeg_encode_rows().
+ */
+
+inline void
+jpeg_encode_begin(j_compress_ptr cinfo, cairo_surface_t *surface, const jpeg_options_t *opts){
   int w = cairo_image_surface_get_width(surface);
   int h = cairo_image_surface_get_height(surface);
+
+#ifdef JCS_EXTENSIONS
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  cinfo->in_color_space = JCS_EXT_XRGB;
+#else
+  cinfo->in_color_space = JCS_EXT_BGRX;
+#endif
+  cinfo->input_components = 4;
+#else
+  cinfo->in_color_space = JCS_RGB;
+  cinfo->input_components = 3;
+#endif
+  cinfo->image_width = w;
+  cinfo->image_height = h;
+  jpeg_set_defaults(cinfo);
+  if (opts->progressive)
+     jpeg_simple_progression(cinfo);
+  jpeg_set_quality(cinfo, opts->quality, (opts->quality<25)?0:1);
+
+  cinfo->comp_info[0].h_samp_factor = opts->chroma_subsampling == 444 ? 1 : 2;
+  cinfo->comp_info[0].v_samp_factor = opts->chroma_subsampling == 420 ? 2 : 1;
+  cinfo->optimize_coding = opts->optimize_coding;
+  cinfo->dct_method = (J_DCT_METHOD) opts->dct_method;
+  cinfo->restart_interval = opts->restart_interval;
+
+  jpeg_start_compress(cinfo, TRUE);
+}
+
+/*
+ * Compress up to `count` more rows of `surface`, finishing the image
+ * after the last one. With libjpeg-turbo the surface rows are handed
+ * over as they are; otherwise each row is converted to RGB first.
+ * Returns true once the image is complete.
+ */
+
+inline bool
+jpeg_encode_rows(j_compress_ptr cinfo, cairo_surface_t *surface, unsigned count){
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  JDIMENSION end = cinfo->next_scanline + count;
+  if (end > cinfo->image_height || end < cinfo->next_scanline) end = cinfo->image_height;
+
+#ifdef JCS_EXTENSIONS
+  while (cinfo->next_scanline < end) {
+    JSAMPROW row = data + cinfo->next_scanline * stride;
+    jpeg_write_scanlines(cinfo, &row, 1);
+  }
+#else
+  JSAMPARRAY slr = (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, cinfo->image_width * 3, 1);
+  while (cinfo->next_scanline < end) {
+    argb32_convert(slr[0], data + cinfo->next_scanline * stride, cinfo->image_width, PIXEL_FORMAT_RGB, true);
+    jpeg_write_scanlines(cinfo, slr, 1);
+  }
+#endif
+
+  if (cinfo->next_scanline < cinfo->image_height) return false;
+  jpeg_finish_compress(cinfo);
+  return true;
+}
+
+/*
+ * Compress `surface` with the destination already attached to `cinfo`.
+ */
+
+inline void
+jpeg_encode_surface(j_compress_ptr cinfo, cairo_surface_t *surface, const jpeg_options_t *opts){
+  jpeg_encode_begin(cinfo, surface, opts);
+  jpeg_encode_rows(cinfo, surface, cinfo->image_height);
+}
+
+inline void
+write_to_jpeg_stream(cairo_surface_t *surface, int bufsize, const jpeg_options_t *opts, closure_t *closure){
   struct jpeg_compress_struct cinfo;
   struct jpeg_error_mgr jerr;
 
-  JSAMPROW slr;
   cinfo.err = jpeg_std_error(&jerr);
   jpeg_create_compress(&cinfo);
-  cinfo.in_color_space = JCS_RGB;
-  cinfo.input_components = 3;
-  cinfo.image_width = w;
-  cinfo.image_height = h;
-  jpeg_set_defaults(&cinfo);
-  if (progressive)
-     jpeg_simple_progression(&cinfo);
-  jpeg_set_quality(&cinfo, quality, (quality<25)?0:1);
   jpeg_closure_dest(&cinfo, closure, bufsize);
+  jpeg_encode_surface(&cinfo, surface, opts);
+  jpeg_destroy_compress(&cinfo);
+}
 
-  jpeg_start_compress(&cinfo, TRUE);
-  unsigned char *dst;
-  unsigned int *src = (unsigned int *) cairo_image_surface_get_data(surface);
-  int sl = 0;
-  dst = (unsigned char *) malloc(w * 3);
-  while (sl < h) {
-    unsigned char *dp = dst;
-    int x = 0;
-    while (x < w) {
-      dp[0] = (*src >> 16) & 255;
-      dp[1] = (*src >> 8) & 255;
-      dp[2] = *src & 255;
-      src++;
-      dp += 3;
-      x++;
-    }
-    slr = dst;
-    jpeg_write_scanlines(&cinfo, &slr, 1);
-    sl++;
+/*
+ * Encode `surface` into `closure`'s buffer. Touches no JS state, so
+ * it is safe to call from the thread pool.
+ */
+
+inline cairo_status_t
+write_to_jpeg_buffer(cairo_surface_t *surface, const jpeg_options_t *opts, closure_t *closure){
+  struct jpeg_compress_struct cinfo;
+  canvas_jpeg_error_mgr jerr;
+
+  cairo_surface_flush(surface);
+  if (cairo_surface_status(surface)) return cairo_surface_status(surface);
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = canvas_jpeg_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_compress(&cinfo);
+    return CAIRO_STATUS_WRITE_ERROR;
   }
-  free(dst);
-  jpeg_finish_compress(&cinfo);
+
+  jpeg_create_compress(&cinfo);
+  jpeg_closure_buffer_dest(&cinfo, closure);
+  jpeg_encode_surface(&cinfo, surface, opts);
   jpeg_destroy_compress(&cinfo);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Incremental JPEG encoder writing into a closure's buffer, for
+ * encoding a batch of rows at a time. Between batches the closure's
+ * data may be handed over to a Buffer and replaced by a fresh
+ * allocation (with `len` reset to 0). Touches no JS state.
+ */
+
+typedef struct {
+  struct jpeg_compress_struct cinfo;
+  canvas_jpeg_error_mgr jerr;
+  cairo_surface_t *surface;
+  bool active;
+} jpeg_encoder_t;
+
+inline void
+jpeg_encoder_destroy(jpeg_encoder_t *enc){
+  if (enc->active) jpeg_destroy_compress(&enc->cinfo);
+  enc->active = false;
+}
+
+/*
+ * Bring the closure's length up to date with the compressed output.
+ */
+
+inline void
+jpeg_encoder_sync(jpeg_encoder_t *enc){
+  closure_destination_mgr *dest = (closure_destination_mgr *) enc->cinfo.dest;
+  dest->closure->len = dest->closure->max_len - enc->cinfo.dest->free_in_buffer;
+}
+
+inline cairo_status_t
+jpeg_encoder_begin(jpeg_encoder_t *enc, cairo_surface_t *surface, const jpeg_options_t *opts, closure_t *closure){
+  enc->surface = surface;
+  enc->active = false;
+
+  cairo_surface_flush(surface);
+  if (cairo_surface_status(surface)) return cairo_surface_status(surface);
+
+  enc->cinfo.err = jpeg_std_error(&enc->jerr.pub);
+  enc->jerr.pub.error_exit = canvas_jpeg_error_exit;
+  if (setjmp(enc->jerr.setjmp_buffer)) {
+    jpeg_encoder_destroy(enc);
+    return CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  jpeg_create_compress(&enc->cinfo);
+  enc->active = true;
+  jpeg_closure_buffer_dest(&enc->cinfo, closure);
+  jpeg_encode_begin(&enc->cinfo, surface, opts);
+  jpeg_encoder_sync(enc);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Compress up to `count` more rows. The encoder is destroyed once
+ * the image is complete or on error.
+ */
+
+inline cairo_status_t
+jpeg_encoder_write_rows(jpeg_encoder_t *enc, unsigned count){
+  if (!enc->active) return CAIRO_STATUS_SUCCESS;
+
+  if (setjmp(enc->jerr.setjmp_buffer)) {
+    jpeg_encoder_destroy(enc);
+    return CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  init_closure_buffer_destination(&enc->cinfo);
+  bool done = jpeg_encode_rows(&enc->cinfo, enc->surface, count);
+  jpeg_encoder_sync(enc);
+  if (done) jpeg_encoder_destroy(enc);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+inline bool
+jpeg_encoder_done(jpeg_encoder_t *enc){
+  return !enc->active;
 }
 
 #endif
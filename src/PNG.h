@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "closure.h"
+#include "pixel_convert.h"
+#include "quantize.h"
 
 #if defined(__GNUC__) && (__GNUC__ > 2) && defined(__OPTIMIZE__)
 #define likely(expr) (__builtin_expect (!!(expr), 1))
@@ -26,41 +28,112 @@ static void canvas_png_flush(png_structp png_ptr) {
 
 /* Converts native endian xRGB => RGBx bytes */
 static void canvas_convert_data_to_bytes(png_structp png, png_row_infop row_info, png_bytep data) {
-    unsigned int i;
+    argb32_to_rgbx(data, data, row_info->rowbytes / 4);
+}
 
-    for (i = 0; i < row_info->rowbytes; i += 4) {
-        uint8_t *b = &data[i];
-        uint32_t pixel;
+/* Unpremultiplies data and converts native endian ARGB => RGBA bytes, in place */
+static void canvas_unpremultiply_bytes(png_bytep data, png_size_t rowbytes) {
+    argb32_unpremultiply_to_rgba(data, data, rowbytes / 4);
+}
 
-        memcpy(&pixel, b, sizeof (uint32_t));
+static void canvas_unpremultiply_data(png_structp png, png_row_infop row_info, png_bytep data) {
+    canvas_unpremultiply_bytes(data, row_info->rowbytes);
+}
 
-        b[0] = (pixel & 0xff0000) >> 16;
-        b[1] = (pixel & 0x00ff00) >>  8;
-        b[2] = (pixel & 0x0000ff) >>  0;
-        b[3] = 0;
+/*
+ * Smallest lossless PNG format for an ARGB32 or RGB24 surface, found
+ * by scanning its pixels: opaque content needs no alpha channel, gray
+ * content is written as gray (with alpha when translucent), and opaque
+ * gray content using only 1, 2 or 4-bit levels at that depth. The scan
+ * ends as soon as it is down to RGBA.
+ */
+
+typedef struct {
+    int color_type;
+    int bit_depth;
+} canvas_png_format_t;
+
+static canvas_png_format_t canvas_png_choose_format(cairo_surface_t *surface) {
+    uint8_t *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    bool rgb24 = cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24;
+    canvas_png_format_t format = { PNG_COLOR_TYPE_RGB_ALPHA, 8 };
+
+    // RGB24 alpha bytes are undefined, such surfaces are opaque anyway
+    uint32_t flags = rgb24 ? PIXEL_SCAN_ALL & ~PIXEL_SCAN_OPAQUE : PIXEL_SCAN_ALL;
+    for (int y = 0; y < height && (flags & (PIXEL_SCAN_OPAQUE | PIXEL_SCAN_GRAY)); y++) {
+        flags = argb32_scan(data + y * stride, width, flags);
     }
+    bool opaque = rgb24 || (flags & PIXEL_SCAN_OPAQUE);
+
+    if (!(flags & PIXEL_SCAN_GRAY)) {
+        format.color_type = opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    } else if (!opaque) {
+        format.color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+    } else {
+        format.color_type = PNG_COLOR_TYPE_GRAY;
+        format.bit_depth = flags & PIXEL_SCAN_GRAY1 ? 1 : flags & PIXEL_SCAN_GRAY2 ? 2 : flags & PIXEL_SCAN_GRAY4 ? 4 : 8;
+    }
+    return format;
 }
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
-static void canvas_unpremultiply_data(png_structp png, png_row_infop row_info, png_bytep data) {
-    unsigned int i;
+/*
+ * Bytes per row and per pixel (at least one, as PNG filters count it)
+ * in `format`.
+ */
+
+static inline size_t canvas_png_format_rowbytes(const canvas_png_format_t *format, unsigned int width) {
+    int channels = format->color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4
+        : format->color_type == PNG_COLOR_TYPE_RGB ? 3
+        : format->color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+    return ((size_t) width * channels * format->bit_depth + 7) / 8;
+}
+
+static inline int canvas_png_format_bpp(const canvas_png_format_t *format) {
+    return (int) canvas_png_format_rowbytes(format, 1);
+}
 
-    for (i = 0; i < row_info->rowbytes; i += 4) {
-        uint8_t *b = &data[i];
+/*
+ * Convert a row of ARGB32 or RGB24 pixels to `format` into `out`,
+ * which must hold `width` * 4 bytes. Gray levels are taken from blue.
+ */
+
+static void canvas_png_pack_row(const canvas_png_format_t *format, const uint8_t *src, uint8_t *out, unsigned int width) {
+    int depth = format->bit_depth;
+    unsigned int i, bits = 0, acc = 0;
+
+    switch (format->color_type) {
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        argb32_unpremultiply_to_rgba(out, src, width);
+        return;
+    case PNG_COLOR_TYPE_RGB:
+        argb32_convert(out, src, width, PIXEL_FORMAT_RGB, true);
+        return;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        argb32_unpremultiply_to_rgba(out, src, width);
+        for (i = 0; i < width; i++) {
+            out[i * 2] = out[i * 4 + 2];
+            out[i * 2 + 1] = out[i * 4 + 3];
+        }
+        return;
+    }
+
+    for (i = 0; i < width; i++) {
         uint32_t pixel;
-        uint8_t  alpha;
-
-        memcpy(&pixel, b, sizeof (uint32_t));
-        alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0) {
-            b[0] = b[1] = b[2] = b[3] = 0;
-        } else {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
+        memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+        if (depth == 8) {
+            out[i] = pixel & 0xff;
+            continue;
+        }
+        acc = acc << depth | (pixel & 0xff) >> (8 - depth);
+        if ((bits += depth) == 8) {
+            *out++ = acc;
+            acc = bits = 0;
         }
     }
+    if (bits) *out = acc << (8 - bits);
 }
 
 struct canvas_png_write_closure_t {
@@ -68,78 +141,172 @@ struct canvas_png_write_closure_t {
     void *closure;
 };
 
-static cairo_status_t canvas_write_png(cairo_surface_t *surface, png_rw_ptr write_func, void *closure) {
-    unsigned int i;
-    cairo_status_t status = CAIRO_STATUS_SUCCESS;
-    uint8_t *data;
+/*
+ * Incremental PNG encoder state. Rows are fed to libpng in batches by
+ * canvas_png_encoder_write_rows() so that encoding can be split across
+ * several thread pool work items, each one emitting whatever compressed
+ * output it produced. The struct must not move once begun since libpng
+ * holds pointers into it. ARGB32 and RGB24 surfaces are written in the
+ * format canvas_png_choose_format() picks, or, with a palette set in the
+ * closure, quantized and written as indexed color. Gray and indexed rows
+ * are converted into `row_buf` before being handed to libpng.
+ */
+typedef struct {
     png_structp png;
     png_infop info;
-    png_bytep *volatile rows = NULL;
+    cairo_surface_t *surface;
+    unsigned int width;
+    unsigned int height;
+    unsigned int row;
+    cairo_status_t status;
+    struct canvas_png_write_closure_t png_closure;
+    canvas_png_format_t format;
+    palette_quantizer_t *quantizer;
+    png_bytep row_buf;
+} canvas_png_encoder_t;
+
+static void canvas_png_encoder_destroy(canvas_png_encoder_t *enc) {
+    if (enc->png) png_destroy_write_struct(&enc->png, &enc->info);
+    enc->png = NULL;
+    enc->info = NULL;
+    if (enc->quantizer) palette_quantizer_destroy(enc->quantizer);
+    enc->quantizer = NULL;
+    free(enc->row_buf);
+    enc->row_buf = NULL;
+}
+
+/*
+ * Set up indexed output: quantize the surface, then write the palette
+ * with a bit depth just deep enough for it, and tRNS for translucent
+ * entries.
+ */
+
+static cairo_status_t canvas_png_encoder_begin_palette(canvas_png_encoder_t *enc, const palette_options_t *options, bool alpha) {
+    png_color colors[256];
+    png_byte trans[256];
+    unsigned count, translucent;
+    int bpc = 1;
+
+    enc->quantizer = palette_quantizer_create(cairo_image_surface_get_data(enc->surface),
+        enc->width, enc->height, cairo_image_surface_get_stride(enc->surface),
+        alpha, options->max_colors, options->dither);
+    enc->row_buf = (png_bytep) malloc(enc->width);
+    if (!enc->quantizer || !enc->row_buf) return CAIRO_STATUS_NO_MEMORY;
+
+    count = palette_quantizer_colors(enc->quantizer);
+    translucent = palette_quantizer_translucent(enc->quantizer);
+    for (unsigned i = 0; i < count; i++) {
+        const uint8_t *rgba = palette_quantizer_color(enc->quantizer, i);
+        colors[i].red = rgba[0];
+        colors[i].green = rgba[1];
+        colors[i].blue = rgba[2];
+        trans[i] = rgba[3];
+    }
+    while ((1u << bpc) < count) bpc *= 2;
+
+    png_set_IHDR(enc->png, enc->info, enc->width, enc->height, bpc, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(enc->png, enc->info, colors, count);
+    if (translucent) png_set_tRNS(enc->png, enc->info, trans, translucent, NULL);
+
+    png_write_info(enc->png, enc->info);
+    if (bpc < 8) png_set_packing(enc->png);
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static void canvas_stream_write_func(png_structp png, png_bytep data, png_size_t size) {
+    cairo_status_t status;
+    struct canvas_png_write_closure_t *png_closure;
+
+    png_closure = (struct canvas_png_write_closure_t *) png_get_io_ptr(png);
+    status = png_closure->write_func(png_closure->closure, data, size);
+    if (unlikely(status)) {
+        cairo_status_t *error = (cairo_status_t *) png_get_error_ptr(png);
+        if (*error == CAIRO_STATUS_SUCCESS) {
+            *error = status;
+        }
+        png_error(png, NULL);
+    }
+}
+
+static cairo_status_t canvas_png_encoder_begin(canvas_png_encoder_t *enc, cairo_surface_t *surface, cairo_write_func_t write_func, void *closure) {
     png_color_16 white;
     int png_color_type;
     int bpc;
-    unsigned int width = cairo_image_surface_get_width(surface);
-    unsigned int height = cairo_image_surface_get_height(surface);
 
-    data = cairo_image_surface_get_data(surface);
-    if (data == NULL) {
-        status = CAIRO_STATUS_SURFACE_TYPE_MISMATCH;
-        return status;
-    }
-    cairo_surface_flush(surface);
+    enc->png = NULL;
+    enc->info = NULL;
+    enc->quantizer = NULL;
+    enc->row_buf = NULL;
+    enc->surface = surface;
+    enc->row = 0;
+    enc->status = CAIRO_STATUS_SUCCESS;
+    enc->png_closure.write_func = write_func;
+    enc->png_closure.closure = closure;
 
-    if (width == 0 || height == 0) {
-        status = CAIRO_STATUS_WRITE_ERROR;
-        return status;
+    if (cairo_surface_status(surface)) {
+        return enc->status = cairo_surface_status(surface);
     }
 
-    rows = (png_bytep *) malloc(height * sizeof (png_byte*));
-    if (unlikely(rows == NULL)) {
-        status = CAIRO_STATUS_NO_MEMORY;
-        return status;
+    if (cairo_image_surface_get_data(surface) == NULL) {
+        return enc->status = CAIRO_STATUS_SURFACE_TYPE_MISMATCH;
     }
+    cairo_surface_flush(surface);
 
-    for (i = 0; i < height; i++) {
-	rows[i] = (png_byte *) data + i * cairo_image_surface_get_stride(surface);
+    enc->width = cairo_image_surface_get_width(surface);
+    enc->height = cairo_image_surface_get_height(surface);
+    if (enc->width == 0 || enc->height == 0) {
+        return enc->status = CAIRO_STATUS_WRITE_ERROR;
     }
 
 #ifdef PNG_USER_MEM_SUPPORTED
-     png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, NULL, NULL);
+    enc->png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, &enc->status, NULL, NULL, NULL, NULL, NULL);
 #else
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    enc->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &enc->status, NULL, NULL);
 #endif
 
-    if (unlikely(png == NULL)) {
-        status = CAIRO_STATUS_NO_MEMORY;
-        free(rows);
-        return status;
+    if (unlikely(enc->png == NULL)) {
+        return enc->status = CAIRO_STATUS_NO_MEMORY;
     }
 
-    info = png_create_info_struct (png);
-    if (unlikely(info == NULL)) {
-        status = CAIRO_STATUS_NO_MEMORY;
-        png_destroy_write_struct(&png, &info);
-        free(rows);
-        return status;
-
+    enc->info = png_create_info_struct(enc->png);
+    if (unlikely(enc->info == NULL)) {
+        canvas_png_encoder_destroy(enc);
+        return enc->status = CAIRO_STATUS_NO_MEMORY;
     }
 
 #ifdef PNG_SETJMP_SUPPORTED
-    if (setjmp (png_jmpbuf (png))) {
-        png_destroy_write_struct(&png, &info);
-        free(rows);
-        return status;
+    if (setjmp(png_jmpbuf(enc->png))) {
+        canvas_png_encoder_destroy(enc);
+        if (!enc->status) enc->status = CAIRO_STATUS_WRITE_ERROR;
+        return enc->status;
     }
 #endif
 
-    png_set_write_fn(png, closure, write_func, canvas_png_flush);
-    png_set_compression_level(png, ((closure_t *) ((canvas_png_write_closure_t *) closure)->closure)->compression_level);
-    png_set_filter(png, 0, ((closure_t *) ((canvas_png_write_closure_t *) closure)->closure)->filter);
+    png_set_write_fn(enc->png, &enc->png_closure, canvas_stream_write_func, canvas_png_flush);
+    png_set_compression_level(enc->png, ((closure_t *) closure)->compression_level);
+    png_set_filter(enc->png, 0, ((closure_t *) closure)->filter);
 
-    switch (cairo_image_surface_get_format(surface)) {
+    const palette_options_t *palette = &((closure_t *) closure)->palette;
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (palette->max_colors && (format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24)) {
+        enc->status = canvas_png_encoder_begin_palette(enc, palette, format == CAIRO_FORMAT_ARGB32);
+        if (enc->status) canvas_png_encoder_destroy(enc);
+        return enc->status;
+    }
+
+    switch (format) {
     case CAIRO_FORMAT_ARGB32:
-        bpc = 8;
-        png_color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    case CAIRO_FORMAT_RGB24:
+        enc->format = canvas_png_choose_format(surface);
+        bpc = enc->format.bit_depth;
+        png_color_type = enc->format.color_type;
+        if (!(png_color_type & PNG_COLOR_MASK_COLOR)) {
+            enc->row_buf = (png_bytep) malloc((size_t) enc->width * 4);
+            if (!enc->row_buf) {
+                canvas_png_encoder_destroy(enc);
+                return enc->status = CAIRO_STATUS_NO_MEMORY;
+            }
+        }
         break;
 #ifdef CAIRO_FORMAT_RGB30
     case CAIRO_FORMAT_RGB30:
@@ -147,10 +314,6 @@ static cairo_status_t canvas_write_png(cairo_surface_t *surface, png_rw_ptr writ
         png_color_type = PNG_COLOR_TYPE_RGB;
         break;
 #endif
-    case CAIRO_FORMAT_RGB24:
-        bpc = 8;
-        png_color_type = PNG_COLOR_TYPE_RGB;
-        break;
     case CAIRO_FORMAT_A8:
         bpc = 8;
         png_color_type = PNG_COLOR_TYPE_GRAY;
@@ -159,69 +322,88 @@ static cairo_status_t canvas_write_png(cairo_surface_t *surface, png_rw_ptr writ
         bpc = 1;
         png_color_type = PNG_COLOR_TYPE_GRAY;
 #ifndef WORDS_BIGENDIAN
-        png_set_packswap(png);
+        png_set_packswap(enc->png);
 #endif
         break;
     case CAIRO_FORMAT_INVALID:
     case CAIRO_FORMAT_RGB16_565:
     default:
-        status = CAIRO_STATUS_INVALID_FORMAT;
-        png_destroy_write_struct(&png, &info);
-        free(rows);
-        return status;
+        canvas_png_encoder_destroy(enc);
+        return enc->status = CAIRO_STATUS_INVALID_FORMAT;
     }
 
-    png_set_IHDR(png, info, width, height, bpc, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_IHDR(enc->png, enc->info, enc->width, enc->height, bpc, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
     white.gray = (1 << bpc) - 1;
     white.red = white.blue = white.green = white.gray;
-    png_set_bKGD(png, info, &white);
+    png_set_bKGD(enc->png, enc->info, &white);
 
     /* We have to call png_write_info() before setting up the write
      * transformation, since it stores data internally in 'png'
      * that is needed for the write transformation functions to work.
      */
-    png_write_info(png, info);
+    png_write_info(enc->png, enc->info);
     if (png_color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
-        png_set_write_user_transform_fn(png, canvas_unpremultiply_data);
+        png_set_write_user_transform_fn(enc->png, canvas_unpremultiply_data);
     } else if (png_color_type == PNG_COLOR_TYPE_RGB) {
-        png_set_write_user_transform_fn(png, canvas_convert_data_to_bytes);
-        png_set_filler(png, 0, PNG_FILLER_AFTER);
+        png_set_write_user_transform_fn(enc->png, canvas_convert_data_to_bytes);
+        png_set_filler(enc->png, 0, PNG_FILLER_AFTER);
     }
 
-    png_write_image(png, rows);
-    png_write_end(png, info);
-
-    png_destroy_write_struct(&png, &info);
-    free(rows);
-    return status;
+    return enc->status;
 }
 
-static void canvas_stream_write_func(png_structp png, png_bytep data, png_size_t size) {
-    cairo_status_t status;
-    struct canvas_png_write_closure_t *png_closure;
+/*
+ * Encode up to `count` more rows, finishing the image once the last
+ * row has been written. The encoder is destroyed on completion or error.
+ */
 
-    png_closure = (struct canvas_png_write_closure_t *) png_get_io_ptr(png);
-    status = png_closure->write_func(png_closure->closure, data, size);
-    if (unlikely(status)) {
-        cairo_status_t *error = (cairo_status_t *) png_get_error_ptr(png);
-        if (*error == CAIRO_STATUS_SUCCESS) {
-            *error = status;
-        }
-        png_error(png, NULL);
+static cairo_status_t canvas_png_encoder_write_rows(canvas_png_encoder_t *enc, unsigned int count) {
+    uint8_t *data = cairo_image_surface_get_data(enc->surface);
+    int stride = cairo_image_surface_get_stride(enc->surface);
+    unsigned int end;
+
+    if (enc->status || !enc->png) return enc->status;
+
+#ifdef PNG_SETJMP_SUPPORTED
+    if (setjmp(png_jmpbuf(enc->png))) {
+        canvas_png_encoder_destroy(enc);
+        if (!enc->status) enc->status = CAIRO_STATUS_WRITE_ERROR;
+        return enc->status;
     }
-}
+#endif
 
-static cairo_status_t canvas_write_to_png_stream(cairo_surface_t *surface, cairo_write_func_t write_func, void *closure) {
-    struct canvas_png_write_closure_t png_closure;
+    end = enc->row + count;
+    if (end > enc->height) end = enc->height;
+
+    for (; enc->row < end; enc->row++) {
+        png_bytep row = (png_bytep) data + enc->row * stride;
+        if (enc->quantizer) {
+            palette_quantizer_map_row(enc->quantizer, row, enc->row_buf);
+            row = enc->row_buf;
+        } else if (enc->row_buf) {
+            canvas_png_pack_row(&enc->format, row, enc->row_buf, enc->width);
+            row = enc->row_buf;
+        }
+        png_write_row(enc->png, row);
+    }
 
-    if (cairo_surface_status(surface)) {
-        return cairo_surface_status(surface);
+    if (enc->row == enc->height) {
+        png_write_end(enc->png, enc->info);
+        canvas_png_encoder_destroy(enc);
     }
 
-    png_closure.write_func = write_func;
-    png_closure.closure = closure;
+    return enc->status;
+}
+
+static inline bool canvas_png_encoder_done(canvas_png_encoder_t *enc) {
+    return enc->status || !enc->png;
+}
 
-    return canvas_write_png(surface, canvas_stream_write_func, &png_closure);
+static inline cairo_status_t canvas_write_to_png_stream(cairo_surface_t *surface, cairo_write_func_t write_func, void *closure) {
+    canvas_png_encoder_t enc;
+    cairo_status_t status = canvas_png_encoder_begin(&enc, surface, write_func, closure);
+    if (status) return status;
+    return canvas_png_encoder_write_rows(&enc, enc.height);
 }
 #endif
@@ -0,0 +1,314 @@
+#ifndef _CANVAS_PNG_OPTIMIZE_H
+#define _CANVAS_PNG_OPTIMIZE_H
+#include <math.h>
+#include "PNGParallel.h"
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+/*
+ * Size optimizing PNG encoder for ARGB32 and RGB24 surfaces, for images
+ * encoded once and served many times. The image is filtered with each
+ * per-row filter heuristic in turn and deflated at level 9 with each
+ * zlib strategy, the smallest stream being kept; trials run on up to
+ * `threads` threads, the calling one and those of the encode lane that
+ * are free. When built with libdeflate, the winning filtering
+ * is then recompressed at libdeflate's level 12 and kept if smaller.
+ * The regular encoder's output at level 9 is the last candidate, so
+ * the result is never larger. Indexed output and other surface formats
+ * only go through the regular encoder.
+ */
+
+/*
+ * Per-row filter heuristics: one of the five filters for every row,
+ * libpng's minimum sum of absolute differences, or the filter whose
+ * output has the least Shannon entropy.
+ */
+
+#define CANVAS_PNG_HEURISTIC_MINSUM 5
+#define CANVAS_PNG_HEURISTIC_ENTROPY 6
+#define CANVAS_PNG_HEURISTIC_COUNT 7
+
+#define CANVAS_PNG_IDAT_BYTES 0x7fffffff
+
+static const int canvas_png_zlib_strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+#define CANVAS_PNG_STRATEGY_COUNT (sizeof(canvas_png_zlib_strategies) / sizeof(int))
+
+typedef struct {
+    cairo_surface_t *surface;
+    unsigned int width;
+    unsigned int height;
+    canvas_png_format_t format;
+    size_t rowbytes;
+    int bpp;
+    uv_mutex_t lock;
+    unsigned int next_trial;
+    cairo_status_t status;
+    canvas_png_strip_t best;
+    unsigned int best_trial;
+} canvas_png_optimize_t;
+
+/* Entropy of `len` bytes, in bits, up to a constant shared by all rows. */
+static double canvas_png_entropy_cost(const uint8_t *data, size_t len) {
+    uint32_t counts[256];
+    double cost = 0;
+
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < len; i++) counts[data[i]]++;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i]) cost -= counts[i] * log2((double) counts[i]);
+    }
+    return cost;
+}
+
+/*
+ * Filter `row` into `out` (filter type byte followed by the filtered
+ * row) as `heuristic` chooses. `scratch` must hold `rowbytes` bytes.
+ */
+
+static void canvas_png_heuristic_filter(int heuristic, const uint8_t *row, const uint8_t *prev, size_t rowbytes, int bpp, uint8_t *out, uint8_t *scratch) {
+    if (heuristic < CANVAS_PNG_HEURISTIC_MINSUM) {
+        out[0] = heuristic;
+        canvas_png_filter_row(heuristic, row, prev, rowbytes, bpp, out + 1);
+    } else if (heuristic == CANVAS_PNG_HEURISTIC_MINSUM) {
+        canvas_png_select_filter(PNG_ALL_FILTERS, row, prev, rowbytes, bpp, out, scratch);
+    } else {
+        double best = HUGE_VAL;
+        for (int type = 0; type < 5; type++) {
+            canvas_png_filter_row(type, row, prev, rowbytes, bpp, scratch);
+            double cost = canvas_png_entropy_cost(scratch, rowbytes);
+            if (cost < best) {
+                best = cost;
+                out[0] = type;
+                memcpy(out + 1, scratch, rowbytes);
+            }
+        }
+    }
+}
+
+/*
+ * Filter every row with `heuristic`, handing each filtered row to `fn`
+ * until it fails.
+ */
+
+template <typename F>
+static cairo_status_t canvas_png_each_filtered_row(canvas_png_optimize_t *opt, int heuristic, F fn) {
+    uint8_t *data = cairo_image_surface_get_data(opt->surface);
+    int stride = cairo_image_surface_get_stride(opt->surface);
+    uint8_t *prev = (uint8_t *) calloc(opt->width, 4);
+    uint8_t *cur = (uint8_t *) malloc((size_t) opt->width * 4);
+    uint8_t *scratch = (uint8_t *) malloc(opt->rowbytes);
+    uint8_t *filtered = (uint8_t *) malloc(opt->rowbytes + 1);
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+
+    if (!prev || !cur || !scratch || !filtered) status = CAIRO_STATUS_NO_MEMORY;
+
+    for (unsigned int y = 0; y < opt->height && !status; y++) {
+        canvas_png_pack_row(&opt->format, data + y * stride, cur, opt->width);
+        canvas_png_heuristic_filter(heuristic, cur, prev, opt->rowbytes, opt->bpp, filtered, scratch);
+        uint8_t *tmp = prev; prev = cur; cur = tmp;
+        status = fn(filtered, y + 1 == opt->height);
+    }
+
+    free(prev);
+    free(cur);
+    free(scratch);
+    free(filtered);
+    return status;
+}
+
+struct canvas_png_deflate_row {
+    z_stream *zs;
+    canvas_png_strip_t *out;
+    size_t len;
+    cairo_status_t operator()(uint8_t *filtered, bool last) const {
+        int flush = last ? Z_FINISH : Z_NO_FLUSH;
+        int ret;
+        zs->next_in = filtered;
+        zs->avail_in = len;
+        do {
+            if (!canvas_png_strip_reserve(out, zs)) return CAIRO_STATUS_NO_MEMORY;
+            ret = deflate(zs, flush);
+            if (ret == Z_STREAM_ERROR) return CAIRO_STATUS_WRITE_ERROR;
+        } while (zs->avail_in || (last && ret != Z_STREAM_END));
+        return CAIRO_STATUS_SUCCESS;
+    }
+};
+
+/*
+ * Deflate the image filtered with `heuristic` into `out` as a complete
+ * zlib stream, using `strategy`.
+ */
+
+static cairo_status_t canvas_png_optimize_trial(canvas_png_optimize_t *opt, int heuristic, int strategy, canvas_png_strip_t *out) {
+    z_stream zs;
+
+    out->max_len = opt->rowbytes + 1024;
+    out->data = (uint8_t *) malloc(out->max_len);
+    out->len = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if (!out->data || deflateInit2(&zs, 9, Z_DEFLATED, 15, 9, strategy) != Z_OK) {
+        free(out->data);
+        out->data = NULL;
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    zs.next_out = out->data;
+    zs.avail_out = out->max_len;
+
+    canvas_png_deflate_row fn = { &zs, out, opt->rowbytes + 1 };
+    cairo_status_t status = canvas_png_each_filtered_row(opt, heuristic, fn);
+
+    out->len = out->max_len - zs.avail_out;
+    deflateEnd(&zs);
+    return status;
+}
+
+static void canvas_png_optimize_worker(void *arg) {
+    canvas_png_optimize_t *opt = (canvas_png_optimize_t *) arg;
+    unsigned int trials = CANVAS_PNG_HEURISTIC_COUNT * CANVAS_PNG_STRATEGY_COUNT;
+
+    for (;;) {
+        uv_mutex_lock(&opt->lock);
+        unsigned int n = opt->status ? trials : opt->next_trial++;
+        uv_mutex_unlock(&opt->lock);
+        if (n >= trials) return;
+
+        canvas_png_strip_t out;
+        int heuristic = n / CANVAS_PNG_STRATEGY_COUNT;
+        cairo_status_t status = canvas_png_optimize_trial(opt, heuristic, canvas_png_zlib_strategies[n % CANVAS_PNG_STRATEGY_COUNT], &out);
+
+        // Keep the smallest stream, ties going to the earlier trial so
+        // that the output does not depend on the thread count
+        uv_mutex_lock(&opt->lock);
+        if (status) {
+            if (!opt->status) opt->status = status;
+        } else if (!opt->best.data || out.len < opt->best.len ||
+                   (out.len == opt->best.len && n < opt->best_trial)) {
+            canvas_png_strip_t tmp = opt->best;
+            opt->best = out;
+            opt->best_trial = n;
+            out = tmp;
+        }
+        uv_mutex_unlock(&opt->lock);
+        free(out.data);
+    }
+}
+
+#ifdef HAVE_LIBDEFLATE
+struct canvas_png_gather_row {
+    uint8_t *out;
+    size_t len;
+    cairo_status_t operator()(uint8_t *filtered, bool last) {
+        memcpy(out, filtered, len);
+        out += len;
+        return CAIRO_STATUS_SUCCESS;
+    }
+};
+
+/*
+ * Recompress the winning filtering with libdeflate, replacing the best
+ * stream if that is smaller. Running out of memory here just keeps the
+ * zlib stream.
+ */
+
+static void canvas_png_optimize_libdeflate(canvas_png_optimize_t *opt) {
+    size_t raw_len = opt->height * (opt->rowbytes + 1);
+    uint8_t *raw = (uint8_t *) malloc(raw_len);
+    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(12);
+    if (!raw || !compressor) {
+        free(raw);
+        if (compressor) libdeflate_free_compressor(compressor);
+        return;
+    }
+
+    canvas_png_gather_row fn = { raw, opt->rowbytes + 1 };
+    if (!canvas_png_each_filtered_row(opt, opt->best_trial / CANVAS_PNG_STRATEGY_COUNT, fn)) {
+        size_t max_len = libdeflate_zlib_compress_bound(compressor, raw_len);
+        uint8_t *data = (uint8_t *) malloc(max_len);
+        size_t len = data ? libdeflate_zlib_compress(compressor, raw, raw_len, data, max_len) : 0;
+        if (len && len < opt->best.len) {
+            free(opt->best.data);
+            opt->best.data = data;
+            opt->best.len = len;
+            opt->best.max_len = max_len;
+        } else {
+            free(data);
+        }
+    }
+
+    libdeflate_free_compressor(compressor);
+    free(raw);
+}
+#endif
+
+static cairo_status_t canvas_write_to_png_stream_optimized(cairo_surface_t *surface, cairo_write_func_t write_func, void *closure, unsigned int threads) {
+    closure_t *c = (closure_t *) closure;
+    canvas_png_optimize_t opt;
+    cairo_status_t status;
+
+    if (cairo_surface_status(surface)) return cairo_surface_status(surface);
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (c->palette.max_colors || (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return canvas_write_to_png_stream(surface, write_func, closure);
+    }
+
+    if (cairo_image_surface_get_data(surface) == NULL) return CAIRO_STATUS_SURFACE_TYPE_MISMATCH;
+    cairo_surface_flush(surface);
+
+    opt.surface = surface;
+    opt.width = cairo_image_surface_get_width(surface);
+    opt.height = cairo_image_surface_get_height(surface);
+    if (opt.width == 0 || opt.height == 0) return CAIRO_STATUS_WRITE_ERROR;
+
+    opt.format = canvas_png_choose_format(surface);
+    opt.rowbytes = canvas_png_format_rowbytes(&opt.format, opt.width);
+    opt.bpp = canvas_png_format_bpp(&opt.format);
+    opt.next_trial = 0;
+    opt.status = CAIRO_STATUS_SUCCESS;
+    opt.best.data = NULL;
+    opt.best.len = 0;
+    opt.best_trial = 0;
+    if (threads < 1) threads = 1;
+    if (threads > CANVAS_PNG_HEURISTIC_COUNT * CANVAS_PNG_STRATEGY_COUNT)
+        threads = CANVAS_PNG_HEURISTIC_COUNT * CANVAS_PNG_STRATEGY_COUNT;
+    if (uv_mutex_init(&opt.lock)) return CAIRO_STATUS_NO_MEMORY;
+
+    // The calling thread runs trials too, helped by encode threads
+    work_pool_share(WORK_LANE_ENCODE, threads - 1, canvas_png_optimize_worker, &opt);
+    uv_mutex_destroy(&opt.lock);
+
+    status = opt.status;
+
+#ifdef HAVE_LIBDEFLATE
+    if (!status) canvas_png_optimize_libdeflate(&opt);
+#endif
+
+    // libpng's own choices at level 9, with its header the same as ours
+    closure_t regular = *c;
+    regular.compression_level = 9;
+    regular.filter = PNG_ALL_FILTERS;
+    regular.len = 0;
+    regular.data = (uint8_t *) malloc(regular.max_len = PAGE_SIZE);
+    if (!status && !regular.data) status = CAIRO_STATUS_NO_MEMORY;
+    if (!status) status = canvas_write_to_png_stream(surface, closure_write, &regular);
+
+    size_t idats = (opt.best.len + CANVAS_PNG_IDAT_BYTES - 1) / CANVAS_PNG_IDAT_BYTES;
+    size_t header_len = 8 + 12 + 13 + 12 + (opt.format.color_type & PNG_COLOR_MASK_COLOR ? 6 : 2);
+    if (!status && regular.len <= header_len + opt.best.len + idats * 12 + 12) {
+        status = write_func(closure, regular.data, regular.len);
+    } else if (!status) {
+        status = canvas_png_write_header(write_func, closure, opt.width, opt.height, &opt.format);
+        for (size_t off = 0; off < opt.best.len && !status; off += CANVAS_PNG_IDAT_BYTES) {
+            size_t len = opt.best.len - off < CANVAS_PNG_IDAT_BYTES ? opt.best.len - off : CANVAS_PNG_IDAT_BYTES;
+            status = canvas_png_write_chunk(write_func, closure, "IDAT", opt.best.data + off, len);
+        }
+        if (!status) status = canvas_png_write_chunk(write_func, closure, "IEND", NULL, 0);
+    }
+
+    free(regular.data);
+    free(opt.best.data);
+    return status;
+}
+
+#endif
@@ -0,0 +1,435 @@
+#ifndef _CANVAS_PNG_PARALLEL_H
+#define _CANVAS_PNG_PARALLEL_H
+#include <uv.h>
+#include <zlib.h>
+#include "PNG.h"
+#include "work_pool.h"
+
+/*
+ * Parallel PNG encoder for ARGB32 and RGB24 surfaces, writing the same
+ * format as the libpng encoder would.
+ *
+ * The image is cut into horizontal strips that are filtered and deflated
+ * independently on several threads of the encode lane, pigz style. Every
+ * strip but the last ends on a sync flush, so the raw deflate streams are
+ * byte aligned and can be concatenated behind a single zlib header; the
+ * per-strip adler32 sums are combined for the trailer. Each strip is
+ * primed with the last 32K of the filtered data before it, so very little
+ * is lost at the seams.
+ */
+
+#define CANVAS_PNG_STRIP_BYTES (512 * 1024)
+#define CANVAS_PNG_DICT_BYTES 32768
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t max_len;
+    uLong adler;
+    uLong raw_len;
+} canvas_png_strip_t;
+
+typedef struct {
+    cairo_surface_t *surface;
+    unsigned int width;
+    unsigned int height;
+    canvas_png_format_t format;
+    size_t rowbytes;
+    int bpp;
+    int level;
+    int strategy;
+    unsigned int filter;
+    unsigned int rows_per_strip;
+    unsigned int nstrips;
+    canvas_png_strip_t *strips;
+    uv_mutex_t lock;
+    unsigned int next_strip;
+    cairo_status_t status;
+} canvas_png_parallel_t;
+
+static inline int canvas_png_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/*
+ * Apply PNG filter `type` (0-4) to `row` given the previous row `prev`
+ * (all zeros for the first row), writing `rowbytes` bytes to `out`.
+ * Returns the sum of the absolute values of the filtered bytes, the
+ * heuristic libpng uses to pick a filter per row.
+ */
+
+static unsigned long canvas_png_filter_row(int type, const uint8_t *row, const uint8_t *prev, size_t rowbytes, int bpp, uint8_t *out) {
+    unsigned long sum = 0;
+    size_t i;
+
+    for (i = 0; i < rowbytes; i++) {
+        int a = i >= (size_t) bpp ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= (size_t) bpp ? prev[i - bpp] : 0;
+        uint8_t v;
+
+        switch (type) {
+        case 1: v = row[i] - a; break;
+        case 2: v = row[i] - b; break;
+        case 3: v = row[i] - ((a + b) >> 1); break;
+        case 4: v = row[i] - canvas_png_paeth(a, b, c); break;
+        default: v = row[i]; break;
+        }
+
+        out[i] = v;
+        sum += v < 128 ? v : 256 - v;
+    }
+
+    return sum;
+}
+
+/*
+ * Filter `row` into `out` (filter type byte followed by the filtered row),
+ * choosing among the PNG_FILTER_* flags in `mask`. `scratch` must hold
+ * `rowbytes` bytes.
+ */
+
+static void canvas_png_select_filter(unsigned int mask, const uint8_t *row, const uint8_t *prev, size_t rowbytes, int bpp, uint8_t *out, uint8_t *scratch) {
+    static const unsigned int flags[5] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+    unsigned long best = (unsigned long) -1;
+    int type;
+
+    for (type = 0; type < 5; type++) {
+        if (!(mask & flags[type])) continue;
+        if (mask == flags[type]) {
+            out[0] = type;
+            canvas_png_filter_row(type, row, prev, rowbytes, bpp, out + 1);
+            return;
+        }
+
+        unsigned long sum = canvas_png_filter_row(type, row, prev, rowbytes, bpp, scratch);
+        if (sum < best) {
+            best = sum;
+            out[0] = type;
+            memcpy(out + 1, scratch, rowbytes);
+        }
+    }
+}
+
+/*
+ * The PNG_FILTER_* flags libpng filters with for the `filters` given to
+ * png_set_filter() before the header is written, as canvas_png_encoder
+ * does: only the flags in its low byte count, no flag leaves the
+ * default, which is all filters from 8 bits per sample up, and filters
+ * needing a row above or a pixel to the left are dropped for a single
+ * row or column. Returns 0 for the values 5 to 7 libpng rejects.
+ */
+
+static unsigned int canvas_png_filter_mask(unsigned int filters, unsigned int width, unsigned int height, int bit_depth) {
+    unsigned int mask = filters & 0xff;
+    if (mask >= 5 && mask <= 7) return 0;
+    if (!mask) mask = bit_depth < 8 ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+    mask &= PNG_ALL_FILTERS;
+    if (height == 1) mask &= ~(PNG_FILTER_UP | PNG_FILTER_AVG | PNG_FILTER_PAETH);
+    if (width == 1) mask &= ~(PNG_FILTER_SUB | PNG_FILTER_AVG | PNG_FILTER_PAETH);
+    return mask ? mask : PNG_FILTER_NONE;
+}
+
+/* Load surface row `y` in the output format; `out` holds width * 4 bytes. */
+static void canvas_png_load_row(canvas_png_parallel_t *enc, unsigned int y, uint8_t *out) {
+    uint8_t *data = cairo_image_surface_get_data(enc->surface);
+    int stride = cairo_image_surface_get_stride(enc->surface);
+    canvas_png_pack_row(&enc->format, data + y * stride, out, enc->width);
+}
+
+static bool canvas_png_strip_reserve(canvas_png_strip_t *strip, z_stream *zs) {
+    if (zs->avail_out) return true;
+    size_t max = strip->max_len * 2;
+    uint8_t *data = (uint8_t *) realloc(strip->data, max);
+    if (!data) return false;
+    strip->len = strip->max_len;
+    strip->data = data;
+    strip->max_len = max;
+    zs->next_out = data + strip->len;
+    zs->avail_out = max - strip->len;
+    return true;
+}
+
+/*
+ * Filter and deflate strip `n` into enc->strips[n].
+ */
+
+static cairo_status_t canvas_png_encode_strip(canvas_png_parallel_t *enc, unsigned int n) {
+    canvas_png_strip_t *strip = &enc->strips[n];
+    size_t rowbytes = enc->rowbytes;
+    unsigned int first = n * enc->rows_per_strip;
+    unsigned int last = first + enc->rows_per_strip;
+    bool final = n == enc->nstrips - 1;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    unsigned int dict_rows = 0, y;
+    z_stream zs;
+    int flush, ret;
+
+    if (last > enc->height) last = enc->height;
+
+    // Rows preceding the strip are re-filtered to build the dictionary
+    if (first > 0) {
+        dict_rows = (CANVAS_PNG_DICT_BYTES + rowbytes) / (rowbytes + 1);
+        if (dict_rows > first) dict_rows = first;
+    }
+
+    uint8_t *prev = (uint8_t *) calloc(enc->width, 4);
+    uint8_t *cur = (uint8_t *) malloc((size_t) enc->width * 4);
+    uint8_t *scratch = (uint8_t *) malloc(rowbytes);
+    uint8_t *dict = (uint8_t *) malloc(dict_rows * (rowbytes + 1) + 1);
+
+    strip->max_len = rowbytes + 1024;
+    strip->data = (uint8_t *) malloc(strip->max_len);
+    strip->len = 0;
+    strip->adler = adler32(0L, Z_NULL, 0);
+    strip->raw_len = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if (!prev || !cur || !scratch || !dict || !strip->data ||
+        deflateInit2(&zs, enc->level, Z_DEFLATED, -15, 8, enc->strategy) != Z_OK) {
+        free(prev);
+        free(cur);
+        free(scratch);
+        free(dict);
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+
+    y = first - dict_rows;
+    if (y > 0) canvas_png_load_row(enc, y - 1, prev);
+
+    for (; y < first; y++) {
+        uint8_t *out = dict + (y - (first - dict_rows)) * (rowbytes + 1);
+        canvas_png_load_row(enc, y, cur);
+        canvas_png_select_filter(enc->filter, cur, prev, rowbytes, enc->bpp, out, scratch);
+        uint8_t *tmp = prev; prev = cur; cur = tmp;
+    }
+
+    if (dict_rows) {
+        size_t dict_len = dict_rows * (rowbytes + 1);
+        size_t offset = dict_len > CANVAS_PNG_DICT_BYTES ? dict_len - CANVAS_PNG_DICT_BYTES : 0;
+        deflateSetDictionary(&zs, dict + offset, dict_len - offset);
+    }
+
+    zs.next_out = strip->data;
+    zs.avail_out = strip->max_len;
+
+    // The dictionary buffer doubles as the filtered row buffer
+    uint8_t *filtered = (uint8_t *) realloc(dict, rowbytes + 1);
+    if (filtered) dict = filtered;
+    else filtered = dict;
+
+    for (y = first; y < last && !status; y++) {
+        canvas_png_load_row(enc, y, cur);
+        canvas_png_select_filter(enc->filter, cur, prev, rowbytes, enc->bpp, filtered, scratch);
+        uint8_t *tmp = prev; prev = cur; cur = tmp;
+
+        strip->adler = adler32(strip->adler, filtered, rowbytes + 1);
+        strip->raw_len += rowbytes + 1;
+
+        zs.next_in = filtered;
+        zs.avail_in = rowbytes + 1;
+        flush = y + 1 < last ? Z_NO_FLUSH : final ? Z_FINISH : Z_SYNC_FLUSH;
+
+        do {
+            if (!canvas_png_strip_reserve(strip, &zs)) {
+                status = CAIRO_STATUS_NO_MEMORY;
+                break;
+            }
+            ret = deflate(&zs, flush);
+            if (ret == Z_STREAM_ERROR) {
+                status = CAIRO_STATUS_WRITE_ERROR;
+                break;
+            }
+        } while (zs.avail_in || (flush != Z_NO_FLUSH && zs.avail_out == 0) ||
+                 (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+
+    strip->len = strip->max_len - zs.avail_out;
+    deflateEnd(&zs);
+    free(prev);
+    free(cur);
+    free(scratch);
+    free(dict);
+    return status;
+}
+
+static void canvas_png_parallel_worker(void *arg) {
+    canvas_png_parallel_t *enc = (canvas_png_parallel_t *) arg;
+
+    for (;;) {
+        uv_mutex_lock(&enc->lock);
+        unsigned int n = enc->status ? enc->nstrips : enc->next_strip++;
+        uv_mutex_unlock(&enc->lock);
+        if (n >= enc->nstrips) return;
+
+        cairo_status_t status = canvas_png_encode_strip(enc, n);
+        if (status) {
+            uv_mutex_lock(&enc->lock);
+            if (!enc->status) enc->status = status;
+            uv_mutex_unlock(&enc->lock);
+        }
+    }
+}
+
+/*
+ * Chunk writing helpers; `crc` accumulates over the chunk type and data.
+ */
+
+static cairo_status_t canvas_png_chunk_begin(cairo_write_func_t write_func, void *closure, const char *type, uint32_t len, uLong *crc) {
+    uint8_t head[8] = {
+        (uint8_t) (len >> 24), (uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len,
+        (uint8_t) type[0], (uint8_t) type[1], (uint8_t) type[2], (uint8_t) type[3]
+    };
+    *crc = crc32(crc32(0L, Z_NULL, 0), head + 4, 4);
+    return write_func(closure, head, 8);
+}
+
+static cairo_status_t canvas_png_chunk_data(cairo_write_func_t write_func, void *closure, const uint8_t *data, size_t len, uLong *crc) {
+    if (!len) return CAIRO_STATUS_SUCCESS;
+    *crc = crc32(*crc, data, len);
+    return write_func(closure, data, len);
+}
+
+static cairo_status_t canvas_png_chunk_end(cairo_write_func_t write_func, void *closure, uLong crc) {
+    uint8_t tail[4] = {
+        (uint8_t) (crc >> 24), (uint8_t) (crc >> 16), (uint8_t) (crc >> 8), (uint8_t) crc
+    };
+    return write_func(closure, tail, 4);
+}
+
+static cairo_status_t canvas_png_write_chunk(cairo_write_func_t write_func, void *closure, const char *type, const uint8_t *data, uint32_t len) {
+    uLong crc;
+    cairo_status_t status = canvas_png_chunk_begin(write_func, closure, type, len, &crc);
+    if (!status) status = canvas_png_chunk_data(write_func, closure, data, len, &crc);
+    if (!status) status = canvas_png_chunk_end(write_func, closure, crc);
+    return status;
+}
+
+/*
+ * Write the PNG signature, IHDR and bKGD chunks for an image in
+ * `format`, white being the background as with libpng.
+ */
+
+static cairo_status_t canvas_png_write_header(cairo_write_func_t write_func, void *closure, unsigned int width, unsigned int height, const canvas_png_format_t *format) {
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    static const uint8_t bkgd_rgb[6] = { 0, 255, 0, 255, 0, 255 };
+    uint8_t bkgd_gray[2] = { 0, (uint8_t) ((1 << format->bit_depth) - 1) };
+    uint8_t ihdr[13] = {
+        (uint8_t) (width >> 24), (uint8_t) (width >> 16), (uint8_t) (width >> 8), (uint8_t) width,
+        (uint8_t) (height >> 24), (uint8_t) (height >> 16), (uint8_t) (height >> 8), (uint8_t) height,
+        (uint8_t) format->bit_depth, (uint8_t) format->color_type, 0, 0, 0
+    };
+    bool gray = !(format->color_type & PNG_COLOR_MASK_COLOR);
+
+    cairo_status_t status = write_func(closure, signature, 8);
+    if (!status) status = canvas_png_write_chunk(write_func, closure, "IHDR", ihdr, 13);
+    if (!status) status = canvas_png_write_chunk(write_func, closure, "bKGD", gray ? bkgd_gray : bkgd_rgb, gray ? 2 : 6);
+    return status;
+}
+
+/* Two byte zlib header matching what zlib itself writes for `level`. */
+static void canvas_png_zlib_header(int level, uint8_t header[2]) {
+    int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    header[0] = 0x78;
+    header[1] = flevel << 6;
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+}
+
+/*
+ * Encode `surface` using up to `threads` threads, the calling one and
+ * those of the encode lane that are free, writing through `write_func`.
+ * Only ARGB32 and RGB24 surfaces are parallelized; anything else, indexed
+ * output included, goes through the regular libpng encoder.
+ */
+
+static cairo_status_t canvas_write_to_png_stream_parallel(cairo_surface_t *surface, cairo_write_func_t write_func, void *closure, unsigned int threads) {
+    closure_t *c = (closure_t *) closure;
+    canvas_png_parallel_t enc;
+    cairo_status_t status;
+    unsigned int i;
+
+    if (cairo_surface_status(surface)) return cairo_surface_status(surface);
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (threads < 2 || c->palette.max_colors || (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return canvas_write_to_png_stream(surface, write_func, closure);
+    }
+
+    if (cairo_image_surface_get_data(surface) == NULL) return CAIRO_STATUS_SURFACE_TYPE_MISMATCH;
+    cairo_surface_flush(surface);
+
+    enc.surface = surface;
+    enc.width = cairo_image_surface_get_width(surface);
+    enc.height = cairo_image_surface_get_height(surface);
+    if (enc.width == 0 || enc.height == 0) return CAIRO_STATUS_WRITE_ERROR;
+
+    enc.format = canvas_png_choose_format(surface);
+    // Filters libpng rejects fail the same way there
+    enc.filter = canvas_png_filter_mask(c->filter, enc.width, enc.height, enc.format.bit_depth);
+    if (!enc.filter) return canvas_write_to_png_stream(surface, write_func, closure);
+
+    enc.rowbytes = canvas_png_format_rowbytes(&enc.format, enc.width);
+    enc.bpp = canvas_png_format_bpp(&enc.format);
+    enc.level = c->compression_level;
+    enc.strategy = enc.filter == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    enc.rows_per_strip = CANVAS_PNG_STRIP_BYTES / (enc.rowbytes + 1);
+    if (enc.rows_per_strip < 1) enc.rows_per_strip = 1;
+    enc.nstrips = (enc.height + enc.rows_per_strip - 1) / enc.rows_per_strip;
+    enc.next_strip = 0;
+    enc.status = CAIRO_STATUS_SUCCESS;
+    if (threads > enc.nstrips) threads = enc.nstrips;
+
+    enc.strips = (canvas_png_strip_t *) calloc(enc.nstrips, sizeof(canvas_png_strip_t));
+    if (!enc.strips) return CAIRO_STATUS_NO_MEMORY;
+    if (uv_mutex_init(&enc.lock)) {
+        free(enc.strips);
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+
+    // The calling thread encodes strips too, helped by encode threads
+    work_pool_share(WORK_LANE_ENCODE, threads - 1, canvas_png_parallel_worker, &enc);
+    uv_mutex_destroy(&enc.lock);
+
+    status = enc.status;
+
+    // Stitch the strips into one zlib stream split across IDAT chunks
+    if (!status) status = canvas_png_write_header(write_func, closure, enc.width, enc.height, &enc.format);
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (i = 0; i < enc.nstrips && !status; i++) {
+        canvas_png_strip_t *strip = &enc.strips[i];
+        bool first = i == 0;
+        bool last = i == enc.nstrips - 1;
+        uint8_t header[2];
+        uint8_t trailer[4];
+        uLong crc;
+
+        adler = adler32_combine(adler, strip->adler, strip->raw_len);
+        canvas_png_zlib_header(enc.level, header);
+        trailer[0] = adler >> 24;
+        trailer[1] = adler >> 16;
+        trailer[2] = adler >> 8;
+        trailer[3] = adler;
+
+        status = canvas_png_chunk_begin(write_func, closure, "IDAT", strip->len + (first ? 2 : 0) + (last ? 4 : 0), &crc);
+        if (!status && first) status = canvas_png_chunk_data(write_func, closure, header, 2, &crc);
+        if (!status) status = canvas_png_chunk_data(write_func, closure, strip->data, strip->len, &crc);
+        if (!status && last) status = canvas_png_chunk_data(write_func, closure, trailer, 4, &crc);
+        if (!status) status = canvas_png_chunk_end(write_func, closure, crc);
+    }
+
+    if (!status) status = canvas_png_write_chunk(write_func, closure, "IEND", NULL, 0);
+
+    for (i = 0; i < enc.nstrips; i++) free(enc.strips[i].data);
+    free(enc.strips);
+    return status;
+}
+
+#endif
@@ -0,0 +1,108 @@
+//
+// WebP.h
+//
+
+#ifndef __NODE_WEBP_H__
+#define __NODE_WEBP_H__
+
+#include "Canvas.h"
+#include "pixel_convert.h"
+#include <webp/encode.h>
+
+/*
+ * Reset `opts` to the encoder defaults.
+ */
+
+inline void
+webp_options_init(webp_options_t *opts){
+  opts->quality = 75;
+  opts->lossless = false;
+  opts->method = 4;
+}
+
+/*
+ * WebPPicture writer appending to the closure's buffer.
+ */
+
+static int
+webp_closure_writer(const uint8_t *data, size_t len, const WebPPicture *picture){
+  closure_t *closure = (closure_t *) picture->custom_ptr;
+
+  if (closure->len + len > closure->max_len) {
+    unsigned max = closure->max_len;
+    do {
+      max *= 2;
+    } while (closure->len + len > max);
+
+    uint8_t *buf = (uint8_t *) realloc(closure->data, max);
+    if (!buf) return 0;
+    closure->data = buf;
+    closure->max_len = max;
+  }
+
+  memcpy(closure->data + closure->len, data, len);
+  closure->len += len;
+  return 1;
+}
+
+/*
+ * Encode `surface` into `closure`'s buffer. The surface rows are
+ * unpremultiplied straight into the picture's ARGB plane. Touches no
+ * JS state, so it is safe to call from the thread pool.
+ */
+
+inline cairo_status_t
+write_to_webp_buffer(cairo_surface_t *surface, const webp_options_t *opts, closure_t *closure){
+  WebPConfig config;
+  WebPPicture picture;
+
+  cairo_surface_flush(surface);
+  if (cairo_surface_status(surface)) return cairo_surface_status(surface);
+
+  int w = cairo_image_surface_get_width(surface);
+  int h = cairo_image_surface_get_height(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+
+  if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, opts->quality))
+    return CAIRO_STATUS_WRITE_ERROR;
+  config.lossless = opts->lossless;
+  config.method = opts->method;
+  if (!WebPValidateConfig(&config) || !WebPPictureInit(&picture))
+    return CAIRO_STATUS_WRITE_ERROR;
+
+  picture.use_argb = 1;
+  picture.width = w;
+  picture.height = h;
+  if (!WebPPictureAlloc(&picture)) return CAIRO_STATUS_NO_MEMORY;
+
+  for (int y = 0; y < h; y++) {
+    uint32_t *argb = picture.argb + y * picture.argb_stride;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint8_t *rgba = (uint8_t *) argb;
+    argb32_convert(rgba, data + y * stride, w, PIXEL_FORMAT_RGBA, false);
+    for (int x = 0; x < w; x++, rgba += 4) {
+      argb[x] = (uint32_t) rgba[3] << 24 | rgba[0] << 16 | rgba[1] << 8 | rgba[2];
+    }
+#else
+    // Native ARGB words are B G R A in memory
+    argb32_convert((uint8_t *) argb, data + y * stride, w, PIXEL_FORMAT_BGRA, false);
+#endif
+  }
+
+  picture.writer = webp_closure_writer;
+  picture.custom_ptr = closure;
+
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+  if (!WebPEncode(&config, &picture)) {
+    status = picture.error_code == VP8_ENC_ERROR_OUT_OF_MEMORY
+      || picture.error_code == VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY
+      ? CAIRO_STATUS_NO_MEMORY
+      : CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  WebPPictureFree(&picture);
+  return status;
+}
+
+#endif
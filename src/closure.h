@@ -16,10 +16,46 @@
   #define PAGE_SIZE 4096
 #endif
 
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <nan.h>
 
 /*
- * PNG stream closure.
+ * JPEG encoder settings. `chroma_subsampling` is 444, 422 or 420 and
+ * `dct_method` takes libjpeg's J_DCT_METHOD values.
+ */
+
+typedef struct {
+  uint32_t quality;
+  bool progressive;
+  uint32_t chroma_subsampling;
+  bool optimize_coding;
+  int dct_method;
+  uint32_t restart_interval;
+} jpeg_options_t;
+
+/*
+ * WebP encoder settings. `method` trades speed (0) for size (6).
+ */
+
+typedef struct {
+  float quality;
+  bool lossless;
+  int method;
+} webp_options_t;
+
+/*
+ * PNG palette quantization settings, `max_colors` 0 meaning truecolor.
+ */
+
+typedef struct {
+  uint32_t max_colors;
+  bool dither;
+} palette_options_t;
+
+/*
+ * Encoder closure.
  */
 
 typedef struct {
@@ -29,37 +65,192 @@ typedef struct {
   unsigned max_len;
   uint8_t *data;
   Canvas *canvas;
+  cairo_surface_t *surface;
+  uint32_t generation;
+  canvas_encoding_t encoding;
   cairo_status_t status;
   uint32_t compression_level;
   uint32_t filter;
+  uint32_t threads;
+  jpeg_options_t jpeg;
+  webp_options_t webp;
+  palette_options_t palette;
+  bool max_compression;
 } closure_t;
 
 /*
  * Initialize the given closure.
  */
 
-cairo_status_t
+inline cairo_status_t
 closure_init(closure_t *closure, Canvas *canvas, unsigned int compression_level, unsigned int filter) {
   closure->len = 0;
   closure->canvas = canvas;
+  closure->surface = NULL;
+  closure->generation = canvas->generation();
   closure->data = (uint8_t *) malloc(closure->max_len = PAGE_SIZE);
   if (!closure->data) return CAIRO_STATUS_NO_MEMORY;
   closure->compression_level = compression_level;
   closure->filter = filter;
+  closure->threads = 1;
+  closure->encoding = CANVAS_ENCODING_PNG;
+  closure->palette.max_colors = 0;
+  closure->palette.dither = false;
+  closure->max_compression = false;
   return CAIRO_STATUS_SUCCESS;
 }
 
 /*
- * Free the given closure's data,
- * and hint V8 at the memory dealloc.
+ * Grow the closure's buffer to `size` bytes up front so the encoder
+ * does not realloc its way there. Failing to is not an error, the
+ * buffer just grows as it is written.
  */
 
-void
+inline void
+closure_presize(closure_t *closure, size_t size) {
+  if (size <= closure->max_len || size > UINT_MAX) return;
+  uint8_t *data = (uint8_t *) realloc(closure->data, size);
+  if (!data) return;
+  closure->data = data;
+  closure->max_len = size;
+}
+
+/*
+ * cairo write function appending to the closure's buffer.
+ */
+
+inline cairo_status_t
+closure_write(void *c, const uint8_t *data, unsigned len) {
+  closure_t *closure = (closure_t *) c;
+
+  if (closure->len + len > closure->max_len) {
+    uint8_t *data;
+    unsigned max = closure->max_len;
+
+    do {
+      max *= 2;
+    } while (closure->len + len > max);
+
+    data = (uint8_t *) realloc(closure->data, max);
+    if (!data) return CAIRO_STATUS_NO_MEMORY;
+    closure->data = data;
+    closure->max_len = max;
+  }
+
+  memcpy(closure->data + closure->len, data, len);
+  closure->len += len;
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Encode cache key for the closure's format and encoder settings.
+ * Single threaded PNG output does not depend on the thread count,
+ * and indexed PNG output is always single threaded. Neither does
+ * maxCompression output, whose trials all run to completion.
+ */
+
+inline std::string
+closure_cache_key(const closure_t *closure) {
+  std::string key((const char *) &closure->encoding, sizeof(closure->encoding));
+#define KEY(field) key.append((const char *) &closure->field, sizeof(closure->field))
+  switch (closure->encoding) {
+    case CANVAS_ENCODING_JPEG:
+      KEY(jpeg.quality);
+      KEY(jpeg.progressive);
+      KEY(jpeg.chroma_subsampling);
+      KEY(jpeg.optimize_coding);
+      KEY(jpeg.dct_method);
+      KEY(jpeg.restart_interval);
+      break;
+    case CANVAS_ENCODING_WEBP:
+      KEY(webp.quality);
+      KEY(webp.lossless);
+      KEY(webp.method);
+      break;
+    default: {
+      KEY(compression_level);
+      KEY(filter);
+      KEY(palette.max_colors);
+      KEY(palette.dither);
+      KEY(max_compression);
+      uint32_t threads = closure->threads < 2 || closure->palette.max_colors || closure->max_compression ? 1 : closure->threads;
+      key.append((const char *) &threads, sizeof(threads));
+    }
+  }
+#undef KEY
+  return key;
+}
+
+/*
+ * Fill the closure with the canvas's cached encoding for the same
+ * settings, if there is one. Main thread only.
+ */
+
+inline bool
+closure_cache_fetch(closure_t *closure) {
+  const std::string *cached = closure->canvas->cachedEncoding(closure_cache_key(closure));
+  if (!cached) return false;
+
+  closure_presize(closure, cached->size());
+  if (closure->max_len < cached->size()) return false;
+  memcpy(closure->data, cached->data(), cached->size());
+  closure->len = cached->size();
+  return true;
+}
+
+/*
+ * Cache the closure's output, unless the canvas has been drawn
+ * to since the closure was initialized. Main thread only.
+ */
+
+inline void
+closure_cache_store(closure_t *closure) {
+  if (closure->generation != closure->canvas->generation()) return;
+  closure->canvas->cacheEncoding(closure_cache_key(closure), closure->data, closure->len);
+}
+
+/*
+ * Free the given closure's data. V8 only hears of the data once it is
+ * handed to a Buffer, so there is nothing to take back here.
+ */
+
+inline void
 closure_destroy(closure_t *closure) {
-  if (closure->len) {
-    free(closure->data);
-    Nan::AdjustExternalMemory(-((intptr_t) closure->max_len));
+  free(closure->data);
+  closure->data = NULL;
+}
+
+/*
+ * Free callback for Buffers created by closure_to_buffer(). The data
+ * is released by the allocator that produced it rather than Node's.
+ * `hint`, when set, is the size reported to V8 for the Buffer.
+ */
+
+inline void
+closure_buffer_free(char *data, void *hint) {
+  free(data);
+  if (hint) Nan::AdjustExternalMemory(-((intptr_t) hint));
+}
+
+/*
+ * Hand the closure's data over to a new Buffer without copying it,
+ * shrinking the allocation to fit first, and hint V8 at the memory
+ * the Buffer holds until it is collected. The closure no longer owns
+ * the data afterwards.
+ */
+
+inline Local<Object>
+closure_to_buffer(closure_t *closure) {
+  uint8_t *data = closure->data;
+  if (closure->len < closure->max_len) {
+    uint8_t *shrunk = (uint8_t *) realloc(data, closure->len ? closure->len : 1);
+    if (shrunk) data = shrunk;
   }
+  closure->data = NULL;
+  closure->max_len = closure->len;
+  Nan::AdjustExternalMemory(closure->len);
+  return Nan::NewBuffer((char *) data, closure->len, closure_buffer_free, (void *) (intptr_t) closure->len).ToLocalChecked();
 }
 
 #endif /* __NODE_CLOSURE_H__ */
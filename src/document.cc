@@ -0,0 +1,283 @@
+//
+// document.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "document.h"
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+void
+document_init(document_t *doc, size_t spill_threshold) {
+  doc->data = NULL;
+  doc->len = 0;
+  doc->max_len = 0;
+  doc->spill = NULL;
+  doc->spilled = 0;
+  doc->spill_threshold = spill_threshold;
+  doc->flush = NULL;
+  doc->flush_closure = NULL;
+  doc->status = CAIRO_STATUS_SUCCESS;
+}
+
+void
+document_destroy(document_t *doc) {
+  free(doc->data);
+  if (doc->spill) fclose(doc->spill);
+  document_init(doc, doc->spill_threshold);
+}
+
+/*
+ * Append to the memory buffer, doubling it as needed.
+ */
+
+static cairo_status_t
+buffer_append(document_t *doc, const uint8_t *data, size_t len) {
+  if (doc->len + len > doc->max_len) {
+    size_t max = doc->max_len ? doc->max_len : DOCUMENT_CHUNK;
+    while (doc->len + len > max) max *= 2;
+    uint8_t *grown = (uint8_t *) realloc(doc->data, max);
+    if (!grown) return CAIRO_STATUS_NO_MEMORY;
+    doc->data = grown;
+    doc->max_len = max;
+  }
+  memcpy(doc->data + doc->len, data, len);
+  doc->len += len;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Move the memory buffer to the temp file, which the rest of the
+ * document is then written to directly.
+ */
+
+static cairo_status_t
+spill(document_t *doc) {
+  if (!doc->spill && !(doc->spill = tmpfile())) return CAIRO_STATUS_WRITE_ERROR;
+  if (doc->len && fwrite(doc->data, 1, doc->len, doc->spill) != doc->len)
+    return CAIRO_STATUS_WRITE_ERROR;
+  doc->spilled += doc->len;
+  free(doc->data);
+  doc->data = NULL;
+  doc->len = doc->max_len = 0;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+cairo_status_t
+document_write(void *closure, const uint8_t *data, unsigned len) {
+  document_t *doc = (document_t *) closure;
+  if (doc->status) return doc->status;
+
+  cairo_status_t status;
+  if (doc->spill && !doc->flush) {
+    status = fwrite(data, 1, len, doc->spill) == len
+      ? CAIRO_STATUS_SUCCESS
+      : CAIRO_STATUS_WRITE_ERROR;
+    if (!status) doc->spilled += len;
+  } else {
+    status = buffer_append(doc, data, len);
+    if (!status && doc->flush && doc->len >= DOCUMENT_CHUNK) {
+      status = document_flush(doc);
+    } else if (!status && !doc->flush && doc->spill_threshold && doc->len > doc->spill_threshold) {
+      status = spill(doc);
+    }
+  }
+  return doc->status = status;
+}
+
+void
+document_set_flush(document_t *doc, document_flush_func_t flush, void *closure) {
+  doc->flush = flush;
+  doc->flush_closure = closure;
+}
+
+/*
+ * Call `fn` with the spilled bytes, read back in chunks, and then with
+ * the memory buffer.
+ */
+
+template <typename F>
+static cairo_status_t
+each_chunk(document_t *doc, F fn) {
+  if (doc->spilled) {
+    uint8_t *chunk = (uint8_t *) malloc(DOCUMENT_CHUNK);
+    if (!chunk) return CAIRO_STATUS_NO_MEMORY;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    if (fflush(doc->spill) || fseek(doc->spill, 0, SEEK_SET)) status = CAIRO_STATUS_READ_ERROR;
+    for (size_t left = doc->spilled; !status && left; ) {
+      size_t n = left < DOCUMENT_CHUNK ? left : DOCUMENT_CHUNK;
+      if (fread(chunk, 1, n, doc->spill) != n) {
+        status = CAIRO_STATUS_READ_ERROR;
+      } else {
+        status = fn(chunk, n);
+        left -= n;
+      }
+    }
+    free(chunk);
+    // Later writes append
+    if (fseek(doc->spill, 0, SEEK_END) && !status) status = CAIRO_STATUS_WRITE_ERROR;
+    if (status) return status;
+  }
+
+  for (size_t off = 0; off < doc->len; off += DOCUMENT_CHUNK) {
+    size_t n = doc->len - off < DOCUMENT_CHUNK ? doc->len - off : DOCUMENT_CHUNK;
+    cairo_status_t status = fn(doc->data + off, n);
+    if (status) return status;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+struct flush_chunk {
+  document_t *doc;
+  cairo_status_t operator()(const uint8_t *data, size_t len) const {
+    return doc->flush(doc->flush_closure, data, len);
+  }
+};
+
+struct replay_chunk {
+  cairo_write_func_t write_func;
+  void *closure;
+  cairo_status_t operator()(const uint8_t *data, size_t len) const {
+    return write_func(closure, data, len);
+  }
+};
+
+cairo_status_t
+document_flush(document_t *doc) {
+  if (!doc->flush) return CAIRO_STATUS_SUCCESS;
+  flush_chunk fn = { doc };
+  cairo_status_t status = each_chunk(doc, fn);
+  if (doc->spill) {
+    fclose(doc->spill);
+    doc->spill = NULL;
+    doc->spilled = 0;
+  }
+  doc->len = 0;
+  return status;
+}
+
+cairo_status_t
+document_replay(document_t *doc, cairo_write_func_t write_func, void *closure) {
+  replay_chunk fn = { write_func, closure };
+  return each_chunk(doc, fn);
+}
+
+uint8_t *
+document_take(document_t *doc, size_t *len) {
+  uint8_t *data;
+  *len = document_length(doc);
+
+  if (!doc->spilled) {
+    data = doc->data ? doc->data : (uint8_t *) malloc(1);
+    if (data && doc->len < doc->max_len) {
+      uint8_t *shrunk = (uint8_t *) realloc(data, doc->len ? doc->len : 1);
+      if (shrunk) data = shrunk;
+    }
+    if (!data) return NULL;
+    doc->data = NULL;
+    doc->len = doc->max_len = 0;
+    return data;
+  }
+
+  data = (uint8_t *) malloc(*len);
+  if (!data) return NULL;
+  if (fflush(doc->spill)
+      || fseek(doc->spill, 0, SEEK_SET)
+      || fread(data, 1, doc->spilled, doc->spill) != doc->spilled) {
+    free(data);
+    return NULL;
+  }
+  if (doc->len) memcpy(data + doc->spilled, doc->data, doc->len);
+
+  fclose(doc->spill);
+  free(doc->data);
+  doc->spill = NULL;
+  doc->spilled = 0;
+  doc->data = NULL;
+  doc->len = doc->max_len = 0;
+  return data;
+}
+
+void
+document_snapshot_init(document_snapshot_t *snapshot) {
+  snapshot->fd = -1;
+  snapshot->spilled = 0;
+  snapshot->data = NULL;
+  snapshot->len = 0;
+}
+
+cairo_status_t
+document_snapshot(document_t *doc, document_snapshot_t *snapshot) {
+  document_snapshot_init(snapshot);
+  if (doc->spilled) {
+    if (fflush(doc->spill) || (snapshot->fd = dup(fileno(doc->spill))) < 0)
+      return CAIRO_STATUS_READ_ERROR;
+    snapshot->spilled = doc->spilled;
+  }
+  if (doc->len) {
+    if (!(snapshot->data = (uint8_t *) malloc(doc->len))) {
+      document_snapshot_destroy(snapshot);
+      return CAIRO_STATUS_NO_MEMORY;
+    }
+    memcpy(snapshot->data, doc->data, doc->len);
+    snapshot->len = doc->len;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * The temp file is read at explicit offsets, leaving the position the
+ * document appends at alone.
+ */
+
+cairo_status_t
+document_snapshot_replay(const document_snapshot_t *snapshot, document_flush_func_t fn, void *closure) {
+  if (snapshot->spilled) {
+    uint8_t *chunk = (uint8_t *) malloc(DOCUMENT_CHUNK);
+    if (!chunk) return CAIRO_STATUS_NO_MEMORY;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    for (size_t off = 0; !status && off < snapshot->spilled; ) {
+      size_t left = snapshot->spilled - off;
+      uv_fs_t req;
+      uv_buf_t buf = uv_buf_init((char *) chunk, left < DOCUMENT_CHUNK ? left : DOCUMENT_CHUNK);
+      int n = uv_fs_read(NULL, &req, snapshot->fd, &buf, 1, off, NULL);
+      uv_fs_req_cleanup(&req);
+      if (n <= 0) {
+        status = CAIRO_STATUS_READ_ERROR;
+      } else {
+        status = fn(closure, chunk, n);
+        off += n;
+      }
+    }
+    free(chunk);
+    if (status) return status;
+  }
+
+  for (size_t off = 0; off < snapshot->len; off += DOCUMENT_CHUNK) {
+    size_t n = snapshot->len - off < DOCUMENT_CHUNK ? snapshot->len - off : DOCUMENT_CHUNK;
+    cairo_status_t status = fn(closure, snapshot->data + off, n);
+    if (status) return status;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+void
+document_snapshot_destroy(document_snapshot_t *snapshot) {
+  if (snapshot->fd >= 0) {
+    uv_fs_t req;
+    uv_fs_close(NULL, &req, snapshot->fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  free(snapshot->data);
+  document_snapshot_init(snapshot);
+}
@@ -0,0 +1,134 @@
+//
+// document.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_DOCUMENT_H__
+#define __NODE_DOCUMENT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <cairo.h>
+
+/*
+ * Bytes buffered before they are handed to a flush function, and the
+ * size of the chunks a spilled document is read back in.
+ */
+
+#ifndef DOCUMENT_CHUNK
+#define DOCUMENT_CHUNK (64 * 1024)
+#endif
+
+typedef cairo_status_t (*document_flush_func_t)(void *closure, const uint8_t *data, size_t len);
+
+/*
+ * Output of a cairo document surface as it is produced. Bytes are
+ * buffered in memory and either
+ *
+ *  - kept until the document is read back,
+ *  - moved to an anonymous temp file once more than `spill_threshold`
+ *    of them are held, or
+ *  - passed on to a flush function in DOCUMENT_CHUNK sized pieces,
+ *    in which case nothing is kept.
+ */
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t max_len;
+  FILE *spill;
+  size_t spilled;
+  size_t spill_threshold;
+  document_flush_func_t flush;
+  void *flush_closure;
+  cairo_status_t status;
+} document_t;
+
+void
+document_init(document_t *doc, size_t spill_threshold);
+
+void
+document_destroy(document_t *doc);
+
+/*
+ * cairo write function for document surfaces.
+ */
+
+cairo_status_t
+document_write(void *closure, const uint8_t *data, unsigned len);
+
+/*
+ * Bytes written so far and not yet flushed.
+ */
+
+inline size_t
+document_length(const document_t *doc) {
+  return doc->spilled + doc->len;
+}
+
+/*
+ * Start passing the output to `flush`. Whatever is held already is
+ * handed over on the next document_flush().
+ */
+
+void
+document_set_flush(document_t *doc, document_flush_func_t flush, void *closure);
+
+/*
+ * Hand everything held to the flush function.
+ */
+
+cairo_status_t
+document_flush(document_t *doc);
+
+/*
+ * Pass everything held to `write_func` in order, in chunks of at most
+ * DOCUMENT_CHUNK bytes. The document is left as it is.
+ */
+
+cairo_status_t
+document_replay(document_t *doc, cairo_write_func_t write_func, void *closure);
+
+/*
+ * Everything held as one malloc()ed block, read back from the temp
+ * file if the document spilled. The document no longer holds it
+ * afterwards. Returns NULL when out of memory or the read fails.
+ */
+
+uint8_t *
+document_take(document_t *doc, size_t *len);
+
+/*
+ * A finished, spilled document as it stands, to be read on another
+ * thread while the document itself is free to change or go away: a
+ * descriptor of its own for the temp file and a copy of the bytes
+ * still in memory.
+ */
+
+typedef struct {
+  int fd;
+  size_t spilled;
+  uint8_t *data;
+  size_t len;
+} document_snapshot_t;
+
+void
+document_snapshot_init(document_snapshot_t *snapshot);
+
+cairo_status_t
+document_snapshot(document_t *doc, document_snapshot_t *snapshot);
+
+/*
+ * Pass the snapshot to `fn` in order, in chunks of at most
+ * DOCUMENT_CHUNK bytes. Safe to call from the thread pool.
+ */
+
+cairo_status_t
+document_snapshot_replay(const document_snapshot_t *snapshot, document_flush_func_t fn, void *closure);
+
+void
+document_snapshot_destroy(document_snapshot_t *snapshot);
+
+#endif /* __NODE_DOCUMENT_H__ */
@@ -9,12 +9,18 @@
 #include <pango/pango.h>
 #include <glib.h>
 #include "Canvas.h"
+#include "AnimationEncoder.h"
 #include "Image.h"
 #include "ImageData.h"
+#include "ImageEncoder.h"
 #include "CanvasGradient.h"
 #include "CanvasPattern.h"
 #include "CanvasRenderingContext2d.h"
+#include "pixel_convert.h"
 #include <ft2build.h>
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+#endif
 #include FT_FREETYPE_H
 
 // Compatibility with Visual Studio versions prior to VS2015
@@ -23,9 +29,13 @@
 #endif
 
 NAN_MODULE_INIT(init) {
+  pixel_convert_init();
+
   Canvas::Initialize(target);
   Image::Initialize(target);
   ImageData::Initialize(target);
+  ImageEncoder::Initialize(target);
+  AnimationEncoder::Initialize(target);
   Context2d::Initialize(target);
   Gradient::Initialize(target);
   Pattern::Initialize(target);
@@ -58,6 +68,13 @@ NAN_MODULE_INIT(init) {
   target->Set(Nan::New<String>("jpegVersion").ToLocalChecked(), Nan::New<String>(jpeg_version).ToLocalChecked());
 #endif
 
+#ifdef HAVE_WEBP
+  int webp = WebPGetEncoderVersion();
+  char webp_version[16];
+  snprintf(webp_version, 16, "%d.%d.%d", (webp >> 16) & 0xff, (webp >> 8) & 0xff, webp & 0xff);
+  target->Set(Nan::New<String>("webpVersion").ToLocalChecked(), Nan::New<String>(webp_version).ToLocalChecked());
+#endif
+
 #ifdef HAVE_GIF
 #ifndef GIF_LIB_VERSION
   char gif_version[10];
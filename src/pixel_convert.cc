@@ -0,0 +1,700 @@
+//
+// pixel_convert.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "pixel_convert.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXEL_CONVERT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARMEB__) && !defined(__AARCH64EB__)
+#define PIXEL_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+/*
+ * Kernel set for one instruction set. `bgra` selects B G R A byte order
+ * over R G B A; `alpha` keeps the alpha byte rather than zeroing it.
+ */
+
+typedef struct {
+  void (*unpremultiply)(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra);
+  void (*swizzle)(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra, bool alpha);
+  void (*alpha)(uint8_t *dst, const uint8_t *src, size_t pixels);
+  void (*scan)(const uint8_t *src, size_t pixels, uint32_t acc[3]);
+  void (*from_rgb)(uint8_t *dst, const uint8_t *src, size_t pixels);
+  void (*from_gray)(uint8_t *dst, const uint8_t *src, size_t pixels);
+  const char *isa;
+} kernels_t;
+
+/*
+ * Reciprocal table for unpremultiplying. The straight value of a channel
+ * is (c * 255 + a / 2) / a; multiplying the (exact) float numerator by
+ * the smallest float above 1 / a and truncating yields the same quotient
+ * for every c and a, including the out of range c > a case, so the table
+ * replaces three integer divisions per pixel. recip[0] is 0, which makes
+ * fully transparent pixels come out as zero.
+ */
+
+static float recip[256];
+
+/*
+ * Portable versions. These also handle the tails of the SIMD loops.
+ */
+
+static inline uint8_t
+unpremultiply_channel(uint32_t c, uint32_t a) {
+  return (uint8_t) (uint32_t) ((float) (c * 255 + (a >> 1)) * recip[a]);
+}
+
+static void
+unpremultiply_c(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra) {
+  int r = bgra ? 2 : 0;
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t pixel;
+    memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+    uint32_t a = pixel >> 24;
+    uint8_t *b = dst + i * 4;
+    b[r] = unpremultiply_channel((pixel >> 16) & 0xff, a);
+    b[1] = unpremultiply_channel((pixel >> 8) & 0xff, a);
+    b[2 - r] = unpremultiply_channel(pixel & 0xff, a);
+    b[3] = a;
+  }
+}
+
+static void
+swizzle_c(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra, bool alpha) {
+  int r = bgra ? 2 : 0;
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t pixel;
+    memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+    uint8_t *b = dst + i * 4;
+    b[r] = (pixel >> 16) & 0xff;
+    b[1] = (pixel >> 8) & 0xff;
+    b[2 - r] = pixel & 0xff;
+    b[3] = alpha ? pixel >> 24 : 0;
+  }
+}
+
+static void
+alpha_c(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t pixel;
+    memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+    dst[i] = pixel >> 24;
+  }
+}
+
+/*
+ * Scan accumulators, OR-ed over every pixel: the complement of the
+ * pixel (any alpha bit set means a translucent pixel), the pixel xor
+ * itself shifted by one channel (nonzero low 16 bits mean r, g and b
+ * differ), and, in bytes 0, 1 and 2, the blue level xor itself shifted
+ * by 4, 2 and 1 bits, which is zero when the level is a multiple of
+ * 17, 85 or 255.
+ */
+
+static void
+scan_c(const uint8_t *src, size_t pixels, uint32_t acc[3]) {
+  uint32_t opaque = 0xffffffff, gray = 0, depth = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t pixel;
+    memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+    uint32_t b = pixel & 0xff;
+    opaque &= pixel;
+    gray |= pixel ^ (pixel >> 8);
+    depth |= (b ^ b >> 4) | (b ^ b >> 2) << 8 | (b ^ b >> 1) << 16;
+  }
+  acc[0] |= ~opaque;
+  acc[1] |= gray;
+  acc[2] |= depth;
+}
+
+static void
+from_rgb_c(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    const uint8_t *s = src + i * 3;
+    uint32_t pixel = 0xff000000 | (uint32_t) s[0] << 16 | (uint32_t) s[1] << 8 | s[2];
+    memcpy(dst + i * 4, &pixel, sizeof(uint32_t));
+  }
+}
+
+static void
+from_gray_c(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    uint32_t pixel = 0xff000000 | src[i] * 0x010101u;
+    memcpy(dst + i * 4, &pixel, sizeof(uint32_t));
+  }
+}
+
+static const kernels_t kernels_c = { unpremultiply_c, swizzle_c, alpha_c, scan_c, from_rgb_c, from_gray_c, "c" };
+
+#ifdef PIXEL_CONVERT_X86
+
+/*
+ * SSE2, four pixels at a time. x86 is little endian, so the alpha of
+ * pixel n is byte 4n + 3 and RGBA bytes are R | G << 8 | B << 16 | A << 24.
+ */
+
+TARGET_SSE2 static inline __m128i
+unpremultiply_sse2_channel(__m128i c, __m128i half, __m128 r) {
+  __m128i x = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 8), c), half);
+  __m128i q = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(x), r));
+  return _mm_and_si128(q, _mm_set1_epi32(0xff));
+}
+
+TARGET_SSE2 static void
+unpremultiply_sse2(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  size_t i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    const uint8_t *s = src + i * 4;
+    __m128i v = _mm_loadu_si128((const __m128i *) s);
+    __m128i a = _mm_srli_epi32(v, 24);
+    __m128i half = _mm_srli_epi32(a, 1);
+    __m128 r = _mm_set_ps(recip[s[15]], recip[s[11]], recip[s[7]], recip[s[3]]);
+
+    __m128i cr = unpremultiply_sse2_channel(_mm_and_si128(_mm_srli_epi32(v, 16), mask), half, r);
+    __m128i cg = unpremultiply_sse2_channel(_mm_and_si128(_mm_srli_epi32(v, 8), mask), half, r);
+    __m128i cb = unpremultiply_sse2_channel(_mm_and_si128(v, mask), half, r);
+    if (bgra) {
+      __m128i tmp = cr; cr = cb; cb = tmp;
+    }
+
+    __m128i out = _mm_or_si128(
+        _mm_or_si128(cr, _mm_slli_epi32(cg, 8))
+      , _mm_or_si128(_mm_slli_epi32(cb, 16), _mm_slli_epi32(a, 24)));
+    _mm_storeu_si128((__m128i *) (dst + i * 4), out);
+  }
+
+  unpremultiply_c(dst + i * 4, src + i * 4, pixels - i, bgra);
+}
+
+TARGET_SSE2 static void
+swizzle_sse2(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra, bool alpha) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128i keep = _mm_set1_epi32(alpha ? 0xff00ff00 : 0x0000ff00);
+  size_t i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 4));
+    __m128i out = _mm_and_si128(v, keep);
+    if (bgra) {
+      out = _mm_or_si128(out, _mm_and_si128(v, _mm_set1_epi32(0x00ff00ff)));
+    } else {
+      out = _mm_or_si128(out, _mm_or_si128(
+          _mm_and_si128(_mm_srli_epi32(v, 16), mask)
+        , _mm_slli_epi32(_mm_and_si128(v, mask), 16)));
+    }
+    _mm_storeu_si128((__m128i *) (dst + i * 4), out);
+  }
+
+  swizzle_c(dst + i * 4, src + i * 4, pixels - i, bgra, alpha);
+}
+
+TARGET_SSE2 static void
+alpha_sse2(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    const __m128i *s = (const __m128i *) (src + i * 4);
+    __m128i a0 = _mm_srli_epi32(_mm_loadu_si128(s), 24);
+    __m128i a1 = _mm_srli_epi32(_mm_loadu_si128(s + 1), 24);
+    __m128i a2 = _mm_srli_epi32(_mm_loadu_si128(s + 2), 24);
+    __m128i a3 = _mm_srli_epi32(_mm_loadu_si128(s + 3), 24);
+    __m128i out = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+    _mm_storeu_si128((__m128i *) (dst + i), out);
+  }
+
+  alpha_c(dst + i, src + i * 4, pixels - i);
+}
+
+TARGET_SSE2 static void
+scan_sse2(const uint8_t *src, size_t pixels, uint32_t acc[3]) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  __m128i opaque = _mm_set1_epi32(-1), gray = _mm_setzero_si128(), depth = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 4));
+    __m128i b = _mm_and_si128(v, mask);
+    opaque = _mm_and_si128(opaque, v);
+    gray = _mm_or_si128(gray, _mm_xor_si128(v, _mm_srli_epi32(v, 8)));
+    depth = _mm_or_si128(depth, _mm_or_si128(
+        _mm_xor_si128(b, _mm_srli_epi32(b, 4))
+      , _mm_or_si128(
+          _mm_slli_epi32(_mm_xor_si128(b, _mm_srli_epi32(b, 2)), 8)
+        , _mm_slli_epi32(_mm_xor_si128(b, _mm_srli_epi32(b, 1)), 16))));
+  }
+
+  uint32_t lanes[3][4];
+  _mm_storeu_si128((__m128i *) lanes[0], _mm_xor_si128(opaque, _mm_set1_epi32(-1)));
+  _mm_storeu_si128((__m128i *) lanes[1], gray);
+  _mm_storeu_si128((__m128i *) lanes[2], depth);
+  for (int k = 0; k < 3; k++) acc[k] |= lanes[k][0] | lanes[k][1] | lanes[k][2] | lanes[k][3];
+
+  scan_c(src + i * 4, pixels - i, acc);
+}
+
+/*
+ * Gray bytes g become g g g 0xff, by interleaving g with itself and
+ * with 0xff, then the two. RGB has no SSE2 version, lacking a byte
+ * shuffle.
+ */
+
+TARGET_SSE2 static void
+from_gray_sse2(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  const __m128i ff = _mm_set1_epi8((char) 0xff);
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i g = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+    __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+    __m128i ga_lo = _mm_unpacklo_epi8(g, ff);
+    __m128i ga_hi = _mm_unpackhi_epi8(g, ff);
+    uint8_t *d = dst + i * 4;
+    _mm_storeu_si128((__m128i *) d, _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i *) (d + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i *) (d + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128((__m128i *) (d + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+
+  from_gray_c(dst + i * 4, src + i, pixels - i);
+}
+
+static const kernels_t kernels_sse2 = { unpremultiply_sse2, swizzle_sse2, alpha_sse2, scan_sse2, from_rgb_c, from_gray_sse2, "sse2" };
+
+/*
+ * AVX2, eight pixels at a time with the reciprocals gathered.
+ */
+
+TARGET_AVX2 static inline __m256i
+unpremultiply_avx2_channel(__m256i c, __m256i half, __m256 r) {
+  __m256i x = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(c, 8), c), half);
+  __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(x), r));
+  return _mm256_and_si256(q, _mm256_set1_epi32(0xff));
+}
+
+TARGET_AVX2 static void
+unpremultiply_avx2(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  size_t i = 0;
+
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+    __m256i a = _mm256_srli_epi32(v, 24);
+    __m256i half = _mm256_srli_epi32(a, 1);
+    __m256 r = _mm256_i32gather_ps(recip, a, 4);
+
+    __m256i cr = unpremultiply_avx2_channel(_mm256_and_si256(_mm256_srli_epi32(v, 16), mask), half, r);
+    __m256i cg = unpremultiply_avx2_channel(_mm256_and_si256(_mm256_srli_epi32(v, 8), mask), half, r);
+    __m256i cb = unpremultiply_avx2_channel(_mm256_and_si256(v, mask), half, r);
+    if (bgra) {
+      __m256i tmp = cr; cr = cb; cb = tmp;
+    }
+
+    __m256i out = _mm256_or_si256(
+        _mm256_or_si256(cr, _mm256_slli_epi32(cg, 8))
+      , _mm256_or_si256(_mm256_slli_epi32(cb, 16), _mm256_slli_epi32(a, 24)));
+    _mm256_storeu_si256((__m256i *) (dst + i * 4), out);
+  }
+
+  unpremultiply_sse2(dst + i * 4, src + i * 4, pixels - i, bgra);
+}
+
+TARGET_AVX2 static void
+swizzle_avx2(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra, bool alpha) {
+  // Source byte of output bytes 0, 2 and 3 of each pixel; -1 clears the byte
+  char x = bgra ? 0 : 2, z = bgra ? 2 : 0, a = alpha ? 3 : -1;
+  char a4 = alpha ? 7 : -1, a8 = alpha ? 11 : -1, a12 = alpha ? 15 : -1;
+  const __m256i shuffle = _mm256_setr_epi8(
+      x, 1, z, a, x + 4, 5, z + 4, a4, x + 8, 9, z + 8, a8, x + 12, 13, z + 12, a12
+    , x, 1, z, a, x + 4, 5, z + 4, a4, x + 8, 9, z + 8, a8, x + 12, 13, z + 12, a12);
+  size_t i = 0;
+
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+    _mm256_storeu_si256((__m256i *) (dst + i * 4), _mm256_shuffle_epi8(v, shuffle));
+  }
+
+  swizzle_sse2(dst + i * 4, src + i * 4, pixels - i, bgra, alpha);
+}
+
+TARGET_AVX2 static void
+scan_avx2(const uint8_t *src, size_t pixels, uint32_t acc[3]) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  __m256i opaque = _mm256_set1_epi32(-1), gray = _mm256_setzero_si256(), depth = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+    __m256i b = _mm256_and_si256(v, mask);
+    opaque = _mm256_and_si256(opaque, v);
+    gray = _mm256_or_si256(gray, _mm256_xor_si256(v, _mm256_srli_epi32(v, 8)));
+    depth = _mm256_or_si256(depth, _mm256_or_si256(
+        _mm256_xor_si256(b, _mm256_srli_epi32(b, 4))
+      , _mm256_or_si256(
+          _mm256_slli_epi32(_mm256_xor_si256(b, _mm256_srli_epi32(b, 2)), 8)
+        , _mm256_slli_epi32(_mm256_xor_si256(b, _mm256_srli_epi32(b, 1)), 16))));
+  }
+
+  uint32_t lanes[3][8];
+  _mm256_storeu_si256((__m256i *) lanes[0], _mm256_xor_si256(opaque, _mm256_set1_epi32(-1)));
+  _mm256_storeu_si256((__m256i *) lanes[1], gray);
+  _mm256_storeu_si256((__m256i *) lanes[2], depth);
+  for (int k = 0; k < 3; k++) {
+    for (int j = 0; j < 8; j++) acc[k] |= lanes[k][j];
+  }
+
+  scan_sse2(src + i * 4, pixels - i, acc);
+}
+
+/*
+ * Eight RGB pixels, loaded as two overlapping 16-byte halves of which
+ * the first 12 bytes are used, shuffled into B G R and or-ed with
+ * opaque alpha. The loads read 4 bytes past the pixels converted, so
+ * the loop stops short of the end.
+ */
+
+TARGET_AVX2 static void
+from_rgb_avx2(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+    , 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  size_t i = 0;
+
+  for (; i + 10 <= pixels; i += 8) {
+    const uint8_t *s = src + i * 3;
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) s))
+      , _mm_loadu_si128((const __m128i *) (s + 12)), 1);
+    v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+    _mm256_storeu_si256((__m256i *) (dst + i * 4), v);
+  }
+
+  from_rgb_c(dst + i * 4, src + i * 3, pixels - i);
+}
+
+static const kernels_t kernels_avx2 = { unpremultiply_avx2, swizzle_avx2, alpha_sse2, scan_avx2, from_rgb_avx2, from_gray_sse2, "avx2" };
+
+static bool
+cpu_has_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool
+cpu_has_avx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return false;
+  __cpuid(info, 1);
+  // AVX and OSXSAVE, then check the OS saves the YMM registers
+  if ((info[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28)) return false;
+  if ((_xgetbv(0) & 6) != 6) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif /* PIXEL_CONVERT_X86 */
+
+#ifdef PIXEL_CONVERT_NEON
+
+/*
+ * NEON, four pixels at a time. Only built for little endian ARM.
+ */
+
+static inline uint32x4_t
+unpremultiply_neon_channel(uint32x4_t c, uint32x4_t half, float32x4_t r) {
+  uint32x4_t x = vmlaq_n_u32(half, c, 255);
+  uint32x4_t q = vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(x), r));
+  return vandq_u32(q, vdupq_n_u32(0xff));
+}
+
+static void
+unpremultiply_neon(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra) {
+  const uint32x4_t mask = vdupq_n_u32(0xff);
+  size_t i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    const uint8_t *s = src + i * 4;
+    uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(s));
+    uint32x4_t a = vshrq_n_u32(v, 24);
+    uint32x4_t half = vshrq_n_u32(a, 1);
+    float rs[4] = { recip[s[3]], recip[s[7]], recip[s[11]], recip[s[15]] };
+    float32x4_t r = vld1q_f32(rs);
+
+    uint32x4_t cr = unpremultiply_neon_channel(vandq_u32(vshrq_n_u32(v, 16), mask), half, r);
+    uint32x4_t cg = unpremultiply_neon_channel(vandq_u32(vshrq_n_u32(v, 8), mask), half, r);
+    uint32x4_t cb = unpremultiply_neon_channel(vandq_u32(v, mask), half, r);
+    if (bgra) {
+      uint32x4_t tmp = cr; cr = cb; cb = tmp;
+    }
+
+    uint32x4_t out = vorrq_u32(
+        vorrq_u32(cr, vshlq_n_u32(cg, 8))
+      , vorrq_u32(vshlq_n_u32(cb, 16), vshlq_n_u32(a, 24)));
+    vst1q_u8(dst + i * 4, vreinterpretq_u8_u32(out));
+  }
+
+  unpremultiply_c(dst + i * 4, src + i * 4, pixels - i, bgra);
+}
+
+static void
+swizzle_neon(uint8_t *dst, const uint8_t *src, size_t pixels, bool bgra, bool alpha) {
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    // Memory order is B G R A
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    uint8x16x4_t out;
+    out.val[0] = bgra ? v.val[0] : v.val[2];
+    out.val[1] = v.val[1];
+    out.val[2] = bgra ? v.val[2] : v.val[0];
+    out.val[3] = alpha ? v.val[3] : vdupq_n_u8(0);
+    vst4q_u8(dst + i * 4, out);
+  }
+
+  swizzle_c(dst + i * 4, src + i * 4, pixels - i, bgra, alpha);
+}
+
+static void
+alpha_neon(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    vst1q_u8(dst + i, v.val[3]);
+  }
+
+  alpha_c(dst + i, src + i * 4, pixels - i);
+}
+
+static void
+scan_neon(const uint8_t *src, size_t pixels, uint32_t acc[3]) {
+  const uint32x4_t mask = vdupq_n_u32(0xff);
+  uint32x4_t opaque = vdupq_n_u32(0xffffffff), gray = vdupq_n_u32(0), depth = vdupq_n_u32(0);
+  size_t i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+    uint32x4_t b = vandq_u32(v, mask);
+    opaque = vandq_u32(opaque, v);
+    gray = vorrq_u32(gray, veorq_u32(v, vshrq_n_u32(v, 8)));
+    depth = vorrq_u32(depth, vorrq_u32(
+        veorq_u32(b, vshrq_n_u32(b, 4))
+      , vorrq_u32(
+          vshlq_n_u32(veorq_u32(b, vshrq_n_u32(b, 2)), 8)
+        , vshlq_n_u32(veorq_u32(b, vshrq_n_u32(b, 1)), 16))));
+  }
+
+  uint32_t lanes[3][4];
+  vst1q_u32(lanes[0], vmvnq_u32(opaque));
+  vst1q_u32(lanes[1], gray);
+  vst1q_u32(lanes[2], depth);
+  for (int k = 0; k < 3; k++) acc[k] |= lanes[k][0] | lanes[k][1] | lanes[k][2] | lanes[k][3];
+
+  scan_c(src + i * 4, pixels - i, acc);
+}
+
+static void
+from_rgb_neon(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+    uint8x16x4_t bgra;
+    bgra.val[0] = rgb.val[2];
+    bgra.val[1] = rgb.val[1];
+    bgra.val[2] = rgb.val[0];
+    bgra.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8(dst + i * 4, bgra);
+  }
+
+  from_rgb_c(dst + i * 4, src + i * 3, pixels - i);
+}
+
+static void
+from_gray_neon(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t bgra;
+    bgra.val[0] = bgra.val[1] = bgra.val[2] = vld1q_u8(src + i);
+    bgra.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8(dst + i * 4, bgra);
+  }
+
+  from_gray_c(dst + i * 4, src + i, pixels - i);
+}
+
+static const kernels_t kernels_neon = { unpremultiply_neon, swizzle_neon, alpha_neon, scan_neon, from_rgb_neon, from_gray_neon, "neon" };
+
+#endif /* PIXEL_CONVERT_NEON */
+
+static const kernels_t *kernels = &kernels_c;
+
+/*
+ * Build the reciprocal table and pick the kernels for this CPU.
+ * Must be called once before any conversion.
+ */
+
+void
+pixel_convert_init() {
+  recip[0] = 0;
+  for (int a = 1; a < 256; a++) {
+    recip[a] = nextafterf(1.0f / a, 2.0f);
+  }
+
+#ifdef PIXEL_CONVERT_X86
+  if (cpu_has_sse2()) kernels = &kernels_sse2;
+  if (cpu_has_avx2()) kernels = &kernels_avx2;
+#endif
+
+#ifdef PIXEL_CONVERT_NEON
+  kernels = &kernels_neon;
+#endif
+}
+
+/*
+ * Name of the instruction set the kernels use.
+ */
+
+const char *
+pixel_convert_isa() {
+  return kernels->isa;
+}
+
+void
+argb32_unpremultiply_to_rgba(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  kernels->unpremultiply(dst, src, pixels, false);
+}
+
+void
+argb32_to_rgbx(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  kernels->swizzle(dst, src, pixels, false, false);
+}
+
+uint32_t
+argb32_scan(const uint8_t *src, size_t pixels, uint32_t flags) {
+  uint32_t acc[3] = { 0, 0, 0 };
+  kernels->scan(src, pixels, acc);
+
+  if (acc[0] & 0xff000000) flags &= ~PIXEL_SCAN_OPAQUE;
+  if (acc[1] & 0xffff) flags &= ~(PIXEL_SCAN_GRAY | PIXEL_SCAN_GRAY4 | PIXEL_SCAN_GRAY2 | PIXEL_SCAN_GRAY1);
+  if (acc[2] & 0x0f) flags &= ~PIXEL_SCAN_GRAY4;
+  if (acc[2] & 0x3f00) flags &= ~PIXEL_SCAN_GRAY2;
+  if (acc[2] & 0x7f0000) flags &= ~PIXEL_SCAN_GRAY1;
+  return flags;
+}
+
+int
+pixel_format_bytes(pixel_format_t format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGBA:
+    case PIXEL_FORMAT_BGRA:
+      return 4;
+    case PIXEL_FORMAT_RGB:
+      return 3;
+    case PIXEL_FORMAT_RGB565:
+      return 2;
+    case PIXEL_FORMAT_A8:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Pixels per block for the packed formats, which go through
+ * an RGBA block on the stack.
+ */
+
+#define PIXEL_CONVERT_BLOCK 256
+
+void
+argb32_convert(uint8_t *dst, const uint8_t *src, size_t pixels, pixel_format_t format, bool premultiplied) {
+  uint8_t rgba[PIXEL_CONVERT_BLOCK * 4];
+
+  switch (format) {
+    case PIXEL_FORMAT_RGBA:
+    case PIXEL_FORMAT_BGRA:
+      if (premultiplied) {
+        kernels->swizzle(dst, src, pixels, format == PIXEL_FORMAT_BGRA, true);
+      } else {
+        kernels->unpremultiply(dst, src, pixels, format == PIXEL_FORMAT_BGRA);
+      }
+      break;
+    case PIXEL_FORMAT_A8:
+      kernels->alpha(dst, src, pixels);
+      break;
+    case PIXEL_FORMAT_RGB:
+    case PIXEL_FORMAT_RGB565:
+      for (size_t i = 0; i < pixels; i += PIXEL_CONVERT_BLOCK) {
+        size_t n = pixels - i < PIXEL_CONVERT_BLOCK ? pixels - i : PIXEL_CONVERT_BLOCK;
+        if (premultiplied) {
+          kernels->swizzle(rgba, src + i * 4, n, false, false);
+        } else {
+          kernels->unpremultiply(rgba, src + i * 4, n, false);
+        }
+
+        if (format == PIXEL_FORMAT_RGB) {
+          uint8_t *out = dst + i * 3;
+          for (size_t j = 0; j < n; j++) {
+            out[j * 3] = rgba[j * 4];
+            out[j * 3 + 1] = rgba[j * 4 + 1];
+            out[j * 3 + 2] = rgba[j * 4 + 2];
+          }
+        } else {
+          uint8_t *out = dst + i * 2;
+          for (size_t j = 0; j < n; j++) {
+            uint16_t v = (rgba[j * 4] >> 3) << 11 | (rgba[j * 4 + 1] >> 2) << 5 | rgba[j * 4 + 2] >> 3;
+            memcpy(out + j * 2, &v, sizeof(uint16_t));
+          }
+        }
+      }
+      break;
+  }
+}
+
+void
+rgb_to_argb32(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  kernels->from_rgb(dst, src, pixels);
+}
+
+void
+gray_to_argb32(uint8_t *dst, const uint8_t *src, size_t pixels) {
+  kernels->from_gray(dst, src, pixels);
+}
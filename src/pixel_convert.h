@@ -0,0 +1,99 @@
+//
+// pixel_convert.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_PIXEL_CONVERT_H__
+#define __NODE_PIXEL_CONVERT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Pixel format conversion kernels. Each one has a portable C version and,
+ * where the compiler supports it, SSE2, AVX2 or NEON versions; the fastest
+ * one the CPU supports is picked by pixel_convert_init(). All versions
+ * produce identical output.
+ *
+ * Source pixels are cairo ARGB32 (native endian, premultiplied). `dst` may
+ * equal `src` for in place conversion, except for the imports at the end.
+ */
+
+void
+pixel_convert_init();
+
+const char *
+pixel_convert_isa();
+
+/*
+ * Unpremultiply `pixels` ARGB32 pixels into straight RGBA bytes.
+ */
+
+void
+argb32_unpremultiply_to_rgba(uint8_t *dst, const uint8_t *src, size_t pixels);
+
+/*
+ * Convert `pixels` xRGB32 pixels into RGBx bytes, the x byte being zero.
+ */
+
+void
+argb32_to_rgbx(uint8_t *dst, const uint8_t *src, size_t pixels);
+
+/*
+ * Flags for argb32_scan(), each holding when every pixel scanned is
+ * opaque, gray (r == g == b) or, being gray, at a level that 4, 2 or
+ * 1-bit samples represent exactly.
+ */
+
+#define PIXEL_SCAN_OPAQUE 0x01
+#define PIXEL_SCAN_GRAY 0x02
+#define PIXEL_SCAN_GRAY4 0x04
+#define PIXEL_SCAN_GRAY2 0x08
+#define PIXEL_SCAN_GRAY1 0x10
+#define PIXEL_SCAN_ALL 0x1f
+
+/*
+ * Scan `pixels` ARGB32 pixels, returning `flags` less the ones that
+ * do not hold for them.
+ */
+
+uint32_t
+argb32_scan(const uint8_t *src, size_t pixels, uint32_t flags);
+
+/*
+ * Export formats. RGBA, BGRA and RGB are byte orders, RGB565 is a
+ * native endian 16-bit word and A8 is the alpha channel alone.
+ */
+
+typedef enum {
+  PIXEL_FORMAT_RGBA,
+  PIXEL_FORMAT_BGRA,
+  PIXEL_FORMAT_RGB,
+  PIXEL_FORMAT_A8,
+  PIXEL_FORMAT_RGB565
+} pixel_format_t;
+
+int
+pixel_format_bytes(pixel_format_t format);
+
+/*
+ * Convert `pixels` ARGB32 pixels to `format`, unpremultiplying
+ * unless `premultiplied` is set.
+ */
+
+void
+argb32_convert(uint8_t *dst, const uint8_t *src, size_t pixels, pixel_format_t format, bool premultiplied);
+
+/*
+ * Import `pixels` RGB or gray bytes, as libjpeg outputs them, as opaque
+ * ARGB32 pixels. `dst` must not overlap `src`.
+ */
+
+void
+rgb_to_argb32(uint8_t *dst, const uint8_t *src, size_t pixels);
+
+void
+gray_to_argb32(uint8_t *dst, const uint8_t *src, size_t pixels);
+
+#endif /* __NODE_PIXEL_CONVERT_H__ */
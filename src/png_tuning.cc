@@ -0,0 +1,134 @@
+//
+// png_tuning.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "png_tuning.h"
+#include <math.h>
+#include <string.h>
+#include <png.h>
+#include <uv.h>
+
+/*
+ * Content classes by sampled entropy in bits per byte: flat graphics,
+ * mixed content, and photographic or noisy images.
+ */
+
+typedef enum {
+  PNG_CONTENT_FLAT,
+  PNG_CONTENT_MIXED,
+  PNG_CONTENT_NOISY,
+  PNG_CONTENT_COUNT
+} png_content_t;
+
+#define PNG_TUNING_SAMPLE_ROWS 32
+#define PNG_TUNING_SAMPLE_WIDTH 2048
+#define PNG_TUNING_MIN_PIXELS (256 * 256)
+
+/*
+ * Pixels per second a single thread encodes, by class and level. The
+ * defaults are on the slow side so that a budget is not blown before
+ * anything has been measured.
+ */
+
+static double throughput[PNG_CONTENT_COUNT][10] = {
+  { 0, 80e6, 75e6, 70e6, 45e6, 40e6, 35e6, 25e6, 12e6, 6e6 },
+  { 0, 45e6, 40e6, 35e6, 25e6, 20e6, 15e6, 11e6, 5e6, 3e6 },
+  { 0, 30e6, 28e6, 25e6, 18e6, 15e6, 12e6, 10e6, 6e6, 4e6 }
+};
+
+static uv_once_t once = UV_ONCE_INIT;
+static uv_mutex_t mutex;
+
+static void
+init_mutex() {
+  uv_mutex_init(&mutex);
+}
+
+/*
+ * Shannon entropy of the bytes of the horizontal differences of up to
+ * PNG_TUNING_SAMPLE_ROWS evenly spaced rows.
+ */
+
+static png_content_t
+classify(const uint8_t *data, int width, int height, int stride) {
+  uint32_t counts[256];
+  memset(counts, 0, sizeof(counts));
+
+  int rows = height < PNG_TUNING_SAMPLE_ROWS ? height : PNG_TUNING_SAMPLE_ROWS;
+  int w = width < PNG_TUNING_SAMPLE_WIDTH ? width : PNG_TUNING_SAMPLE_WIDTH;
+  uint32_t total = 0;
+  for (int r = 0; r < rows; r++) {
+    const uint8_t *row = data + (size_t) ((int64_t) r * height / rows) * stride;
+    for (int i = 4; i < w * 4; i++) counts[(uint8_t) (row[i] - row[i - 4])]++;
+    total += (w - 1) * 4;
+  }
+  if (!total) return PNG_CONTENT_FLAT;
+
+  double bits = 0;
+  for (int i = 0; i < 256; i++) {
+    if (!counts[i]) continue;
+    double p = (double) counts[i] / total;
+    bits -= p * log2(p);
+  }
+  return bits < 1.5 ? PNG_CONTENT_FLAT : bits < 4.5 ? PNG_CONTENT_MIXED : PNG_CONTENT_NOISY;
+}
+
+/*
+ * Threads are assumed to scale at 80%.
+ */
+
+static double
+parallelism(unsigned threads) {
+  return threads > 1 ? threads * 0.8 : 1;
+}
+
+void
+png_tuning_choose(
+    const uint8_t *data, int width, int height, int stride
+  , unsigned threads, double budget_ms
+  , uint32_t *compression_level, uint32_t *filter) {
+  uv_once(&once, init_mutex);
+  png_content_t content = classify(data, width, height, stride);
+  double pixels = (double) width * height;
+
+  uv_mutex_lock(&mutex);
+  // Level 0 stores the image uncompressed, never worth it
+  int level = -1, fastest = 1;
+  for (int l = 1; l <= 9; l++) {
+    double ms = pixels / (throughput[content][l] * parallelism(threads)) * 1000;
+    if (ms <= budget_ms) level = l;
+    if (throughput[content][l] > throughput[content][fastest]) fastest = l;
+  }
+  uv_mutex_unlock(&mutex);
+
+  *compression_level = level < 0 ? fastest : level;
+
+  // Flat graphics rarely gain from the costlier filters; otherwise
+  // only the fast levels leave out the adaptive filter selection
+  if (content == PNG_CONTENT_FLAT) {
+    *filter = PNG_FILTER_NONE | PNG_FILTER_SUB;
+  } else if (*compression_level < 3) {
+    *filter = PNG_FILTER_SUB;
+  } else {
+    *filter = PNG_ALL_FILTERS;
+  }
+}
+
+void
+png_tuning_record(
+    const uint8_t *data, int width, int height, int stride
+  , unsigned threads, uint32_t compression_level, uint64_t elapsed_ns) {
+  double pixels = (double) width * height;
+  if (pixels < PNG_TUNING_MIN_PIXELS || !elapsed_ns || !compression_level || compression_level > 9) return;
+
+  uv_once(&once, init_mutex);
+  png_content_t content = classify(data, width, height, stride);
+  double measured = pixels / (elapsed_ns / 1e9) / parallelism(threads);
+
+  uv_mutex_lock(&mutex);
+  double &t = throughput[content][compression_level];
+  t = t * 0.7 + measured * 0.3;
+  uv_mutex_unlock(&mutex);
+}
@@ -0,0 +1,41 @@
+//
+// png_tuning.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_PNG_TUNING_H__
+#define __NODE_PNG_TUNING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Choice of zlib level and PNG filters for a time budget. Images are
+ * put in a content class from the entropy of their horizontal
+ * differences over a sample of rows, and the encode time at each
+ * level predicted from the throughput measured for that class on this
+ * machine, starting from conservative defaults. The highest level
+ * predicted to fit the budget is chosen, or the fastest if none does;
+ * level 0, which stores the image uncompressed, never is.
+ *
+ * `data` is cairo ARGB32 or RGB24. Safe to call from any thread.
+ */
+
+void
+png_tuning_choose(
+    const uint8_t *data, int width, int height, int stride
+  , unsigned threads, double budget_ms
+  , uint32_t *compression_level, uint32_t *filter);
+
+/*
+ * Record how long an encode of the image took at `compression_level`
+ * with `threads` threads, refining later predictions.
+ */
+
+void
+png_tuning_record(
+    const uint8_t *data, int width, int height, int stride
+  , unsigned threads, uint32_t compression_level, uint64_t elapsed_ns);
+
+#endif /* __NODE_PNG_TUNING_H__ */
@@ -0,0 +1,385 @@
+//
+// quantize.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "quantize.h"
+#include "pixel_convert.h"
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+/*
+ * Histogram bins keep 5 bits of red, green and blue and 3 of alpha.
+ * Images over QUANT_SAMPLES pixels only have every n-th row sampled.
+ */
+
+#define QUANT_BINS (1 << 18)
+#define QUANT_SAMPLES (1 << 20)
+#define QUANT_EXACT_SLOTS 512
+#define QUANT_UNKNOWN 0xffff
+
+struct palette_quantizer {
+  int width;
+  bool alpha;
+  bool dither;
+  bool exact;
+  unsigned count;
+  unsigned translucent;
+  unsigned row;
+  uint8_t palette[256][4];
+  uint32_t exact_keys[QUANT_EXACT_SLOTS];
+  int16_t exact_index[QUANT_EXACT_SLOTS];
+  std::vector<uint16_t> cache;
+  std::vector<uint8_t> rgba;
+  std::vector<int> error;
+};
+
+/*
+ * A histogram bin, and a box of bins for median cut.
+ */
+
+typedef struct {
+  uint32_t count;
+  float c[4];
+} quant_entry_t;
+
+typedef struct {
+  size_t begin;
+  size_t end;
+  double score;
+  int channel;
+} quant_box_t;
+
+static inline uint32_t
+bin_of(const uint8_t *p) {
+  return (p[0] >> 3) << 13 | (p[1] >> 3) << 8 | (p[2] >> 3) << 3 | p[3] >> 5;
+}
+
+static inline uint32_t
+key_of(const uint8_t *p) {
+  uint32_t key;
+  memcpy(&key, p, 4);
+  return key;
+}
+
+static inline unsigned
+slot_of(uint32_t key) {
+  return (key * 2654435761u) >> (32 - 9);
+}
+
+/*
+ * Index of `key` in the exact color table, or -1.
+ */
+
+static inline int
+exact_find(palette_quantizer_t *q, uint32_t key) {
+  for (unsigned s = slot_of(key); ; s = (s + 1) % QUANT_EXACT_SLOTS) {
+    if (q->exact_index[s] < 0) return -1;
+    if (q->exact_keys[s] == key) return q->exact_index[s];
+  }
+}
+
+static inline void
+exact_insert(palette_quantizer_t *q, uint32_t key, int index) {
+  unsigned s = slot_of(key);
+  while (q->exact_index[s] >= 0) s = (s + 1) % QUANT_EXACT_SLOTS;
+  q->exact_keys[s] = key;
+  q->exact_index[s] = index;
+}
+
+/*
+ * Unpremultiply `row` into the scratch RGBA row.
+ */
+
+static void
+load_row(palette_quantizer_t *q, const uint8_t *row) {
+  uint8_t *rgba = &q->rgba[0];
+  if (q->alpha) {
+    argb32_unpremultiply_to_rgba(rgba, row, q->width);
+  } else {
+    argb32_to_rgbx(rgba, row, q->width);
+    for (int x = 0; x < q->width; x++) rgba[x * 4 + 3] = 255;
+  }
+}
+
+/*
+ * Score `box` by the weighted squared error along its widest channel.
+ */
+
+static void
+box_measure(quant_box_t *box, const std::vector<quant_entry_t> &entries) {
+  double n = 0, sum[4] = { 0, 0, 0, 0 }, sq[4] = { 0, 0, 0, 0 };
+  for (size_t i = box->begin; i < box->end; i++) {
+    const quant_entry_t &e = entries[i];
+    n += e.count;
+    for (int c = 0; c < 4; c++) {
+      sum[c] += e.count * e.c[c];
+      sq[c] += e.count * e.c[c] * e.c[c];
+    }
+  }
+
+  box->score = 0;
+  box->channel = 0;
+  if (box->end - box->begin < 2) return;
+  for (int c = 0; c < 4; c++) {
+    double err = sq[c] - sum[c] * sum[c] / n;
+    if (err > box->score) {
+      box->score = err;
+      box->channel = c;
+    }
+  }
+}
+
+struct entry_less {
+  int channel;
+  bool operator()(const quant_entry_t &a, const quant_entry_t &b) const {
+    return a.c[channel] < b.c[channel];
+  }
+};
+
+/*
+ * Reduce `entries` to at most `max_colors` colors by median cut.
+ */
+
+static unsigned
+median_cut(std::vector<quant_entry_t> &entries, unsigned max_colors, uint8_t palette[256][4]) {
+  std::vector<quant_box_t> boxes;
+  quant_box_t all = { 0, entries.size(), 0, 0 };
+  box_measure(&all, entries);
+  boxes.push_back(all);
+
+  while (boxes.size() < max_colors) {
+    size_t pick = 0;
+    for (size_t i = 1; i < boxes.size(); i++) {
+      if (boxes[i].score > boxes[pick].score) pick = i;
+    }
+    quant_box_t box = boxes[pick];
+    if (box.score <= 0) break;
+
+    entry_less less = { box.channel };
+    std::sort(entries.begin() + box.begin, entries.begin() + box.end, less);
+
+    uint64_t total = 0, half = 0;
+    for (size_t i = box.begin; i < box.end; i++) total += entries[i].count;
+    size_t split = box.begin;
+    while (split < box.end - 1 && (half += entries[split].count) * 2 < total) split++;
+    split++;
+    if (split >= box.end) split = box.end - 1;
+
+    quant_box_t lo = { box.begin, split, 0, 0 };
+    quant_box_t hi = { split, box.end, 0, 0 };
+    box_measure(&lo, entries);
+    box_measure(&hi, entries);
+    boxes[pick] = lo;
+    boxes.push_back(hi);
+  }
+
+  for (size_t b = 0; b < boxes.size(); b++) {
+    double n = 0, sum[4] = { 0, 0, 0, 0 };
+    for (size_t i = boxes[b].begin; i < boxes[b].end; i++) {
+      n += entries[i].count;
+      for (int c = 0; c < 4; c++) sum[c] += entries[i].count * entries[i].c[c];
+    }
+    for (int c = 0; c < 4; c++) palette[b][c] = (uint8_t) (sum[c] / n + 0.5);
+  }
+  return boxes.size();
+}
+
+/*
+ * Move translucent entries to the front of the palette.
+ */
+
+static unsigned
+partition_translucent(uint8_t palette[256][4], unsigned count) {
+  uint8_t sorted[256][4];
+  unsigned n = 0;
+  for (unsigned i = 0; i < count; i++) {
+    if (palette[i][3] < 255) memcpy(sorted[n++], palette[i], 4);
+  }
+  unsigned translucent = n;
+  for (unsigned i = 0; i < count; i++) {
+    if (palette[i][3] == 255) memcpy(sorted[n++], palette[i], 4);
+  }
+  memcpy(palette, sorted, count * 4);
+  return translucent;
+}
+
+palette_quantizer_t *
+palette_quantizer_create(const uint8_t *data, int width, int height, int stride, bool alpha, unsigned max_colors, bool dither) {
+  if (width <= 0 || height <= 0) return NULL;
+  if (max_colors < 2) max_colors = 2;
+  if (max_colors > 256) max_colors = 256;
+
+  palette_quantizer_t *q = new (std::nothrow) palette_quantizer_t;
+  if (!q) return NULL;
+
+  try {
+    q->width = width;
+    q->alpha = alpha;
+    q->dither = dither;
+    q->exact = true;
+    q->row = 0;
+    q->rgba.resize((size_t) width * 4);
+    memset(q->exact_index, -1, sizeof(q->exact_index));
+
+    std::vector<uint32_t> counts(QUANT_BINS);
+    std::vector<uint32_t> sums((size_t) QUANT_BINS * 4);
+    uint32_t exact[256];
+    unsigned exact_count = 0;
+
+    size_t pixels = (size_t) width * height;
+    int step = pixels > QUANT_SAMPLES ? (int) ((pixels + QUANT_SAMPLES - 1) / QUANT_SAMPLES) : 1;
+
+    for (int y = 0; y < height; y += step) {
+      load_row(q, data + (size_t) y * stride);
+      const uint8_t *p = &q->rgba[0];
+      for (int x = 0; x < width; x++, p += 4) {
+        uint32_t b = bin_of(p);
+        counts[b]++;
+        for (int c = 0; c < 4; c++) sums[b * 4 + c] += p[c];
+
+        if (q->exact) {
+          uint32_t key = key_of(p);
+          if (exact_find(q, key) < 0) {
+            if (exact_count == max_colors) {
+              q->exact = false;
+            } else {
+              exact[exact_count] = key;
+              exact_insert(q, key, exact_count++);
+            }
+          }
+        }
+      }
+    }
+
+    if (q->exact) {
+      q->count = exact_count;
+      for (unsigned i = 0; i < exact_count; i++) memcpy(q->palette[i], &exact[i], 4);
+    } else {
+      std::vector<quant_entry_t> entries;
+      for (uint32_t b = 0; b < QUANT_BINS; b++) {
+        if (!counts[b]) continue;
+        quant_entry_t e;
+        e.count = counts[b];
+        for (int c = 0; c < 4; c++) e.c[c] = (float) sums[b * 4 + c] / counts[b];
+        entries.push_back(e);
+      }
+      q->count = median_cut(entries, max_colors, q->palette);
+    }
+
+    q->translucent = partition_translucent(q->palette, q->count);
+
+    // Rebuild the exact table against the final palette order
+    memset(q->exact_index, -1, sizeof(q->exact_index));
+    if (q->exact) {
+      for (unsigned i = 0; i < q->count; i++) exact_insert(q, key_of(q->palette[i]), i);
+    }
+
+    q->cache.assign(QUANT_BINS, QUANT_UNKNOWN);
+    if (q->dither && !q->exact) q->error.assign((size_t) (width + 2) * 3 * 2, 0);
+  } catch (const std::bad_alloc &) {
+    delete q;
+    return NULL;
+  }
+
+  return q;
+}
+
+void
+palette_quantizer_destroy(palette_quantizer_t *q) {
+  delete q;
+}
+
+unsigned
+palette_quantizer_colors(palette_quantizer_t *q) {
+  return q->count;
+}
+
+unsigned
+palette_quantizer_translucent(palette_quantizer_t *q) {
+  return q->translucent;
+}
+
+const uint8_t *
+palette_quantizer_color(palette_quantizer_t *q, unsigned i) {
+  return q->palette[i];
+}
+
+/*
+ * Index of the palette entry closest to `p`.
+ */
+
+static unsigned
+nearest(palette_quantizer_t *q, const uint8_t *p) {
+  unsigned best = 0;
+  int best_dist = 0x7fffffff;
+  for (unsigned i = 0; i < q->count; i++) {
+    const uint8_t *e = q->palette[i];
+    int dr = p[0] - e[0], dg = p[1] - e[1], db = p[2] - e[2], da = p[3] - e[3];
+    int dist = dr * dr + dg * dg + db * db + da * da;
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = i;
+    }
+  }
+  return best;
+}
+
+static inline unsigned
+lookup(palette_quantizer_t *q, const uint8_t *p) {
+  if (q->exact) {
+    int i = exact_find(q, key_of(p));
+    if (i >= 0) return i;
+  }
+  uint32_t b = bin_of(p);
+  if (q->cache[b] == QUANT_UNKNOWN) q->cache[b] = nearest(q, p);
+  return q->cache[b];
+}
+
+static inline uint8_t
+clamp(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+void
+palette_quantizer_map_row(palette_quantizer_t *q, const uint8_t *row, uint8_t *indices) {
+  load_row(q, row);
+  const uint8_t *p = &q->rgba[0];
+  int w = q->width;
+
+  if (q->error.empty()) {
+    for (int x = 0; x < w; x++, p += 4) indices[x] = lookup(q, p);
+    return;
+  }
+
+  // Floyd-Steinberg on the color channels, errors kept in 16ths
+  size_t len = (size_t) (w + 2) * 3;
+  int *cur = &q->error[(q->row & 1) * len];
+  int *next = &q->error[((q->row + 1) & 1) * len];
+  memset(next, 0, len * sizeof(int));
+  q->row++;
+
+  for (int x = 0; x < w; x++, p += 4) {
+    if (!p[3]) {
+      indices[x] = lookup(q, p);
+      continue;
+    }
+
+    uint8_t v[4];
+    for (int c = 0; c < 3; c++) v[c] = clamp(p[c] + cur[(x + 1) * 3 + c] / 16);
+    v[3] = p[3];
+
+    unsigned i = lookup(q, v);
+    indices[x] = i;
+    for (int c = 0; c < 3; c++) {
+      int err = v[c] - q->palette[i][c];
+      cur[(x + 2) * 3 + c] += err * 7;
+      next[x * 3 + c] += err * 3;
+      next[(x + 1) * 3 + c] += err * 5;
+      next[(x + 2) * 3 + c] += err;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+//
+// quantize.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_QUANTIZE_H__
+#define __NODE_QUANTIZE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Palette quantizer for indexed PNG output. The palette is built from
+ * a histogram of (a sample of) the image: when the image has no more
+ * distinct colors than allowed they are used as they are, otherwise
+ * the histogram is reduced by median cut. Rows are then mapped to
+ * palette indices in order, optionally with Floyd-Steinberg dithering.
+ *
+ * Pixels are cairo ARGB32 (premultiplied) or, without `alpha`, RGB24.
+ * Palette entries are straight RGBA, the translucent ones first so
+ * that a PNG tRNS chunk can stop after them.
+ */
+
+typedef struct palette_quantizer palette_quantizer_t;
+
+palette_quantizer_t *
+palette_quantizer_create(const uint8_t *data, int width, int height, int stride, bool alpha, unsigned max_colors, bool dither);
+
+void
+palette_quantizer_destroy(palette_quantizer_t *q);
+
+/*
+ * Number of palette entries, and of those with alpha below 255.
+ */
+
+unsigned
+palette_quantizer_colors(palette_quantizer_t *q);
+
+unsigned
+palette_quantizer_translucent(palette_quantizer_t *q);
+
+/*
+ * The RGBA bytes of palette entry `i`.
+ */
+
+const uint8_t *
+palette_quantizer_color(palette_quantizer_t *q, unsigned i);
+
+/*
+ * Map the next row to one palette index per pixel.
+ */
+
+void
+palette_quantizer_map_row(palette_quantizer_t *q, const uint8_t *row, uint8_t *indices);
+
+#endif /* __NODE_QUANTIZE_H__ */
@@ -0,0 +1,53 @@
+//
+// scale.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "scale.h"
+#include <algorithm>
+#include <vector>
+
+void
+argb32_downscale(
+    const uint8_t *src, int src_width, int src_height, int src_stride
+  , uint8_t *dst, int dst_width, int dst_height, int dst_stride) {
+  // Source columns [x0[x], x0[x + 1]) make up destination column x
+  std::vector<int> x0(dst_width + 1);
+  for (int x = 0; x <= dst_width; x++) {
+    x0[x] = (int) ((int64_t) x * src_width / dst_width);
+  }
+  std::vector<uint64_t> sums((size_t) dst_width * 4);
+
+  for (int y = 0; y < dst_height; y++) {
+    int y0 = (int) ((int64_t) y * src_height / dst_height);
+    int y1 = (int) ((int64_t) (y + 1) * src_height / dst_height);
+    if (y1 <= y0) y1 = y0 + 1;
+
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int sy = y0; sy < y1; sy++) {
+      const uint8_t *row = src + (size_t) sy * src_stride;
+      uint64_t *sum = &sums[0];
+      for (int x = 0; x < dst_width; x++, sum += 4) {
+        uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for (const uint8_t *p = row + x0[x] * 4, *end = row + x0[x + 1] * 4; p < end; p += 4) {
+          s0 += p[0];
+          s1 += p[1];
+          s2 += p[2];
+          s3 += p[3];
+        }
+        sum[0] += s0;
+        sum[1] += s1;
+        sum[2] += s2;
+        sum[3] += s3;
+      }
+    }
+
+    uint8_t *out = dst + (size_t) y * dst_stride;
+    const uint64_t *sum = &sums[0];
+    for (int x = 0; x < dst_width; x++, sum += 4, out += 4) {
+      uint64_t area = (uint64_t) (x0[x + 1] - x0[x]) * (y1 - y0);
+      for (int c = 0; c < 4; c++) out[c] = (uint8_t) ((sum[c] + area / 2) / area);
+    }
+  }
+}
@@ -0,0 +1,24 @@
+//
+// scale.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_SCALE_H__
+#define __NODE_SCALE_H__
+
+#include <stdint.h>
+
+/*
+ * Downscale 32-bit pixels by averaging the box of source pixels each
+ * destination pixel covers. Every byte is averaged on its own, which
+ * is right for premultiplied ARGB32 and for RGB24. The destination
+ * must not be larger than the source in either direction.
+ */
+
+void
+argb32_downscale(
+    const uint8_t *src, int src_width, int src_height, int src_stride
+  , uint8_t *dst, int dst_width, int dst_height, int dst_stride);
+
+#endif /* __NODE_SCALE_H__ */
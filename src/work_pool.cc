@@ -0,0 +1,322 @@
+//
+// work_pool.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "work_pool.h"
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+
+#define WORK_POOL_ENCODE_THREADS 4
+#define WORK_POOL_DECODE_THREADS 2
+
+typedef struct {
+  uv_work_t *req;
+  uv_work_cb work_cb;
+  uv_after_work_cb after_cb;
+} work_item_t;
+
+typedef struct {
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  std::deque<work_item_t> queue;
+  std::vector<uv_thread_t> exited;
+  unsigned threads;
+  unsigned running;
+  unsigned idle;
+  unsigned depth;
+} work_lane_state_t;
+
+/*
+ * Work shared by work_pool_share(). The caller and every queued helper
+ * hold a reference, the last one out freeing it. Helpers that start
+ * once the caller is done return straight away.
+ */
+
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  unsigned refs;
+  unsigned active;
+  bool closed;
+} work_share_t;
+
+static bool initialized = false;
+static work_lane_state_t lanes[WORK_LANE_COUNT];
+
+// Finished work waiting for its after callback
+static uv_async_t done_async;
+static uv_mutex_t done_mutex;
+static std::vector<work_item_t> done;
+static unsigned outstanding = 0;
+
+static unsigned
+env_unsigned(const char *name, unsigned fallback) {
+  const char *value = getenv(name);
+  if (!value || !*value) return fallback;
+  char *end;
+  unsigned long n = strtoul(value, &end, 10);
+  return *end ? fallback : (unsigned) n;
+}
+
+/*
+ * Run the after callbacks of finished work, and reap the threads that
+ * exited after the lane was shrunk.
+ */
+
+static void
+work_pool_done(uv_async_t *handle) {
+  (void) handle;
+  std::vector<work_item_t> finished;
+  uv_mutex_lock(&done_mutex);
+  finished.swap(done);
+  uv_mutex_unlock(&done_mutex);
+
+  for (size_t i = 0; i < finished.size(); i++) {
+    outstanding--;
+    finished[i].after_cb(finished[i].req, 0);
+  }
+
+  for (int i = 0; i < WORK_LANE_COUNT; i++) {
+    std::vector<uv_thread_t> exited;
+    uv_mutex_lock(&lanes[i].mutex);
+    exited.swap(lanes[i].exited);
+    uv_mutex_unlock(&lanes[i].mutex);
+    for (size_t j = 0; j < exited.size(); j++) uv_thread_join(&exited[j]);
+  }
+
+  // Only keep the process alive while work is outstanding
+  if (!outstanding) uv_unref((uv_handle_t *) &done_async);
+}
+
+static void
+work_pool_init() {
+  if (initialized) return;
+  initialized = true;
+
+  unsigned depth = env_unsigned("CANVAS_QUEUE_DEPTH", 0);
+  for (int i = 0; i < WORK_LANE_COUNT; i++) {
+    work_lane_state_t *lane = &lanes[i];
+    uv_mutex_init(&lane->mutex);
+    uv_cond_init(&lane->cond);
+    lane->running = lane->idle = 0;
+    lane->depth = depth;
+  }
+  lanes[WORK_LANE_ENCODE].threads = env_unsigned("CANVAS_ENCODE_THREADS", WORK_POOL_ENCODE_THREADS);
+  lanes[WORK_LANE_DECODE].threads = env_unsigned("CANVAS_DECODE_THREADS", WORK_POOL_DECODE_THREADS);
+  for (int i = 0; i < WORK_LANE_COUNT; i++) {
+    if (!lanes[i].threads) lanes[i].threads = 1;
+  }
+
+  uv_mutex_init(&done_mutex);
+  uv_async_init(uv_default_loop(), &done_async, work_pool_done);
+  uv_unref((uv_handle_t *) &done_async);
+}
+
+static void
+work_pool_worker(void *arg) {
+  work_lane_state_t *lane = (work_lane_state_t *) arg;
+
+  uv_mutex_lock(&lane->mutex);
+  for (;;) {
+    while (lane->queue.empty() && lane->running <= lane->threads) {
+      lane->idle++;
+      uv_cond_wait(&lane->cond, &lane->mutex);
+      lane->idle--;
+    }
+    if (lane->running > lane->threads) break;
+
+    work_item_t item = lane->queue.front();
+    lane->queue.pop_front();
+    uv_mutex_unlock(&lane->mutex);
+
+    item.work_cb(item.req);
+
+    if (item.after_cb) {
+      uv_mutex_lock(&done_mutex);
+      done.push_back(item);
+      uv_mutex_unlock(&done_mutex);
+      uv_async_send(&done_async);
+    }
+
+    uv_mutex_lock(&lane->mutex);
+  }
+
+  lane->running--;
+  lane->exited.push_back(uv_thread_self());
+  uv_mutex_unlock(&lane->mutex);
+  uv_async_send(&done_async);
+}
+
+void
+work_pool_set_threads(work_lane_t lane, unsigned threads) {
+  work_pool_init();
+  work_lane_state_t *state = &lanes[lane];
+  uv_mutex_lock(&state->mutex);
+  state->threads = threads ? threads : 1;
+  uv_cond_broadcast(&state->cond);
+  uv_mutex_unlock(&state->mutex);
+}
+
+unsigned
+work_pool_threads(work_lane_t lane) {
+  work_pool_init();
+  return lanes[lane].threads;
+}
+
+void
+work_pool_set_queue_depth(work_lane_t lane, unsigned depth) {
+  work_pool_init();
+  lanes[lane].depth = depth;
+}
+
+unsigned
+work_pool_queue_depth(work_lane_t lane) {
+  work_pool_init();
+  return lanes[lane].depth;
+}
+
+bool
+work_pool_full(work_lane_t lane) {
+  work_pool_init();
+  work_lane_state_t *state = &lanes[lane];
+  if (!state->depth) return false;
+  uv_mutex_lock(&state->mutex);
+  bool full = state->queue.size() >= state->depth;
+  uv_mutex_unlock(&state->mutex);
+  return full;
+}
+
+void
+work_pool_queue(work_lane_t lane, uv_work_t *req, uv_work_cb work_cb, uv_after_work_cb after_cb) {
+  work_pool_init();
+  work_lane_state_t *state = &lanes[lane];
+  work_item_t item = { req, work_cb, after_cb };
+
+  if (!outstanding++) uv_ref((uv_handle_t *) &done_async);
+
+  uv_mutex_lock(&state->mutex);
+  state->queue.push_back(item);
+  // Start another thread when none is waiting for work
+  if (state->idle < state->queue.size() && state->running < state->threads) {
+    uv_thread_t tid;
+    if (!uv_thread_create(&tid, work_pool_worker, state)) state->running++;
+  }
+  uv_cond_signal(&state->cond);
+  uv_mutex_unlock(&state->mutex);
+
+  // Without any thread, which only happens when none can be created,
+  // do the work here rather than never
+  uv_mutex_lock(&state->mutex);
+  bool orphaned = !state->running;
+  if (orphaned) state->queue.pop_back();
+  uv_mutex_unlock(&state->mutex);
+  if (orphaned) {
+    work_cb(req);
+    uv_mutex_lock(&done_mutex);
+    done.push_back(item);
+    uv_mutex_unlock(&done_mutex);
+    uv_async_send(&done_async);
+  }
+}
+
+/*
+ * Drop a reference to `share`, freeing it with the last one. Called
+ * with its mutex held, which is released.
+ */
+
+static void
+work_share_release(work_share_t *share) {
+  bool last = !--share->refs;
+  uv_mutex_unlock(&share->mutex);
+  if (!last) return;
+  uv_mutex_destroy(&share->mutex);
+  uv_cond_destroy(&share->cond);
+  delete share;
+}
+
+static void
+work_share_help(uv_work_t *req) {
+  work_share_t *share = (work_share_t *) req->data;
+  delete req;
+
+  uv_mutex_lock(&share->mutex);
+  if (!share->closed) {
+    share->active++;
+    uv_mutex_unlock(&share->mutex);
+    share->fn(share->arg);
+    uv_mutex_lock(&share->mutex);
+    share->active--;
+    uv_cond_signal(&share->cond);
+  }
+  work_share_release(share);
+}
+
+void
+work_pool_share(work_lane_t lane, unsigned helpers, void (*fn)(void *), void *arg) {
+  work_pool_init();
+  work_lane_state_t *state = &lanes[lane];
+  work_share_t *share = helpers ? new work_share_t : NULL;
+
+  if (share) {
+    share->fn = fn;
+    share->arg = arg;
+    share->refs = 1;
+    share->active = 0;
+    share->closed = false;
+    if (uv_mutex_init(&share->mutex)) {
+      delete share;
+      share = NULL;
+    } else if (uv_cond_init(&share->cond)) {
+      uv_mutex_destroy(&share->mutex);
+      delete share;
+      share = NULL;
+    }
+  }
+
+  if (share) {
+    uv_mutex_lock(&state->mutex);
+    // More would only ever find the work gone
+    if (helpers > state->threads) helpers = state->threads;
+    for (unsigned i = 0; i < helpers; i++) {
+      uv_work_t *req = new uv_work_t;
+      req->data = share;
+      work_item_t item = { req, work_share_help, NULL };
+      state->queue.push_front(item);
+      share->refs++;
+      if (state->idle < state->queue.size() && state->running < state->threads) {
+        uv_thread_t tid;
+        if (!uv_thread_create(&tid, work_pool_worker, state)) state->running++;
+      }
+    }
+    uv_cond_broadcast(&state->cond);
+    uv_mutex_unlock(&state->mutex);
+  }
+
+  fn(arg);
+  if (!share) return;
+
+  // Take back the helpers no thread has picked up
+  unsigned unclaimed = 0;
+  uv_mutex_lock(&state->mutex);
+  for (std::deque<work_item_t>::iterator it = state->queue.begin(); it != state->queue.end(); ) {
+    if (it->work_cb == work_share_help && it->req->data == share) {
+      delete it->req;
+      it = state->queue.erase(it);
+      unclaimed++;
+    } else {
+      ++it;
+    }
+  }
+  uv_mutex_unlock(&state->mutex);
+
+  uv_mutex_lock(&share->mutex);
+  share->refs -= unclaimed;
+  share->closed = true;
+  while (share->active) uv_cond_wait(&share->cond, &share->mutex);
+  work_share_release(share);
+}
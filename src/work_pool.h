@@ -0,0 +1,78 @@
+//
+// work_pool.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_WORK_POOL_H__
+#define __NODE_WORK_POOL_H__
+
+#include <uv.h>
+
+/*
+ * Threads owned by canvas for encoding and decoding, so that long
+ * encodes do not hold up the fs and dns work sharing libuv's default
+ * thread pool. Each lane has its own threads and queue. Work is
+ * queued like with uv_queue_work(), and the after callback runs on
+ * the default loop. All functions but work_pool_share() are main
+ * thread only.
+ *
+ * Threads are started as work arrives. The defaults can be set at
+ * startup with CANVAS_ENCODE_THREADS, CANVAS_DECODE_THREADS and
+ * CANVAS_QUEUE_DEPTH.
+ */
+
+typedef enum {
+  WORK_LANE_ENCODE,
+  WORK_LANE_DECODE,
+  WORK_LANE_COUNT
+} work_lane_t;
+
+/*
+ * Number of threads of `lane`, at least 1. Shrinking lets threads
+ * finish what they are doing before they exit.
+ */
+
+void
+work_pool_set_threads(work_lane_t lane, unsigned threads);
+
+unsigned
+work_pool_threads(work_lane_t lane);
+
+/*
+ * Most requests allowed to wait in a lane's queue, 0 for no limit.
+ */
+
+void
+work_pool_set_queue_depth(work_lane_t lane, unsigned depth);
+
+unsigned
+work_pool_queue_depth(work_lane_t lane);
+
+/*
+ * Whether a lane's queue is at its depth. Callers check before
+ * queueing work that may be turned down.
+ */
+
+bool
+work_pool_full(work_lane_t lane);
+
+void
+work_pool_queue(work_lane_t lane, uv_work_t *req, uv_work_cb work_cb, uv_after_work_cb after_cb);
+
+/*
+ * Run `fn(arg)` on the calling thread and on up to `helpers` threads of
+ * `lane` as they come free, returning once every call has returned.
+ * Each call claims pieces of the work itself until none is left, so
+ * the work gets done whether or not any helper starts; the caller never
+ * waits for a helper that has not. That makes it safe to call from
+ * work running on the lane, with every thread busy. Helpers jump the
+ * lane's queue, have no after callback, and are taken back out of it
+ * once the caller is done. Safe from any thread, though the pool has
+ * to be first used from the main thread.
+ */
+
+void
+work_pool_share(work_lane_t lane, unsigned helpers, void (*fn)(void *), void *arg);
+
+#endif /* __NODE_WORK_POOL_H__ */
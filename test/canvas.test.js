@@ -384,6 +384,583 @@ describe('Canvas', function () {
     });
   });
 
+  it('Canvas#toBuffer("image/png") with threads', function (done) {
+    var canvas = new Canvas(600, 600)
+      , ctx = canvas.getContext('2d')
+      , grad = ctx.createLinearGradient(0, 0, 600, 600);
+    grad.addColorStop(0, 'rgba(255, 0, 0, 0.5)');
+    grad.addColorStop(1, 'rgba(0, 0, 255, 1)');
+    ctx.fillStyle = grad;
+    ctx.fillRect(0, 0, 600, 600);
+
+    function pixels(buf) {
+      var img = new Canvas.Image;
+      img.src = buf;
+      var out = new Canvas(600, 600).getContext('2d');
+      out.drawImage(img, 0, 0);
+      return out.getImageData(0, 0, 600, 600).data;
+    }
+
+    var expected = pixels(canvas.toBuffer());
+    var buf = canvas.toBuffer('image/png', {threads: 4});
+    assert.equal('PNG', buf.slice(1,4).toString());
+    assert.deepEqual(pixels(buf), expected);
+
+    canvas.toBuffer('image/png', {threads: 0, compressionLevel: 1}, function (err, buf) {
+      assert.ok(!err);
+      assert.deepEqual(pixels(buf), expected);
+      done();
+    });
+  });
+
+  it('Canvas#toBuffer("image/png") with threads filters as libpng does', function () {
+    var canvas = new Canvas(300, 200)
+      , ctx = canvas.getContext('2d')
+      , grad = ctx.createLinearGradient(0, 0, 300, 200);
+    grad.addColorStop(0, 'rgba(255, 0, 0, 0.5)');
+    grad.addColorStop(1, 'rgba(0, 0, 255, 1)');
+    ctx.fillStyle = grad;
+    ctx.fillRect(0, 0, 300, 200);
+    ctx.fillStyle = '#0a0';
+    ctx.fillRect(40, 40, 100, 60);
+    ctx.font = '30px sans-serif';
+    ctx.fillText('filters', 150, 150);
+
+    // The filter type byte of each row
+    function filterTypes(png) {
+      var idat = [];
+      for (var pos = 8; pos < png.length; pos += png.readUInt32BE(pos) + 12) {
+        if (png.toString('ascii', pos + 4, pos + 8) === 'IDAT') {
+          idat.push(png.slice(pos + 8, pos + 8 + png.readUInt32BE(pos)));
+        }
+      }
+      var rows = require('zlib').inflateSync(Buffer.concat(idat))
+        , channels = { 0: 1, 2: 3, 4: 2, 6: 4 }[png[25]]
+        , rowbytes = Math.ceil(png.readUInt32BE(16) * channels * png[24] / 8)
+        , types = [];
+      for (var offset = 0; offset < rows.length; offset += rowbytes + 1) {
+        types.push(rows[offset]);
+      }
+      return types;
+    }
+
+    [ canvas.PNG_NO_FILTERS
+    , 2
+    , canvas.PNG_FILTER_NONE
+    , canvas.PNG_FILTER_SUB
+    , canvas.PNG_FILTER_UP | canvas.PNG_FILTER_PAETH
+    , canvas.PNG_ALL_FILTERS
+    ].forEach(function (filters) {
+      var expected = filterTypes(canvas.toBuffer('image/png', {filters: filters, threads: 1}));
+      assert.deepEqual(filterTypes(canvas.toBuffer('image/png', {filters: filters, threads: 4})), expected);
+    });
+  });
+
+  it('Canvas#toBuffer() with a PNG timeBudget', function (done) {
+    var canvas = new Canvas(300, 300)
+      , ctx = canvas.getContext('2d');
+    ctx.fillStyle = '#a00';
+    ctx.fillRect(20, 20, 200, 100);
+    ctx.fillText('budget', 50, 200);
+
+    function pixels(buf) {
+      var img = new Canvas.Image;
+      img.src = buf;
+      var out = new Canvas(300, 300).getContext('2d');
+      out.drawImage(img, 0, 0);
+      return out.getImageData(0, 0, 300, 300).data;
+    }
+
+    var expected = pixels(canvas.toBuffer());
+
+    assert.deepEqual(pixels(canvas.toBuffer('image/png', {timeBudget: 50})), expected);
+
+    assert.throws(function () {
+      canvas.toBuffer('image/png', {timeBudget: 0});
+    }, RangeError);
+    assert.throws(function () {
+      canvas.toBuffer('image/png', {timeBudget: -1});
+    }, RangeError);
+
+    canvas.toBuffer('image/png', {timeBudget: 1, threads: 2}, function (err, buf) {
+      assert.ok(!err);
+      assert.deepEqual(pixels(buf), expected);
+      done();
+    });
+  });
+
+  it('Canvas#toBuffer() with PNG maxCompression', function (done) {
+    var canvas = new Canvas(120, 80)
+      , ctx = canvas.getContext('2d');
+    var grad = ctx.createLinearGradient(0, 0, 120, 0);
+    grad.addColorStop(0, '#fff');
+    grad.addColorStop(1, 'rgba(0,0,200,0.5)');
+    ctx.fillStyle = grad;
+    ctx.fillRect(0, 0, 120, 80);
+    ctx.fillStyle = '#000';
+    ctx.fillText('sprite', 10, 40);
+
+    function pixels(buf) {
+      var img = new Canvas.Image;
+      img.src = buf;
+      var out = new Canvas(120, 80).getContext('2d');
+      out.drawImage(img, 0, 0);
+      return out.getImageData(0, 0, 120, 80).data;
+    }
+
+    var expected = pixels(canvas.toBuffer());
+    var level9 = canvas.toBuffer('image/png', {compressionLevel: 9});
+    var small = canvas.toBuffer('image/png', {maxCompression: true});
+    assert.equal('PNG', small.slice(1,4).toString());
+    assert.ok(small.length <= level9.length);
+    assert.deepEqual(pixels(small), expected);
+
+    canvas.toBuffer('image/png', {maxCompression: true, threads: 3}, function (err, buf) {
+      assert.ok(!err);
+      assert.equal(buf.toString('hex'), small.toString('hex'));
+      done();
+    });
+  });
+
+  it('Canvas#toBuffer() picks the smallest lossless PNG color type', function () {
+    function check(fill, colorType, bitDepth) {
+      var canvas = new Canvas(64, 64)
+        , ctx = canvas.getContext('2d');
+      fill(ctx);
+      var expected = ctx.getImageData(0, 0, 64, 64).data;
+      [1, 4].forEach(function (threads) {
+        var buf = canvas.toBuffer('image/png', {threads: threads});
+        assert.equal(buf[25], colorType);
+        assert.equal(buf[24], bitDepth);
+        var img = new Canvas.Image;
+        img.src = buf;
+        var out = new Canvas(64, 64).getContext('2d');
+        out.drawImage(img, 0, 0);
+        assert.deepEqual(out.getImageData(0, 0, 64, 64).data, expected);
+      });
+    }
+
+    check(function (ctx) {}, 4, 8);
+    check(function (ctx) {
+      ctx.fillStyle = 'rgba(0, 128, 255, 0.5)';
+      ctx.fillRect(0, 0, 32, 64);
+    }, 6, 8);
+    check(function (ctx) {
+      ctx.fillStyle = '#08f';
+      ctx.fillRect(0, 0, 64, 64);
+    }, 2, 8);
+    check(function (ctx) {
+      ctx.fillStyle = '#777';
+      ctx.fillRect(0, 0, 64, 64);
+      ctx.fillStyle = '#333';
+      ctx.fillRect(0, 0, 10, 10);
+    }, 0, 4);
+    check(function (ctx) {
+      ctx.fillStyle = '#fff';
+      ctx.fillRect(0, 0, 64, 64);
+      ctx.fillStyle = '#000';
+      ctx.fillRect(0, 0, 10, 10);
+    }, 0, 1);
+    check(function (ctx) {
+      var grad = ctx.createLinearGradient(0, 0, 64, 0);
+      grad.addColorStop(0, '#000');
+      grad.addColorStop(1, '#fff');
+      ctx.fillStyle = grad;
+      ctx.fillRect(0, 0, 64, 64);
+    }, 0, 8);
+  });
+
+  describe('PNG palette', function () {
+    function pixels(buf, w, h) {
+      var img = new Canvas.Image;
+      img.src = buf;
+      var out = new Canvas(w, h).getContext('2d');
+      out.drawImage(img, 0, 0);
+      return out.getImageData(0, 0, w, h).data;
+    }
+
+    it('stores few colors losslessly as an indexed PNG', function (done) {
+      var canvas = new Canvas(200, 200)
+        , ctx = canvas.getContext('2d');
+      ctx.fillStyle = '#f00';
+      ctx.fillRect(0, 0, 100, 200);
+      ctx.fillStyle = 'rgba(0, 0, 255, 0.5)';
+      ctx.fillRect(100, 0, 100, 100);
+
+      var truecolor = canvas.toBuffer();
+      var buf = canvas.toBuffer('image/png', {palette: true});
+      assert.equal(buf[25], 3); // IHDR color type
+      assert.ok(buf.length < truecolor.length);
+      assert.deepEqual(pixels(buf, 200, 200), pixels(truecolor, 200, 200));
+
+      canvas.toBuffer('image/png', {palette: {maxColors: 4}}, function (err, async) {
+        assert.ok(!err);
+        assert.equal(async[24], 2); // bit depth
+        assert.deepEqual(pixels(async, 200, 200), pixels(truecolor, 200, 200));
+        done();
+      });
+    });
+
+    it('quantizes to at most maxColors', function () {
+      var canvas = new Canvas(256, 64)
+        , ctx = canvas.getContext('2d')
+        , grad = ctx.createLinearGradient(0, 0, 256, 0);
+      grad.addColorStop(0, '#f00');
+      grad.addColorStop(0.5, '#0f0');
+      grad.addColorStop(1, '#00f');
+      ctx.fillStyle = grad;
+      ctx.fillRect(0, 0, 256, 64);
+
+      [false, true].forEach(function (dither) {
+        var data = pixels(canvas.toBuffer('image/png', {palette: {maxColors: 16, dither: dither}}), 256, 64)
+          , colors = {};
+        for (var i = 0; i < data.length; i += 4) {
+          colors[data[i] + ',' + data[i + 1] + ',' + data[i + 2]] = true;
+        }
+        assert.ok(Object.keys(colors).length <= 16);
+      });
+    });
+
+    it('rejects invalid options', function () {
+      var canvas = new Canvas(10, 10);
+      assert.throws(function () { canvas.toBuffer('image/png', {palette: {maxColors: 1}}); }, RangeError);
+      assert.throws(function () { canvas.toBuffer('image/png', {palette: {maxColors: 300}}); }, RangeError);
+      assert.throws(function () { canvas.toBuffer('image/png', {palette: 'yes'}); }, TypeError);
+    });
+  });
+
+  it('Canvas#toBuffer() unpremultiplies exactly', function () {
+    var canvas = new Canvas(256, 256)
+      , ctx = canvas.getContext('2d')
+      , imageData = ctx.createImageData(256, 256);
+    for (var i = 0; i < imageData.data.length; i += 4) {
+      imageData.data[i] = (i >> 2) & 255;
+      imageData.data[i + 1] = 255 - ((i >> 2) & 255);
+      imageData.data[i + 2] = (i >> 3) & 255;
+      imageData.data[i + 3] = i >> 10;
+    }
+    ctx.putImageData(imageData, 0, 0);
+
+    // Stored, unfiltered: the inflated IDAT data is the rows as written
+    var png = canvas.toBuffer(undefined, 0, canvas.PNG_FILTER_NONE)
+      , idat = [];
+    for (var pos = 8; pos < png.length; pos += png.readUInt32BE(pos) + 12) {
+      if (png.toString('ascii', pos + 4, pos + 8) === 'IDAT') {
+        idat.push(png.slice(pos + 8, pos + 8 + png.readUInt32BE(pos)));
+      }
+    }
+    var rows = require('zlib').inflateSync(Buffer.concat(idat))
+      , raw = canvas.toBuffer('raw')
+      , le = os.endianness() === 'LE';
+
+    for (var p = 0; p < 256 * 256; p++) {
+      var pixel = le ? raw.readUInt32LE(p * 4) : raw.readUInt32BE(p * 4)
+        , a = pixel >>> 24
+        , offset = (p >> 8) + 1 + p * 4
+        , expected = [16, 8, 0].map(function (shift) {
+            return a ? Math.floor((((pixel >>> shift) & 255) * 255 + (a >> 1)) / a) & 255 : 0;
+          }).concat(a);
+      assert.deepEqual(Array.prototype.slice.call(rows, offset, offset + 4), expected);
+    }
+  });
+
+  it('Canvas#toBuffer("image/jpeg")', function () {
+    var buf = new Canvas(200,200).toBuffer('image/jpeg');
+    assert.equal(buf[0], 0xff);
+    assert.equal(buf[1], 0xd8);
+    assert.equal(buf[buf.length - 2], 0xff);
+    assert.equal(buf[buf.length - 1], 0xd9);
+  });
+
+  it('Canvas#toBuffer("image/jpeg") async', function (done) {
+    var canvas = new Canvas(640, 480);
+    var chunks = [];
+    var stream = canvas.jpegStream({quality: 50});
+    stream.on('data', function (chunk) {
+      chunks.push(chunk);
+    });
+    stream.on('end', function () {
+      canvas.toBuffer('image/jpeg', {quality: 50}, function (err, buf) {
+        assert.ok(!err);
+        assert.equal(buf.toString('hex'), Buffer.concat(chunks).toString('hex'));
+        done();
+      });
+    });
+  });
+
+  it('Canvas#toBuffer("image/jpeg") encoder options', function () {
+    var canvas = new Canvas(64, 64);
+
+    function marker(buf, code) {
+      for (var i = 2; i < buf.length - 1; i += 2 + buf.readUInt16BE(i + 2)) {
+        assert.equal(buf[i], 0xff);
+        if (buf[i + 1] === code) return buf.slice(i + 4, i + 2 + buf.readUInt16BE(i + 2));
+        if (buf[i + 1] === 0xda) return null;
+      }
+      return null;
+    }
+
+    // Luma sampling factors of the first component in SOF0
+    assert.equal(marker(canvas.toBuffer('image/jpeg'), 0xc0)[7], 0x22);
+    assert.equal(marker(canvas.toBuffer('image/jpeg', {chromaSubsampling: '4:2:2'}), 0xc0)[7], 0x21);
+    assert.equal(marker(canvas.toBuffer('image/jpeg', {chromaSubsampling: false}), 0xc0)[7], 0x11);
+
+    assert.equal(marker(canvas.toBuffer('image/jpeg'), 0xdd), null);
+    var dri = marker(canvas.toBuffer('image/jpeg', {restartInterval: 2, optimizeCoding: true, dctMethod: 'float'}), 0xdd);
+    assert.equal(dri.readUInt16BE(0), 2);
+
+    assert.throws(function () {
+      canvas.toBuffer('image/jpeg', {dctMethod: 'slow'});
+    }, TypeError);
+  });
+
+  it('Canvas#toBuffer("image/jpeg") rejects invalid quality', function () {
+    assert.throws(function () {
+      new Canvas(10, 10).toBuffer('image/jpeg', {quality: 101});
+    }, RangeError);
+  });
+
+  (Canvas.webpVersion ? describe : describe.skip)('#toBuffer("image/webp")', function() {
+    var canvas = new Canvas(100, 100)
+      , ctx = canvas.getContext('2d');
+    ctx.fillStyle = 'rgba(255, 0, 0, 0.5)';
+    ctx.fillRect(10, 10, 50, 50);
+
+    function isWebP(buf) {
+      return buf.toString('ascii', 0, 4) === 'RIFF'
+        && buf.toString('ascii', 8, 12) === 'WEBP'
+        && buf.readUInt32LE(4) === buf.length - 8;
+    }
+
+    it('encodes synchronously', function() {
+      assert.ok(isWebP(canvas.toBuffer('image/webp')));
+      assert.ok(isWebP(canvas.toBuffer('image/webp', {lossless: true, method: 0})));
+    });
+
+    it('encodes asynchronously', function(done) {
+      var expected = canvas.toBuffer('image/webp', {quality: 50});
+      canvas.toBuffer('image/webp', {quality: 50}, function(err, buf) {
+        assert.ok(!err);
+        assert.equal(buf.toString('hex'), expected.toString('hex'));
+        done();
+      });
+    });
+
+    it('streams', function(done) {
+      var chunks = [];
+      var stream = canvas.createWebPStream({lossless: true});
+      assert.ok(stream instanceof require('stream').Readable);
+      stream.on('data', function(chunk) {
+        chunks.push(chunk);
+      });
+      stream.on('end', function() {
+        assert.ok(isWebP(Buffer.concat(chunks)));
+        done();
+      });
+      stream.on('error', done);
+    });
+
+    it('rejects invalid options', function() {
+      assert.throws(function() {
+        canvas.toBuffer('image/webp', {method: 7});
+      }, RangeError);
+      assert.throws(function() {
+        canvas.toBuffer('image/webp', {quality: 101});
+      }, RangeError);
+    });
+  });
+
+  describe('AnimationEncoder', function () {
+    function chunks(buf) {
+      var out = [];
+      for (var pos = 8; pos < buf.length; pos += 12 + buf.readUInt32BE(pos)) {
+        out.push({
+          type: buf.toString('ascii', pos + 4, pos + 8),
+          data: buf.slice(pos + 8, pos + 8 + buf.readUInt32BE(pos))
+        });
+      }
+      return out;
+    }
+
+    it('encodes changed rectangles as APNG frames', function (done) {
+      var canvas = new Canvas(100, 50)
+        , ctx = canvas.getContext('2d')
+        , anim = new Canvas.AnimationEncoder(100, 50, {loop: 2});
+
+      ctx.fillStyle = '#0f0';
+      ctx.fillRect(0, 0, 100, 50);
+      var first = ctx.getImageData(0, 0, 100, 50).data;
+      anim.addFrame(canvas, 40);
+      ctx.fillStyle = '#00f';
+      ctx.fillRect(10, 20, 30, 10);
+      anim.addFrame(canvas, 40);
+      anim.addFrame(canvas);
+
+      anim.finish(function (err, buf) {
+        assert.ifError(err);
+        assert.equal(buf.toString('hex', 0, 8), '89504e470d0a1a0a');
+
+        var list = chunks(buf);
+        var actl = list.filter(function (c) { return c.type === 'acTL'; })[0];
+        assert.equal(actl.data.readUInt32BE(0), 3);
+        assert.equal(actl.data.readUInt32BE(4), 2);
+
+        var fctl = list.filter(function (c) { return c.type === 'fcTL'; });
+        assert.equal(fctl.length, 3);
+        assert.equal(fctl[0].data.readUInt32BE(4), 100);
+        assert.equal(fctl[1].data.readUInt32BE(4), 30);
+        assert.equal(fctl[1].data.readUInt32BE(8), 10);
+        assert.equal(fctl[1].data.readUInt32BE(12), 10);
+        assert.equal(fctl[1].data.readUInt32BE(16), 20);
+        assert.equal(fctl[2].data.readUInt32BE(4), 1);
+        assert.equal(list.filter(function (c) { return c.type === 'fdAT'; }).length, 2);
+
+        // Viewers without APNG support show the first frame
+        var img = new Canvas.Image;
+        img.src = buf;
+        var out = new Canvas(100, 50).getContext('2d');
+        out.drawImage(img, 0, 0);
+        assert.deepEqual(out.getImageData(0, 0, 100, 50).data, first);
+        done();
+      });
+    });
+
+    it('calls addFrame() callbacks in order', function (done) {
+      var canvas = new Canvas(10, 10)
+        , anim = new Canvas.AnimationEncoder(10, 10)
+        , calls = [];
+      anim.addFrame(canvas, function (err) { assert.ifError(err); calls.push(1); });
+      anim.addFrame(canvas, 10, function (err) { assert.ifError(err); calls.push(2); });
+      anim.finish(function (err, buf) {
+        assert.ifError(err);
+        assert.deepEqual(calls, [1, 2]);
+        done();
+      });
+    });
+
+    it('encodes GIF when built with giflib', function (done) {
+      var canvas = new Canvas(20, 20)
+        , ctx = canvas.getContext('2d');
+      try {
+        var anim = new Canvas.AnimationEncoder(20, 20, {type: 'image/gif'});
+      } catch (err) {
+        return done();
+      }
+      ctx.fillStyle = '#f00';
+      ctx.fillRect(0, 0, 20, 20);
+      anim.addFrame(canvas, 100);
+      ctx.clearRect(5, 5, 5, 5);
+      anim.addFrame(canvas, 100);
+      anim.finish(function (err, buf) {
+        assert.ifError(err);
+        assert.equal(buf.toString('ascii', 0, 6), 'GIF89a');
+        assert.equal(buf.readUInt16LE(6), 20);
+        assert.equal(buf[buf.length - 1], 0x3b);
+        done();
+      });
+    });
+
+    it('rejects invalid frames and options', function () {
+      var anim = new Canvas.AnimationEncoder(10, 10);
+      assert.throws(function () { anim.addFrame(new Canvas(11, 10)); }, RangeError);
+      assert.throws(function () { anim.addFrame({}); }, TypeError);
+      assert.throws(function () { anim.finish(function () {}); }, /No frames/);
+      assert.throws(function () {
+        new Canvas.AnimationEncoder(10, 10, {type: 'image/bmp'});
+      }, TypeError);
+      assert.throws(function () {
+        new Canvas.AnimationEncoder(10, 10, {compressionLevel: 10});
+      }, RangeError);
+    });
+  });
+
+  describe('encode cache', function() {
+    it('reuses the encoding until the canvas is drawn to', function() {
+      var canvas = new Canvas(50, 50)
+        , ctx = canvas.getContext('2d');
+
+      ctx.fillStyle = '#f00';
+      ctx.fillRect(0, 0, 25, 25);
+      var first = canvas.toBuffer();
+      var hex = first.toString('hex');
+      first.fill(0);
+
+      var second = canvas.toBuffer();
+      assert.notStrictEqual(second, first);
+      assert.equal(second.toString('hex'), hex);
+
+      ctx.fillRect(25, 25, 25, 25);
+      assert.notEqual(canvas.toBuffer().toString('hex'), hex);
+
+      var imageData = ctx.getImageData(0, 0, 1, 1);
+      hex = canvas.toBuffer().toString('hex');
+      imageData.data[3] = 0;
+      ctx.putImageData(imageData, 0, 0);
+      assert.notEqual(canvas.toBuffer().toString('hex'), hex);
+    });
+
+    it('keys on the encoder settings', function() {
+      var canvas = new Canvas(50, 50);
+      canvas.getContext('2d').fillRect(0, 0, 25, 25);
+      var fast = canvas.toBuffer('image/png', {compressionLevel: 0});
+      var small = canvas.toBuffer('image/png', {compressionLevel: 9});
+      assert.ok(fast.length > small.length);
+      assert.equal(canvas.toBuffer('image/png', {compressionLevel: 0}).toString('hex'), fast.toString('hex'));
+    });
+
+    it('serves streams and async encodes', function(done) {
+      var canvas = new Canvas(50, 50);
+      canvas.getContext('2d').fillRect(0, 0, 25, 25);
+      var expected = canvas.toBuffer().toString('hex');
+      var chunks = [];
+      var stream = canvas.createPNGStream();
+      stream.on('data', function(chunk) {
+        chunks.push(chunk);
+      });
+      stream.on('end', function() {
+        assert.equal(Buffer.concat(chunks).toString('hex'), expected);
+        canvas.toBuffer(function(err, buf) {
+          assert.ok(!err);
+          assert.equal(buf.toString('hex'), expected);
+          done();
+        });
+      });
+      stream.on('error', done);
+    });
+  });
+
+  describe('#estimateEncodedSize()', function() {
+    it('guesses from the dimensions, then tracks the last encode', function() {
+      var canvas = new Canvas(200, 200)
+        , ctx = canvas.getContext('2d');
+
+      assert.equal(canvas.estimateEncodedSize(), 200 * 200 / 8);
+      assert.equal(canvas.estimateEncodedSize('image/png'), 200 * 200 / 8);
+
+      ctx.fillStyle = '#f00';
+      ctx.fillRect(0, 0, 100, 100);
+      var buf = canvas.toBuffer();
+      var estimate = canvas.estimateEncodedSize();
+      assert.ok(estimate >= buf.length);
+      assert.ok(estimate < 200 * 200);
+
+      canvas.width = 400;
+      assert.equal(canvas.estimateEncodedSize(), 400 * 200 / 8);
+    });
+
+    it('keeps the guess small for large canvases', function() {
+      var canvas = new Canvas(8000, 8000);
+      assert.equal(canvas.estimateEncodedSize(), 4 * 1024 * 1024);
+      assert.equal(new Canvas(10, 10).estimateEncodedSize('image/jpeg'), 4096);
+    });
+
+    it('rejects unknown types', function() {
+      assert.throws(function() {
+        new Canvas(10, 10).estimateEncodedSize('image/bmp');
+      }, TypeError);
+    });
+  });
+
   describe('#toBuffer("raw")', function() {
     var canvas = new Canvas(10, 10)
         , ctx = canvas.getContext('2d');
@@ -468,6 +1045,256 @@ describe('Canvas', function () {
     });
   });
 
+  describe('#toBuffer("raw", opts)', function() {
+    var canvas = new Canvas(10, 10)
+        , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'rgba(200, 200, 200, 0.505)';
+    ctx.fillRect(0, 0, 5, 5);
+    ctx.fillStyle = 'red';
+    ctx.fillRect(5, 0, 5, 5);
+    ctx.fillStyle = '#00ff00';
+    ctx.fillRect(0, 5, 5, 5);
+
+    function bytes(buf, offset, n) {
+      return Array.prototype.slice.call(buf, offset, offset + n);
+    }
+
+    it('exports straight RGBA', function() {
+      var buf = canvas.toBuffer('raw', {format: 'rgba'});
+      assert.equal(buf.length, 400);
+      assert.deepEqual(bytes(buf, 0, 4), [199, 199, 199, 128]);
+      assert.deepEqual(bytes(buf, 5 * 4, 4), [255, 0, 0, 255]);
+      assert.deepEqual(bytes(buf, 99 * 4, 4), [0, 0, 0, 0]);
+    });
+
+    it('exports premultiplied BGRA', function() {
+      var buf = canvas.toBuffer('raw', {format: 'bgra', premultiplied: true});
+      assert.deepEqual(bytes(buf, 0, 4), [100, 100, 100, 128]);
+      assert.deepEqual(bytes(buf, 50 * 4, 4), [0, 255, 0, 255]);
+    });
+
+    it('exports RGB', function() {
+      var buf = canvas.toBuffer('raw', {format: 'rgb'});
+      assert.equal(buf.length, 300);
+      assert.deepEqual(bytes(buf, 0, 3), [199, 199, 199]);
+      assert.deepEqual(bytes(buf, 9 * 3, 3), [255, 0, 0]);
+    });
+
+    it('exports A8', function() {
+      var buf = canvas.toBuffer('raw', {format: 'a8'});
+      assert.equal(buf.length, 100);
+      assert.deepEqual(bytes(buf, 0, 1), [128]);
+      assert.deepEqual(bytes(buf, 99, 1), [0]);
+    });
+
+    it('exports RGB565', function() {
+      var buf = canvas.toBuffer('raw', {format: 'rgb565'})
+        , read = 'readUInt16' + os.endianness();
+      assert.equal(buf.length, 200);
+      assert.equal(buf[read](5 * 2), 0xf800);
+      assert.equal(buf[read](50 * 2), 0x07e0);
+    });
+
+    it('writes into a caller supplied Buffer', function() {
+      var target = new Buffer(400);
+      assert.strictEqual(canvas.toBuffer('raw', {format: 'rgba', buffer: target}), target);
+      assert.deepEqual(bytes(target, 5 * 4, 4), [255, 0, 0, 255]);
+      assert.throws(function () {
+        canvas.toBuffer('raw', {format: 'rgba', buffer: new Buffer(399)});
+      }, RangeError);
+    });
+
+    it('rejects unknown formats', function() {
+      assert.throws(function () {
+        canvas.toBuffer('raw', {format: 'yuv'});
+      }, TypeError);
+    });
+  });
+
+  describe('.workPool()', function () {
+    var defaults;
+    before(function () { defaults = Canvas.workPool(); });
+    after(function () { Canvas.workPool(defaults); });
+
+    it('reads and sets the pool sizes', function () {
+      assert.equal(typeof defaults.encodeThreads, 'number');
+      var settings = Canvas.workPool({encodeThreads: 3, queueDepth: 7});
+      assert.equal(settings.encodeThreads, 3);
+      assert.equal(settings.decodeThreads, defaults.decodeThreads);
+      assert.equal(settings.queueDepth, 7);
+      assert.throws(function () { Canvas.workPool({encodeThreads: 0}); }, RangeError);
+      assert.throws(function () { Canvas.workPool({queueDepth: -1}); }, RangeError);
+    });
+
+    it('encodes on a single thread', function (done) {
+      Canvas.workPool({encodeThreads: 1, queueDepth: 0});
+      var canvas = new Canvas(100, 100)
+        , pending = 8;
+      for (var i = 0; i < 8; i++) {
+        canvas.getContext('2d').fillRect(i, i, 10, 10);
+        canvas.toBuffer(function (err, buf) {
+          assert.ifError(err);
+          assert.equal(buf.toString('ascii', 1, 4), 'PNG');
+          if (!--pending) done();
+        });
+      }
+    });
+
+    it('throws once the queue is full', function (done) {
+      Canvas.workPool({encodeThreads: 1, queueDepth: 1});
+      var canvas = new Canvas(1000, 1000)
+        , calls = 0;
+      function cb(err) {
+        assert.ifError(err);
+        if (!--calls) done();
+      }
+      assert.throws(function () {
+        for (var i = 0; i < 10; i++) {
+          canvas.getContext('2d').fillRect(i, i, 10, 10);
+          canvas.toBuffer('image/png', {compressionLevel: 9}, cb);
+          calls++;
+        }
+      }, /queue is full/);
+      assert(calls >= 1 && calls < 10);
+    });
+  });
+
+  describe('#toBuffers()', function () {
+    function size(buf) {
+      var img = new Canvas.Image;
+      img.src = buf;
+      return [img.width, img.height];
+    }
+
+    it('encodes every output from one call', function (done) {
+      var canvas = new Canvas(200, 100)
+        , ctx = canvas.getContext('2d');
+      ctx.fillStyle = '#0f0';
+      ctx.fillRect(0, 0, 200, 100);
+
+      canvas.toBuffers([
+        {format: 'image/png'},
+        {format: 'image/jpeg', quality: 80, width: 100},
+        {width: 50},
+        {height: 10, width: 10}
+      ], function (err, bufs) {
+        assert.ifError(err);
+        assert.equal(bufs.length, 4);
+        assert.equal(bufs[0].toString('hex'), canvas.toBuffer().toString('hex'));
+        assert.equal(bufs[1][0], 0xff);
+        assert.equal(bufs[1][1], 0xd8);
+        assert.deepEqual(size(bufs[1]), [100, 50]);
+        assert.deepEqual(size(bufs[2]), [50, 25]);
+        assert.deepEqual(size(bufs[3]), [10, 10]);
+
+        // Box downscaling keeps a solid color
+        var img = new Canvas.Image;
+        img.src = bufs[2];
+        var out = new Canvas(50, 25).getContext('2d');
+        out.drawImage(img, 0, 0);
+        assert.deepEqual(Array.prototype.slice.call(out.getImageData(20, 10, 1, 1).data), [0, 255, 0, 255]);
+        done();
+      });
+    });
+
+    it('rejects invalid specs', function () {
+      var canvas = new Canvas(20, 20);
+      assert.throws(function () { canvas.toBuffers([], function () {}); }, TypeError);
+      assert.throws(function () { canvas.toBuffers([{width: 40}], function () {}); }, RangeError);
+      assert.throws(function () { canvas.toBuffers([{format: 'image/gif'}], function () {}); }, /Unsupported/);
+      assert.throws(function () { canvas.toBuffers([{}]); }, TypeError);
+    });
+  });
+
+  describe('#toFile()', function () {
+    var path = require('path')
+      , dir = os.tmpdir();
+
+    it('writes the same PNG as toBuffer()', function (done) {
+      var canvas = new Canvas(50, 50)
+        , ctx = canvas.getContext('2d')
+        , file = path.join(dir, 'canvas-tofile-' + process.pid + '.png');
+      ctx.fillStyle = '#f0f';
+      ctx.fillRect(10, 10, 20, 20);
+      canvas.toFile(file, {fsync: true}, function (err) {
+        assert.ifError(err);
+        assert.equal(fs.readFileSync(file).toString('hex'), canvas.toBuffer().toString('hex'));
+        fs.unlinkSync(file);
+        done();
+      });
+    });
+
+    it('takes the format from options or the extension', function (done) {
+      var canvas = new Canvas(50, 50)
+        , file = path.join(dir, 'canvas-tofile-' + process.pid + '.jpg');
+      canvas.toFile(file, function (err) {
+        assert.ifError(err);
+        var buf = fs.readFileSync(file);
+        assert.equal(buf[0], 0xff);
+        assert.equal(buf[1], 0xd8);
+        canvas.toFile(file, {format: 'image/png'}, function (err) {
+          assert.ifError(err);
+          assert.equal(fs.readFileSync(file).toString('ascii', 1, 4), 'PNG');
+          fs.unlinkSync(file);
+          done();
+        });
+      });
+    });
+
+    it('writes PDF canvases', function (done) {
+      var canvas = new Canvas(50, 50, 'pdf')
+        , file = path.join(dir, 'canvas-tofile-' + process.pid + '.pdf');
+      canvas.getContext('2d').fillRect(0, 0, 10, 10);
+      canvas.toFile(file, function (err) {
+        assert.ifError(err);
+        assert.equal(fs.readFileSync(file).toString('hex'), canvas.toBuffer().toString('hex'));
+        fs.unlinkSync(file);
+        done();
+      });
+    });
+
+    it('writes PDF canvases spilled to a temp file', function (done) {
+      var canvas = new Canvas(200, 200, 'pdf', {spillThreshold: 1024})
+        , ctx = canvas.getContext('2d')
+        , file = path.join(dir, 'canvas-tofile-spilled-' + process.pid + '.pdf');
+      for (var i = 0; i < 10; i++) {
+        ctx.fillText('Page ' + i, 10, 10);
+        ctx.addPage();
+      }
+      canvas.toFile(file, function (err) {
+        assert.ifError(err);
+        var buf = canvas.toBuffer();
+        assert.equal('PDF', buf.slice(1, 4).toString());
+        assert.equal(fs.readFileSync(file).toString('hex'), buf.toString('hex'));
+        fs.unlinkSync(file);
+        done();
+      });
+    });
+
+    it('reports write errors like fs', function (done) {
+      var canvas = new Canvas(10, 10);
+      canvas.toFile(path.join(dir, 'no-such-dir-' + process.pid, 'x.png'), function (err) {
+        assert(err instanceof Error);
+        assert.equal(err.code, 'ENOENT');
+        assert.equal(err.syscall, 'open');
+        done();
+      });
+    });
+
+    it('rejects formats the canvas cannot be written as', function () {
+      assert.throws(function () {
+        new Canvas(10, 10, 'pdf').toFile('x.png', {format: 'image/png'}, function () {});
+      }, /application\/pdf/);
+      assert.throws(function () {
+        new Canvas(10, 10).toFile('x.gif', {format: 'image/gif'}, function () {});
+      }, /Unsupported format/);
+      assert.throws(function () {
+        new Canvas(10, 10).toFile('x.png');
+      }, TypeError);
+    });
+  });
+
   describe('#toDataURL()', function () {
     var canvas = new Canvas(200, 200)
       , ctx = canvas.getContext('2d');
@@ -893,6 +1720,83 @@ describe('Canvas', function () {
     });
   });
 
+  it('Canvas#createSyncPNGStream() writes what toBuffer() does', function (done) {
+    var canvas = new Canvas(64, 64)
+      , ctx = canvas.getContext('2d');
+    for (var x = 0; x < 64; x++) {
+      ctx.fillStyle = 'rgb(' + x * 4 + ', ' + (255 - x * 4) + ', 128)';
+      ctx.fillRect(x, 0, 1, 64);
+    }
+    var chunks = [];
+    var stream = canvas.createSyncPNGStream();
+    stream.on('data', function (chunk) {
+      chunks.push(new Buffer(chunk));
+    });
+    stream.on('end', function () {
+      assert.equal(Buffer.concat(chunks).toString('hex'), canvas.toBuffer().toString('hex'));
+      done();
+    });
+    stream.on('error', done);
+  });
+
+  it('Canvas#createPNGStream()', function (done) {
+    var canvas = new Canvas(20, 20);
+    var stream = canvas.createPNGStream();
+    var chunks = [];
+    var sync = true;
+    stream.on('data', function(chunk){
+      assert.ok(!sync, 'data emitted synchronously');
+      chunks.push(chunk);
+    });
+    stream.on('end', function(){
+      var buf = Buffer.concat(chunks);
+      assert.equal('PNG', buf.slice(1,4).toString());
+      assert.equal(buf.toString('hex'), canvas.toBuffer().toString('hex'));
+      done();
+    });
+    stream.on('error', function(err) {
+      done(err);
+    });
+    sync = false;
+  });
+
+  it('Canvas#createPNGStream() only encodes as it is read', function (done) {
+    var canvas = new Canvas(600, 600)
+      , ctx = canvas.getContext('2d')
+      , imageData = ctx.createImageData(600, 600);
+    for (var i = 0, seed = 1; i < imageData.data.length; i++) {
+      seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+      imageData.data[i] = (seed >> 16) & 0xff;
+    }
+    ctx.putImageData(imageData, 0, 0);
+
+    var stream = canvas.createPNGStream()
+      , read = stream.encoder.read
+      , reads = 0
+      , chunks = [];
+    stream.encoder.read = function () {
+      reads++;
+      return read.apply(this, arguments);
+    };
+    stream.once('data', function (chunk) {
+      chunks.push(chunk);
+      stream.pause();
+      setTimeout(function () {
+        var pending = reads;
+        stream.on('data', function (chunk) {
+          chunks.push(chunk);
+        });
+        stream.on('end', function () {
+          assert.ok(pending < reads, 'encoded ahead of the reader');
+          assert.equal(Buffer.concat(chunks).toString('hex'), canvas.toBuffer().toString('hex'));
+          done();
+        });
+        stream.resume();
+      }, 50);
+    });
+    stream.on('error', done);
+  });
+
   it('Canvas#createSyncPDFStream()', function (done) {
     var canvas = new Canvas(20, 20, 'pdf');
     var stream = canvas.createSyncPDFStream();
@@ -911,6 +1815,76 @@ describe('Canvas', function () {
     });
   });
 
+  it('Canvas#toBuffer() for a PDF canvas matches createSyncPDFStream()', function (done) {
+    var canvas = new Canvas(20, 20, 'pdf');
+    canvas.getContext('2d').fillRect(0, 0, 10, 10);
+    var buf = canvas.toBuffer();
+    assert.equal('PDF', buf.slice(1, 4).toString());
+    assert.strictEqual(canvas.toBuffer(), buf);
+
+    var chunks = [];
+    var stream = canvas.createSyncPDFStream();
+    stream.on('data', function (chunk) {
+      chunks.push(new Buffer(chunk));
+    });
+    stream.on('end', function () {
+      assert.equal(Buffer.concat(chunks).toString('hex'), buf.toString('hex'));
+      done();
+    });
+    stream.on('error', function (err) {
+      done(err);
+    });
+  });
+
+  it('Canvas#createPDFStream({incremental: true}) streams pages as they are added', function (done) {
+    var canvas = new Canvas(200, 200, 'pdf')
+      , ctx = canvas.getContext('2d')
+      , stream = canvas.createPDFStream({incremental: true})
+      , chunks = [];
+    stream.on('data', function (chunk) {
+      chunks.push(chunk);
+    });
+    stream.on('error', done);
+
+    for (var i = 0; i < 40; i++) {
+      for (var j = 0; j < 100; j++) ctx.fillRect(j, i, 50, 50 + j);
+      ctx.addPage();
+    }
+    assert(chunks.length > 0);
+    assert.equal('PDF', chunks[0].slice(1, 4).toString());
+    assert.throws(function () { canvas.toBuffer(); }, /finishPDF/);
+
+    stream.on('end', function () {
+      var pdf = Buffer.concat(chunks).toString('latin1');
+      assert.equal(pdf.slice(-6).trim(), '%%EOF');
+      assert.equal(pdf.match(/\/Type \/Page\b/g).length, 40);
+      done();
+    });
+    canvas.finishPDF();
+  });
+
+  it('Canvas#toBuffer() for a PDF canvas spilled to a temp file', function (done) {
+    var canvas = new Canvas(200, 200, 'pdf', {spillThreshold: 1024})
+      , ctx = canvas.getContext('2d');
+    for (var i = 0; i < 10; i++) {
+      ctx.fillText('Page ' + i, 10, 10);
+      ctx.addPage();
+    }
+
+    var chunks = [];
+    var stream = canvas.createSyncPDFStream();
+    stream.on('data', function (chunk) {
+      chunks.push(new Buffer(chunk));
+    });
+    stream.on('end', function () {
+      var buf = canvas.toBuffer();
+      assert.equal('PDF', buf.slice(1, 4).toString());
+      assert.equal(Buffer.concat(chunks).toString('hex'), buf.toString('hex'));
+      done();
+    });
+    stream.on('error', done);
+  });
+
   it('Canvas#jpegStream()', function (done) {
     var canvas = new Canvas(640, 480);
     var stream = canvas.jpegStream();
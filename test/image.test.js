@@ -5,10 +5,13 @@
 
 var Canvas = require('../')
   , Image = Canvas.Image
-  , assert = require('assert');
+  , assert = require('assert')
+  , fs = require('fs');
 
 var png_checkers = __dirname + '/fixtures/checkers.png';
 var png_clock = __dirname + '/fixtures/clock.png';
+var jpg_face = __dirname + '/fixtures/face.jpeg';
+var gif_transparent = __dirname + '/fixtures/transparent.gif';
 
 describe('Image', function () {
   it('should require new', function () {
@@ -206,4 +209,250 @@ describe('Image', function () {
     assert.equal(img.src, png_clock + 's3');
     assert.equal(onerrorCalled, 0);
   });
+
+  it('Image#decoding async loads on the thread pool', function (done) {
+    var img = new Image
+      , onloadCalled = 0;
+
+    assert.strictEqual('sync', img.decoding);
+    img.decoding = 'async';
+    assert.strictEqual('async', img.decoding);
+
+    img.onload = function () {
+      onloadCalled += 1;
+      assert.strictEqual(true, img.complete);
+      assert.strictEqual(320, img.width);
+      assert.strictEqual(320, img.height);
+      done();
+    };
+
+    img.src = png_clock;
+    assert.strictEqual(0, onloadCalled);
+    assert.strictEqual(false, img.complete);
+  });
+
+  it('Image#decoding async from a Buffer', function (done) {
+    var img = new Image;
+    img.decoding = 'async';
+    img.onload = function () {
+      var canvas = new Canvas(img.width, img.height)
+        , ctx = canvas.getContext('2d');
+      ctx.drawImage(img, 0, 0);
+      done();
+    };
+    img.src = fs.readFileSync(png_clock);
+  });
+
+  it('Image#decoding async onerror', function (done) {
+    var img = new Image;
+    img.decoding = 'async';
+    img.onload = function () {
+      assert.fail('called onload');
+    };
+    img.onerror = function (err) {
+      assert.ok(err instanceof Error);
+      assert.strictEqual(false, img.complete);
+      done();
+    };
+    img.src = png_clock + 's';
+  });
+
+  it('Image#decoding async drops superseded loads', function (done) {
+    var img = new Image
+      , onloadCalled = 0;
+    img.decoding = 'async';
+    img.onload = function () {
+      onloadCalled += 1;
+    };
+    img.src = png_clock;
+    img.src = png_checkers;
+    img.decode().then(function () {
+      assert.strictEqual(2, img.width);
+      setTimeout(function () {
+        assert.strictEqual(1, onloadCalled);
+        done();
+      }, 50);
+    }).catch(done);
+  });
+
+  it('Image#decode()', function (done) {
+    var img = new Image;
+    img.src = png_checkers;
+    img.decode().then(function () {
+      var failed = new Image;
+      failed.decoding = 'async';
+      failed.src = png_clock + 's';
+      return failed.decode().then(function () {
+        assert.fail('resolved');
+      }, function (err) {
+        assert.ok(err instanceof Error);
+        failed.decode(function (err) {
+          assert.ok(err instanceof Error);
+          done();
+        });
+      });
+    }).catch(done);
+  });
+
+  it('Image#{maxWidth,maxHeight} decode JPEGs scaled down', function () {
+    var img = new Image;
+    assert.strictEqual(0, img.maxWidth);
+    assert.strictEqual(0, img.maxHeight);
+
+    img.src = jpg_face;
+    assert.strictEqual(485, img.width);
+    assert.strictEqual(401, img.height);
+
+    img.maxWidth = 100;
+    img.src = jpg_face;
+    assert.strictEqual(122, img.width);
+    assert.strictEqual(101, img.height);
+
+    img.maxWidth = 0;
+    img.maxHeight = 50;
+    img.src = fs.readFileSync(jpg_face);
+    assert.strictEqual(61, img.width);
+    assert.strictEqual(51, img.height);
+
+    // PNGs are not scaled
+    img.src = png_clock;
+    assert.strictEqual(320, img.width);
+  });
+
+  function pixels(img) {
+    var canvas = new Canvas(img.width, img.height);
+    canvas.getContext('2d').drawImage(img, 0, 0);
+    return canvas.toBuffer();
+  }
+
+  [png_clock, jpg_face].forEach(function (path) {
+    it('Image#createWriteStream() decodes ' + path.slice(-4) + ' chunks as written', function (done) {
+      var expected = new Image
+        , img = new Image;
+      expected.src = path;
+      img.onerror = done;
+      img.onload = function () {
+        assert.strictEqual(expected.width, img.width);
+        assert.strictEqual(expected.height, img.height);
+        assert.ok(pixels(expected).equals(pixels(img)));
+        done();
+      };
+      fs.createReadStream(path, { highWaterMark: 1000 }).pipe(img.createWriteStream());
+    });
+  });
+
+  it('Image#createWriteStream() onerror', function (done) {
+    var img = new Image
+      , stream = img.createWriteStream()
+      , data = fs.readFileSync(png_clock);
+    img.onload = function () {
+      assert.fail('loaded');
+    };
+    img.onerror = function (err) {
+      assert.ok(err instanceof Error);
+      assert.strictEqual(false, img.complete);
+      done();
+    };
+    stream.end(data.slice(0, data.length / 2));
+  });
+
+  it('Image#createWriteStream() drops superseded loads', function (done) {
+    var img = new Image
+      , onloadCalled = 0
+      , stream = img.createWriteStream();
+    img.onload = function () {
+      onloadCalled += 1;
+    };
+    stream.write(fs.readFileSync(png_clock));
+    img.src = png_checkers;
+    stream.end();
+    stream.on('finish', function () {
+      assert.strictEqual(1, onloadCalled);
+      assert.strictEqual(2, img.width);
+      done();
+    });
+  });
+
+  it('Image#frame selects the frame of an animated GIF', function (done) {
+    var canvas = new Canvas(20, 20)
+      , ctx = canvas.getContext('2d');
+    try {
+      var anim = new Canvas.AnimationEncoder(20, 20, {type: 'image/gif'});
+    } catch (err) {
+      return done();
+    }
+    ctx.fillStyle = '#f00';
+    ctx.fillRect(0, 0, 20, 20);
+    anim.addFrame(canvas, 100);
+    ctx.fillStyle = '#00f';
+    ctx.fillRect(5, 5, 5, 5);
+    anim.addFrame(canvas, 200);
+    ctx.fillStyle = '#0f0';
+    ctx.fillRect(0, 0, 3, 3);
+    anim.addFrame(canvas, 300);
+    anim.finish(function (err, buf) {
+      assert.ifError(err);
+      var img = new Image;
+      img.src = buf;
+      assert.strictEqual(3, img.frameCount);
+      assert.deepEqual([100, 200, 300], img.frameDelays);
+      assert.strictEqual(0, img.frame);
+
+      function pixel(x, y) {
+        var c = new Canvas(20, 20).getContext('2d');
+        c.drawImage(img, 0, 0);
+        return Array.prototype.slice.call(c.getImageData(x, y, 1, 1).data);
+      }
+
+      assert.deepEqual([255, 0, 0, 255], pixel(7, 7));
+      img.frame = 2;
+      assert.strictEqual(2, img.frame);
+      assert.deepEqual([0, 0, 255, 255], pixel(7, 7));
+      assert.deepEqual([0, 255, 0, 255], pixel(1, 1));
+      img.frame = 1;
+      assert.deepEqual([255, 0, 0, 255], pixel(1, 1));
+      img.frame = 0;
+      assert.deepEqual([255, 0, 0, 255], pixel(7, 7));
+
+      assert.throws(function () { img.frame = 3; }, RangeError);
+      assert.throws(function () { img.frame = 0.5; }, RangeError);
+      done();
+    });
+  });
+
+  it('Image leaves GIFs transparent whatever their background color', function () {
+    // Red background, index 0, while index 3 is transparent. The first
+    // frame covers the top left 2x2 and is cleared to the background,
+    // the second draws one blue pixel at the bottom right.
+    var img = new Image
+      , failed = false;
+    img.onerror = function () { failed = true; };
+    img.src = gif_transparent;
+    // Built without giflib
+    if (failed) return;
+    assert.strictEqual(2, img.frameCount);
+
+    function pixel(x, y) {
+      var c = new Canvas(4, 4).getContext('2d');
+      c.drawImage(img, 0, 0);
+      return Array.prototype.slice.call(c.getImageData(x, y, 1, 1).data);
+    }
+
+    assert.deepEqual([0, 255, 0, 255], pixel(0, 0));
+    assert.deepEqual([0, 0, 0, 0], pixel(1, 1));
+    assert.deepEqual([0, 0, 0, 0], pixel(3, 3));
+    img.frame = 1;
+    assert.deepEqual([0, 0, 0, 0], pixel(0, 0));
+    assert.deepEqual([0, 0, 0, 0], pixel(2, 2));
+    assert.deepEqual([0, 0, 255, 255], pixel(3, 3));
+  });
+
+  it('Image#frameCount is 1 for still images', function () {
+    var img = new Image;
+    assert.strictEqual(0, img.frameCount);
+    img.src = png_clock;
+    assert.strictEqual(1, img.frameCount);
+    assert.deepEqual([0], img.frameDelays);
+    assert.throws(function () { img.frame = 1; }, RangeError);
+  });
 });
@@ -44,6 +44,14 @@ case "$1" in
     has_system_lib "jpeg" > /dev/null
     result=$?
     ;;
+  webp)
+    has_system_lib "webp" > /dev/null
+    result=$?
+    ;;
+  libdeflate)
+    has_system_lib "deflate" > /dev/null
+    result=$?
+    ;;
   pango)
     has_pkgconfig_lib "pango" > /dev/null
     result=$?